@@ -1,4 +1,17 @@
 #define SAMPLES 0x40000000UL
+// Each in its own entry of the root of the page table
+#define TEST_ROOT_ENTRY_SHIFT GUEST_PAGE_TABLE_LEVEL_SHIFT(GUEST_PAGE_TABLE_DEFAULT_LEVELS - 1)
+#define TEST_ALIAS_ADDRESS (1UL << TEST_ROOT_ENTRY_SHIFT)
+#define TEST_ALIAS_VALUE 0x600DF00DUL
+#define TEST_LAZY_ADDRESS (2UL << TEST_ROOT_ENTRY_SHIFT)
+#define TEST_LAZY_PHYSICAL_ADDRESS (1UL << 35)
+#define TEST_LAZY_OFFSET 0x10000UL
+#define BENCHMARK_PAGE_TABLE_PHYSICAL_ADDRESS (1UL << 36)
+#define TEST_SYSTEM_CALL_GUEST 500
+#define TEST_SYSTEM_CALL_HOST 501
+#define TEST_NUMBER_OF_TASKS 8
+#define TEST_PLUGIN_ADDRESS (3UL << TEST_ROOT_ENTRY_SHIFT)
+#define TEST_SUBTREE_ADDRESS (4UL << TEST_ROOT_ENTRY_SHIFT)
 
 uint64_t prng() {
     static uint64_t seed = 0;
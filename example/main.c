@@ -5,19 +5,19 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <signal.h>
+#include <dirent.h>
 #include <sys/mman.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <rift.h>
+#include <guest.h>
 
 static uint8_t* empty_pages;
 static uint64_t used_memory;
+#undef EXPORT
+#undef EXIT
 #define EXPORT
 #define EXIT
-#ifdef __APPLE__
-#define SYMBOL_NAME_PREFIX "_"
-#else
-#define SYMBOL_NAME_PREFIX
-#endif
 #include "benchmark.h"
 #include "host_page_fault.h"
 
@@ -44,6 +44,13 @@ static uint64_t used_memory;
     destroy_vcpu(vcpu); \
 }
 
+static bool fill_test_memory(void* context, uint64_t offset, void* host_address, uint64_t length) {
+    (void)context;
+    memset(host_address, 0, length);
+    *(uint64_t*)host_address = TEST_ALIAS_VALUE ^ offset;
+    return true;
+}
+
 int main(int argc, char** argv) {
     // Configure vm and load an object file
     struct vm* vm = create_vm();
@@ -64,12 +71,390 @@ int main(int argc, char** argv) {
         case 't': {
             // Run test
             vcpu = create_vcpu_for_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "test");
-            run_vcpu(vcpu);
+            void* ptr;
+            // Aligned to the largest page size of hosts and guests, so that nothing next to it is shared too
+            uint64_t* shared_buffer = aligned_alloc(0x10000, 0x10000);
+            assert(shared_buffer);
+            *shared_buffer = 41;
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "test_shared_buffer", sizeof(uint64_t), &ptr));
+            uint64_t* shared_buffer_virtual_address = ptr;
+            share_host_buffer_with_vcpu(vcpu, shared_buffer, 0x10000, MAPPING_READABLE | MAPPING_WRITABLE, shared_buffer_virtual_address);
+            struct host_to_guest_mapping lazy_memory = {
+                .guest_address = TEST_LAZY_PHYSICAL_ADDRESS,
+                .host_address = mmap(NULL, 0x200000, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0),
+                .length = 0x200000,
+            };
+            assert(lazy_memory.host_address != MAP_FAILED);
+            map_lazy_memory_of_vm(vm, &lazy_memory, fill_test_memory, NULL);
+            map_range_of_page_table(get_page_table_of_vcpu(vcpu), TEST_LAZY_ADDRESS, TEST_LAZY_PHYSICAL_ADDRESS, lazy_memory.length, MAPPING_READABLE);
+            // Run twice, the second time from a snapshot taken before the first run
+            struct vm_snapshot* snapshot = snapshot_vm(vm, 1, &vcpu);
+            uint64_t start_timestamp, end_timestamp;
+            for(int run = 0; run < 2; ++run) {
+                if(run > 0) {
+                    restore_vm(snapshot);
+                    assert(*shared_buffer == 41);
+                    assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "test_timestamp", sizeof(uint64_t), &ptr));
+                    assert(*((uint64_t*)ptr) == 0);
+                }
+                start_timestamp = get_monotonic_time_of_vm(vm);
+                assert(run_vcpu(vcpu) == VCPU_EXIT_EXCEPTION);
+                struct interrupt_frame* frame = get_exception_frame_of_vcpu(vcpu);
+                assert(frame && frame->vector == INTERRUPT_VECTOR_INVALID_OPCODE);
+                frame->instruction_pointer += INVALID_INSTRUCTION_LENGTH;
+                assert(run_vcpu(vcpu) == VCPU_EXIT_HALT);
+                end_timestamp = get_monotonic_time_of_vm(vm);
+            }
+            destroy_vm_snapshot(snapshot);
+            // The guest removed its alias again, recreate it from the host
+            struct page_table* page_table = get_page_table_of_vcpu(vcpu);
+            uint64_t virtual_address, physical_address, alias_physical_address;
+            assert(!resolve_address_using_page_table(page_table, false, TEST_ALIAS_ADDRESS, &alias_physical_address));
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "empty_pages", &virtual_address));
+            assert(resolve_address_using_page_table(page_table, false, virtual_address, &physical_address));
+            map_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, physical_address, GUEST_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITE_COMBINING);
+            assert(resolve_address_using_page_table(page_table, false, TEST_ALIAS_ADDRESS, &alias_physical_address) && alias_physical_address == physical_address);
+            assert(!resolve_address_using_page_table(page_table, true, TEST_ALIAS_ADDRESS, &alias_physical_address));
+            // Each memory type selects its attributes in the leaf, protecting rebuilds them from the flags as well
+#ifdef __x86_64__
+            static const uint64_t memory_type_entries[] = { 0, PT_PWT, PT_PCD, PT_PCD | PT_PWT }, memory_type_mask = PT_PCD | PT_PWT;
+#elif __aarch64__
+            static const uint64_t memory_type_entries[] = { 0, PT_MEM_WT, PT_MEM_NC, PT_DEVICE }, memory_type_mask = 7UL << 2;
+#endif
+            assert((get_leaf_entry_of_page_table(page_table, TEST_ALIAS_ADDRESS) & memory_type_mask) == memory_type_entries[MAPPING_WRITE_COMBINING / MAPPING_WRITE_THROUGH]);
+            for(uint8_t memory_type = 0; memory_type <= MAPPING_UNCACHED; memory_type += MAPPING_WRITE_THROUGH) {
+                map_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, physical_address, GUEST_PAGE_SIZE, MAPPING_READABLE | memory_type);
+                assert((get_leaf_entry_of_page_table(page_table, TEST_ALIAS_ADDRESS) & memory_type_mask) == memory_type_entries[memory_type / MAPPING_WRITE_THROUGH]);
+                uint8_t protected_memory_type = (uint8_t)(MAPPING_UNCACHED - memory_type);
+                protect_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, GUEST_PAGE_SIZE, MAPPING_READABLE | protected_memory_type);
+                assert((get_leaf_entry_of_page_table(page_table, TEST_ALIAS_ADDRESS) & memory_type_mask) == memory_type_entries[protected_memory_type / MAPPING_WRITE_THROUGH]);
+            }
+            unmap_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, GUEST_PAGE_SIZE);
+            assert(!resolve_address_using_page_table(page_table, false, TEST_ALIAS_ADDRESS, &alias_physical_address));
+            // The empty pages are neighbors in host memory too, so they translate into a single piece
+            struct iovec iovecs[2];
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "empty_pages", 4 * GUEST_PAGE_SIZE, &ptr));
+            assert(translate_range_of_page_table(page_table, false, virtual_address + 8, 3 * GUEST_PAGE_SIZE, 2, iovecs) == 1);
+            assert(iovecs[0].iov_base == (uint8_t*)ptr + 8 && iovecs[0].iov_len == 3 * GUEST_PAGE_SIZE);
+            // Alias the same pages twice in a subtree, which only needs one table of pages for both, and graft it twice
+            struct guest_internal_mapping subtree_mappings[3] = {
+                { 0, physical_address, MAPPING_READABLE },
+                { GUEST_HUGE_PAGE_SIZE, physical_address, MAPPING_READABLE },
+                { 2 * GUEST_HUGE_PAGE_SIZE, 0, MAPPING_GAP },
+            };
+            struct page_table_subtree* subtree = create_page_table_subtree(vm, 1, 3, subtree_mappings);
+            assert(create_page_table_subtree(vm, 1, 3, subtree_mappings) == subtree);
+            destroy_page_table_subtree(subtree);
+            uint64_t subtree_length = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(2);
+            for(uint64_t graft = 0; graft < 2; ++graft)
+                assert(graft_subtree_into_page_table(page_table, subtree, TEST_SUBTREE_ADDRESS + graft * subtree_length));
+            assert(!graft_subtree_into_page_table(page_table, subtree, TEST_SUBTREE_ADDRESS));
+            assert(resolve_address_using_page_table(page_table, false, TEST_SUBTREE_ADDRESS + subtree_length + GUEST_HUGE_PAGE_SIZE + 8, &alias_physical_address) && alias_physical_address == physical_address + 8);
+            assert(!resolve_address_using_page_table(page_table, false, TEST_SUBTREE_ADDRESS + 2 * GUEST_HUGE_PAGE_SIZE, &alias_physical_address));
+            // The MMU walks the read only tables without having to set any bits in them
+            uint64_t load_function_address, load_address = TEST_SUBTREE_ADDRESS + subtree_length + GUEST_HUGE_PAGE_SIZE, loaded_value;
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_load", &load_function_address));
+            assert(call_guest_function(vcpu, load_function_address, 1, &load_address, &loaded_value) == VCPU_EXIT_RETURN);
+            assert(loaded_value == *(uint64_t*)ptr);
+            destroy_page_table_subtree(subtree);
+            for(uint64_t graft = 0; graft < 2; ++graft)
+                assert(prune_subtree_from_page_table(page_table, TEST_SUBTREE_ADDRESS + graft * subtree_length));
+            assert(!resolve_address_using_page_table(page_table, false, TEST_SUBTREE_ADDRESS, &alias_physical_address));
+            // Huge pages, followed by pages which start in the middle of a table and fill enough tables to be split between threads
+            uint64_t pages_address = 4 * GUEST_HUGE_PAGE_SIZE + 5 * GUEST_PAGE_SIZE, pages_length = (2UL << 20) * GUEST_PAGE_SIZE;
+            struct guest_internal_mapping huge_mappings[5] = {
+                { 0, 0, MAPPING_GAP },
+                { GUEST_HUGE_PAGE_SIZE, 16 * GUEST_HUGE_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITABLE | MAPPING_HUGE },
+                { 4 * GUEST_HUGE_PAGE_SIZE, 0, MAPPING_GAP },
+                { pages_address, 1UL << 40, MAPPING_READABLE },
+                { pages_address + pages_length, 0, MAPPING_GAP },
+            };
+            struct page_table* huge_page_table = create_page_table(vm, BENCHMARK_PAGE_TABLE_PHYSICAL_ADDRESS, 5, huge_mappings);
+            assert(resolve_address_using_page_table(huge_page_table, true, 2 * GUEST_HUGE_PAGE_SIZE + 0x12345, &alias_physical_address) && alias_physical_address == 17 * GUEST_HUGE_PAGE_SIZE + 0x12345);
+            assert(!resolve_address_using_page_table(huge_page_table, false, pages_address - 8, &alias_physical_address));
+            for(uint64_t offset = 0; offset < pages_length; offset += pages_length / 16 - 3 * GUEST_PAGE_SIZE + 8)
+                assert(resolve_address_using_page_table(huge_page_table, false, pages_address + offset, &alias_physical_address) && alias_physical_address == (1UL << 40) + offset);
+            assert(resolve_address_using_page_table(huge_page_table, false, pages_address + pages_length - 8, &alias_physical_address) && alias_physical_address == (1UL << 40) + pages_length - 8);
+            assert(!resolve_address_using_page_table(huge_page_table, false, pages_address + pages_length, &alias_physical_address));
+            // Changing a whole huge page keeps it, changing a part of one splits it
+            protect_range_of_page_table(huge_page_table, GUEST_HUGE_PAGE_SIZE, GUEST_HUGE_PAGE_SIZE, MAPPING_READABLE);
+            assert(!resolve_address_using_page_table(huge_page_table, true, GUEST_HUGE_PAGE_SIZE + 8, &alias_physical_address));
+            assert(resolve_address_using_page_table(huge_page_table, false, 2 * GUEST_HUGE_PAGE_SIZE - 8, &alias_physical_address) && alias_physical_address == 17 * GUEST_HUGE_PAGE_SIZE - 8);
+            protect_range_of_page_table(huge_page_table, 2 * GUEST_HUGE_PAGE_SIZE + GUEST_PAGE_SIZE, GUEST_PAGE_SIZE, MAPPING_READABLE);
+            assert(!resolve_address_using_page_table(huge_page_table, true, 2 * GUEST_HUGE_PAGE_SIZE + GUEST_PAGE_SIZE, &alias_physical_address));
+            assert(resolve_address_using_page_table(huge_page_table, true, 2 * GUEST_HUGE_PAGE_SIZE + 2 * GUEST_PAGE_SIZE, &alias_physical_address) && alias_physical_address == 17 * GUEST_HUGE_PAGE_SIZE + 2 * GUEST_PAGE_SIZE);
+            unmap_range_of_page_table(huge_page_table, GUEST_HUGE_PAGE_SIZE, GUEST_HUGE_PAGE_SIZE);
+            assert(!resolve_address_using_page_table(huge_page_table, false, GUEST_HUGE_PAGE_SIZE + 8, &alias_physical_address));
+            unmap_range_of_page_table(huge_page_table, 3 * GUEST_HUGE_PAGE_SIZE + GUEST_PAGE_SIZE, GUEST_PAGE_SIZE);
+            assert(!resolve_address_using_page_table(huge_page_table, false, 3 * GUEST_HUGE_PAGE_SIZE + GUEST_PAGE_SIZE, &alias_physical_address));
+            assert(resolve_address_using_page_table(huge_page_table, true, 3 * GUEST_HUGE_PAGE_SIZE, &alias_physical_address) && alias_physical_address == 18 * GUEST_HUGE_PAGE_SIZE);
+            assert(resolve_address_using_page_table(huge_page_table, true, 4 * GUEST_HUGE_PAGE_SIZE - 8, &alias_physical_address) && alias_physical_address == 19 * GUEST_HUGE_PAGE_SIZE - 8);
+            destroy_page_table(huge_page_table);
+            assert(*shared_buffer == 42);
+            unshare_host_buffer_with_vcpu(vcpu, *shared_buffer_virtual_address);
+            free(shared_buffer);
+            unmap_range_of_page_table(page_table, TEST_LAZY_ADDRESS, lazy_memory.length);
+            unmap_memory_of_vm(vm, &lazy_memory);
+            assert(munmap(lazy_memory.host_address, lazy_memory.length) == 0);
+            // Call into the guest repeatedly on the same vCPU
+            uint64_t function_address, result;
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_call", &function_address));
+            for(uint64_t call = 0; call < 2; ++call) {
+                uint64_t arguments[6] = { 1, 2, 3, 4, 5, call };
+                assert(call_guest_function(vcpu, function_address, 6, arguments, &result) == VCPU_EXIT_RETURN);
+                assert(result == 1 + 2 * 2 + 3 * 3 + 4 * 4 + 5 * 5 + call * 6 + (TEST_ALIAS_VALUE ^ TEST_LAZY_OFFSET));
+            }
+            // Let the guest start another vCPU by itself
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_start_vcpu", &function_address));
+            assert(call_guest_function(vcpu, function_address, 0, NULL, &result) == VCPU_EXIT_RETURN);
+            assert(result == 1 + 2 + 3);
+#ifndef __APPLE__
+            // Load the same plugin twice into the page table of the payload, each instance keeps its own data
+            struct loaded_object* plugins[2];
+            for(uint64_t index = 0; index < 2; ++index) {
+                plugins[index] = create_loaded_module(loaded_object, "build/guest/plugin", TEST_PLUGIN_ADDRESS + (index << 30));
+                assert(plugins[index]);
+            }
+            for(uint64_t call = 0; call < 3; ++call) {
+                uint64_t index = call % 2, argument = call + 1, counter = (call == 2) ? 1 + 3 : argument;
+                assert(resolve_symbol_virtual_address_in_loaded_object(plugins[index], "plugin_function", &function_address));
+                assert(function_address >= TEST_PLUGIN_ADDRESS + (index << 30));
+                assert(call_guest_function(vcpu, function_address, 1, &argument, &result) == VCPU_EXIT_RETURN);
+                assert(result == counter + 2 * (call / 2 + 1) + 6 * argument + 2 * (TEST_ALIAS_VALUE ^ TEST_LAZY_OFFSET));
+            }
+            assert(resolve_symbol_host_address_in_loaded_object(plugins[0], false, "plugin_counter", sizeof(uint64_t), &ptr));
+            assert(*((uint64_t*)ptr) == 1 + 3);
+            // Swap the code of the first plugin for another build, then the payload for itself, which relocates the plugins again
+            assert(!replace_code_of_loaded_object(plugins[1], "build/guest/payload"));
+            assert(!replace_code_of_loaded_object(plugins[0], "build/guest/plugin_v3"));
+            assert(replace_code_of_loaded_object(plugins[0], "build/guest/plugin_v2"));
+            assert(replace_code_of_loaded_object(loaded_object, "build/guest/payload"));
+            assert(resolve_symbol_virtual_address_in_loaded_object(plugins[0], "plugin_version", &function_address));
+            assert(call_guest_function(vcpu, function_address, 0, NULL, &result) == VCPU_EXIT_RETURN && result == 2);
+            assert(resolve_symbol_virtual_address_in_loaded_object(plugins[0], "plugin_function", &function_address));
+            uint64_t plugin_argument = 5;
+            assert(call_guest_function(vcpu, function_address, 1, &plugin_argument, &result) == VCPU_EXIT_RETURN);
+            assert(result == 1 + 3 + 5 + 2 * 3 + 6 * plugin_argument + 2 * (TEST_ALIAS_VALUE ^ TEST_LAZY_OFFSET));
+            destroy_loaded_object(plugins[1]);
+            destroy_loaded_object(plugins[0]);
+#endif
+            // Publish code generated by the host, then let the guest replace it with code of its own
+#ifdef __x86_64__
+            static const uint8_t jit_code[] = { 0x48, 0x8D, 0x47, 0x01, 0xC3 }; // lea 1(%rdi), %rax; ret
+#elif __aarch64__
+            static const uint32_t jit_code[] = { 0x91000400, 0xD65F03C0 }; // add x0, x0, #1; ret
+#endif
+            uint64_t jit_address = grow_heap_of_page_table(page_table, GUEST_HUGE_PAGE_SIZE);
+            assert(jit_address != 0);
+            protect_range_of_page_table(page_table, jit_address, GUEST_HUGE_PAGE_SIZE, MAPPING_READABLE | MAPPING_EXECUTABLE | MAPPING_WRITE_THROUGH);
+            uint64_t jit_entry = get_leaf_entry_of_page_table(page_table, jit_address);
+            assert(jit_entry == (get_leaf_entry_of_mapping(MAPPING_READABLE | MAPPING_EXECUTABLE | MAPPING_WRITE_THROUGH) | (jit_entry & GUEST_ENTRY_ADDRESS_MASK)));
+            assert(publish_code_of_page_table(page_table, jit_address, jit_code, sizeof(jit_code)));
+            // Running the code accesses its page but writes none
+            uint8_t jit_page_flags[GUEST_HUGE_PAGE_SIZE / GUEST_PAGE_SIZE], jit_page_ages[GUEST_HUGE_PAGE_SIZE / GUEST_PAGE_SIZE] = { 0 };
+            struct page_access_statistics access_statistics;
+            scan_access_of_page_table(page_table, jit_address, GUEST_HUGE_PAGE_SIZE, true, NULL, jit_page_ages, &access_statistics);
+            uint64_t jit_arguments[2] = { jit_address, 20 };
+            assert(call_guest_function(vcpu, jit_address, 1, &jit_arguments[1], &result) == VCPU_EXIT_RETURN && result == 21);
+            scan_access_of_page_table(page_table, jit_address, GUEST_HUGE_PAGE_SIZE, true, jit_page_flags, jit_page_ages, &access_statistics);
+            assert(access_statistics.number_of_mapped_pages == GUEST_HUGE_PAGE_SIZE / GUEST_PAGE_SIZE && access_statistics.number_of_dirty_pages == 0);
+            assert(jit_page_flags[0] == (PAGE_MAPPED | PAGE_ACCESSED) && jit_page_ages[0] == 0);
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_jit", &function_address));
+            assert(call_guest_function(vcpu, function_address, 2, jit_arguments, &result) == VCPU_EXIT_RETURN && result == 40);
+            // The guest wrote through its alias, the executable mapping kept its flags and memory type
+            assert(((get_leaf_entry_of_page_table(page_table, jit_address) ^ jit_entry) & ~PT_ACC) == 0);
+            assert(get_leaf_entry_of_page_table(page_table, GUEST_CODE_ALIAS_ADDRESS(GUEST_PAGE_TABLE_DEFAULT_LEVELS)) == 0);
+            assert(call_guest_function(vcpu, jit_address, 1, &jit_arguments[1], &result) == VCPU_EXIT_RETURN && result == 40);
             destroy_vcpu(vcpu);
             // Check results
-            void* ptr;
             assert(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "used_memory", sizeof(uint64_t), &ptr));
             assert(*((uint64_t*)ptr) == 0xDEADBEEF);
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "test_timestamp", sizeof(uint64_t), &ptr));
+            assert(start_timestamp <= *((uint64_t*)ptr) && *((uint64_t*)ptr) <= end_timestamp);
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "empty_pages", sizeof(uint64_t), &ptr));
+            assert(*((uint64_t*)ptr) == TEST_ALIAS_VALUE);
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "test_heap_object", sizeof(uint64_t), &ptr));
+            assert(*((uint64_t*)ptr) >= GUEST_HEAP_ADDRESS(GUEST_PAGE_TABLE_DEFAULT_LEVELS) && *((uint64_t*)ptr) < GUEST_SHARED_BUFFER_ADDRESS(GUEST_PAGE_TABLE_DEFAULT_LEVELS));
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "test_lazy_value", sizeof(uint64_t), &ptr));
+            assert(*((uint64_t*)ptr) == (TEST_ALIAS_VALUE ^ TEST_LAZY_OFFSET));
+            // Load the payload once more into a VM of its own, from a buffer this time
+            FILE* payload_file = fopen("build/guest/payload", "rb");
+            assert(payload_file && fseek(payload_file, 0, SEEK_END) == 0);
+            uint64_t payload_length = (uint64_t)ftell(payload_file);
+            uint8_t* payload_data = malloc(payload_length);
+            rewind(payload_file);
+            assert(fread(payload_data, 1, payload_length, payload_file) == payload_length && fclose(payload_file) == 0);
+            struct vm* memory_vm = create_vm();
+            struct loaded_object* memory_object = create_loaded_object_from_memory(memory_vm, payload_data, payload_length);
+            free(payload_data);
+            struct vcpu* memory_vcpu = create_vcpu_for_loaded_object(memory_object, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "test_call");
+            assert(resolve_symbol_virtual_address_in_loaded_object(memory_object, SYMBOL_NAME_PREFIX "test_call", &function_address));
+            uint64_t memory_arguments[6] = { 1, 2, 3, 4, 5, 6 };
+            assert(call_guest_function(memory_vcpu, function_address, 6, memory_arguments, &result) == VCPU_EXIT_RETURN);
+            assert(result == 1 + 2 * 2 + 3 * 3 + 4 * 4 + 5 * 5 + 6 * 6);
+            destroy_vcpu(memory_vcpu);
+            destroy_loaded_object(memory_object);
+            destroy_vm(memory_vm);
+            // Run the payload with every other depth of the page table which the vCPUs support
+            for(size_t levels = GUEST_PAGE_TABLE_MINIMUM_LEVELS - 1; levels <= GUEST_PAGE_TABLE_MAXIMUM_LEVELS + 1; ++levels) {
+                if(levels == GUEST_PAGE_TABLE_DEFAULT_LEVELS)
+                    continue;
+                struct vm* depth_vm = create_vm();
+                if(!set_page_table_levels_of_vm(depth_vm, levels)) {
+#ifdef __aarch64__
+                    assert(levels < GUEST_PAGE_TABLE_MINIMUM_LEVELS || levels > GUEST_PAGE_TABLE_MAXIMUM_LEVELS || GUEST_VIRTUAL_ADDRESS_BITS(levels) > 48);
+#endif
+                    destroy_vm(depth_vm);
+                    continue;
+                }
+                struct loaded_object* depth_object = create_loaded_object(depth_vm, "build/guest/payload");
+                struct vcpu* depth_vcpu = create_vcpu_for_loaded_object(depth_object, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "test_call");
+                assert(resolve_symbol_virtual_address_in_loaded_object(depth_object, SYMBOL_NAME_PREFIX "test_call", &function_address));
+                assert(call_guest_function(depth_vcpu, function_address, 6, memory_arguments, &result) == VCPU_EXIT_RETURN);
+                assert(result == 1 + 2 * 2 + 3 * 3 + 4 * 4 + 5 * 5 + 6 * 6);
+                // The guest walks its tables through the self map of that depth
+                struct page_table* depth_page_table = get_page_table_of_vcpu(depth_vcpu);
+                uint64_t depth_jit_address = grow_heap_of_page_table(depth_page_table, GUEST_HUGE_PAGE_SIZE);
+                assert(depth_jit_address >= GUEST_HEAP_ADDRESS(levels) && depth_jit_address < GUEST_SHARED_BUFFER_ADDRESS(levels));
+                protect_range_of_page_table(depth_page_table, depth_jit_address, GUEST_HUGE_PAGE_SIZE, MAPPING_READABLE | MAPPING_EXECUTABLE);
+                uint64_t depth_jit_arguments[2] = { depth_jit_address, 20 };
+                assert(resolve_symbol_virtual_address_in_loaded_object(depth_object, SYMBOL_NAME_PREFIX "test_jit", &function_address));
+                assert(call_guest_function(depth_vcpu, function_address, 2, depth_jit_arguments, &result) == VCPU_EXIT_RETURN && result == 40);
+                destroy_vcpu(depth_vcpu);
+                destroy_loaded_object(depth_object);
+                destroy_vm(depth_vm);
+            }
+            // The first lookup builds an image in the cache directory, the last one only maps it.
+            // In between the image is truncated and then modified, both times it has to be built again.
+            char cache_directory[] = "/tmp/rift_cache_XXXXXX";
+            assert(mkdtemp(cache_directory));
+            for(uint64_t lookup = 0; lookup < 4; ++lookup) {
+                if(lookup == 1 || lookup == 2) {
+                    DIR* cache = opendir(cache_directory);
+                    assert(cache);
+                    for(struct dirent* entry = readdir(cache); entry; entry = readdir(cache)) {
+                        if(entry->d_name[0] == '.')
+                            continue;
+                        char cache_path[sizeof(cache_directory) + 256];
+                        snprintf(cache_path, sizeof(cache_path), "%s/%s", cache_directory, entry->d_name);
+                        if(lookup == 1)
+                            assert(truncate(cache_path, 2 * sysconf(_SC_PAGESIZE)) == 0);
+                        else {
+                            // The object file follows the header page, this flips a bit of its magic
+                            FILE* file = fopen(cache_path, "r+");
+                            assert(file && fseek(file, sysconf(_SC_PAGESIZE), SEEK_SET) == 0 && fputc(0x7E, file) != EOF && fclose(file) == 0);
+                        }
+                    }
+                    assert(closedir(cache) == 0);
+                }
+                struct loaded_image* cached_image = create_loaded_image_using_cache("build/guest/payload", cache_directory);
+                struct vm* cached_vm = create_vm();
+                struct loaded_object* cached_object = create_loaded_object_from_image(cached_vm, cached_image);
+                struct vcpu* cached_vcpu = create_vcpu_for_loaded_object(cached_object, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "test_call");
+                assert(resolve_symbol_virtual_address_in_loaded_object(cached_object, SYMBOL_NAME_PREFIX "test_call", &function_address));
+                assert(!resolve_symbol_virtual_address_in_loaded_object(cached_object, SYMBOL_NAME_PREFIX "no_such_symbol", &function_address));
+                assert(call_guest_function(cached_vcpu, function_address, 6, memory_arguments, &result) == VCPU_EXIT_RETURN);
+                assert(result == 1 + 2 * 2 + 3 * 3 + 4 * 4 + 5 * 5 + 6 * 6);
+                destroy_vcpu(cached_vcpu);
+                destroy_loaded_object(cached_object);
+                destroy_vm(cached_vm);
+                destroy_loaded_image(cached_image);
+            }
+            DIR* cache = opendir(cache_directory);
+            assert(cache);
+            uint64_t number_of_cached_images = 0;
+            for(struct dirent* entry = readdir(cache); entry; entry = readdir(cache)) {
+                if(entry->d_name[0] == '.')
+                    continue;
+                char cache_path[sizeof(cache_directory) + 256];
+                snprintf(cache_path, sizeof(cache_path), "%s/%s", cache_directory, entry->d_name);
+                assert(unlink(cache_path) == 0);
+                ++number_of_cached_images;
+            }
+            assert(closedir(cache) == 0 && rmdir(cache_directory) == 0 && number_of_cached_images == 1);
+            // Instantiate a shared image in a worker process, which owns a VM of its own
+            struct loaded_image* loaded_image = create_loaded_image("build/guest/payload");
+            fflush(stdout);
+            pid_t worker = fork();
+            assert(worker >= 0);
+            if(worker == 0) {
+                struct loaded_image* worker_image = create_loaded_image_from_file_descriptor(dup(get_file_descriptor_of_loaded_image(loaded_image)));
+                struct vm* worker_vm = create_vm();
+                struct loaded_object* instance = create_loaded_object_from_image(worker_vm, worker_image);
+                vcpu = create_vcpu_for_loaded_object(instance, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "test");
+                // Without lazy memory behind it the test stops at its first access
+                assert(run_vcpu(vcpu) == VCPU_EXIT_HALT);
+                assert(resolve_symbol_host_address_in_loaded_object(instance, false, SYMBOL_NAME_PREFIX "used_memory", sizeof(uint64_t), &ptr));
+                assert(*((uint64_t*)ptr) == TEST_LAZY_ADDRESS + TEST_LAZY_OFFSET);
+                destroy_vcpu(vcpu);
+                destroy_loaded_object(instance);
+                destroy_vm(worker_vm);
+                destroy_loaded_image(worker_image);
+                exit(0);
+            }
+            int status;
+            assert(waitpid(worker, &status, 0) == worker && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            destroy_loaded_image(loaded_image);
+        } break;
+#ifndef __APPLE__
+        case 'u': {
+            // Run untrusted code in user mode, only selected system calls leave the VM
+            vcpu = create_vcpu_for_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "test_user_mode");
+            uint64_t function_address, result, argument = 20;
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_user_mode", &function_address));
+            uint64_t vcpu_exit = call_guest_function(vcpu, function_address, 1, &argument, &result);
+            while(vcpu_exit == VCPU_EXIT_SYSTEM_CALL) {
+                uint64_t system_call_arguments[6];
+                assert(get_system_call_of_vcpu(vcpu, system_call_arguments) == TEST_SYSTEM_CALL_HOST);
+                set_system_call_result_of_vcpu(vcpu, system_call_arguments[0] + 1);
+                vcpu_exit = run_vcpu(vcpu);
+            }
+            assert(vcpu_exit == VCPU_EXIT_RETURN);
+            void* ptr;
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, SYMBOL_NAME_PREFIX "test_user_result", sizeof(uint64_t), &ptr));
+            assert(*((uint64_t*)ptr) == argument * 2 + 1);
+            destroy_vcpu(vcpu);
+        } break;
+#endif
+        case 's': {
+            // Run more tasks than vCPUs and collect their results
+#if defined(__APPLE__) && defined(__x86_64__)
+            uint64_t number_of_tasks = 1;
+#else
+            create_interrupt_controller_of_vm(vm);
+            uint64_t number_of_tasks = TEST_NUMBER_OF_TASKS;
+#endif
+            void* ptr;
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "test_started_tasks", sizeof(uint64_t), &ptr));
+            uint64_t* started_tasks = ptr;
+            *started_tasks = TEST_NUMBER_OF_TASKS - number_of_tasks;
+            uint64_t function_address, id, result, collected = 0;
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_task", &function_address));
+            struct scheduler* scheduler = create_scheduler_for_loaded_object(loaded_object, 2);
+            for(id = 0; id < number_of_tasks; ++id)
+                assert(submit_task_to_scheduler(scheduler, function_address, 16 + id, id));
+            // The tasks spin until the host counts itself in, meanwhile swap the payload for the same build
+            while(__atomic_load_n(started_tasks, __ATOMIC_SEQ_CST) < TEST_NUMBER_OF_TASKS)
+                usleep(1000);
+            // Changing a present mapping kicks the spinning vCPUs out, so that they flush their TLB
+            struct page_table* page_table = get_page_table_of_loaded_object(loaded_object);
+            uint64_t virtual_address, physical_address;
+            assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "test_started_tasks", &virtual_address));
+            assert(resolve_address_using_page_table(page_table, false, virtual_address / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE, &physical_address));
+            map_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, physical_address, GUEST_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITABLE);
+            protect_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, GUEST_PAGE_SIZE, MAPPING_READABLE);
+            unmap_range_of_page_table(page_table, TEST_ALIAS_ADDRESS, GUEST_PAGE_SIZE);
+            assert(replace_code_of_loaded_object(loaded_object, "build/guest/payload"));
+            __atomic_add_fetch(started_tasks, 1, __ATOMIC_SEQ_CST);
+            while(collected < number_of_tasks) {
+                if(!collect_completed_task_of_scheduler(scheduler, &id, &result)) {
+                    usleep(1000);
+                    continue;
+                }
+                assert(id < number_of_tasks && result == (16 + id) * (17 + id) / 2);
+                ++collected;
+            }
+            destroy_scheduler(scheduler);
         } break;
         case 'b': {
             assert(argc == 4);
@@ -96,22 +481,39 @@ int main(int argc, char** argv) {
                     RUN_HOST_BENCHMARK(benchmark_linear_memory_access_pattern, MADV_SEQUENTIAL);
                     break;
                 case 5:
-                    // TODO: dirty page tracking in guest
-                    RUN_GUEST_BENCHMARK(benchmark_linear_memory_access_pattern, MADV_SEQUENTIAL);
+                    RUN_GUEST_BENCHMARK(benchmark_linear_memory_access_pattern_with_dirty_page_tracking, MADV_SEQUENTIAL);
                     break;
                 case 6:
                     register_page_fault_handler(empty_pages, used_memory);
                     RUN_HOST_BENCHMARK(benchmark_random_memory_access_pattern, MADV_RANDOM);
                     break;
                 case 7:
-                    // TODO: dirty page tracking in guest
-                    RUN_GUEST_BENCHMARK(benchmark_random_memory_access_pattern, MADV_RANDOM);
+                    RUN_GUEST_BENCHMARK(benchmark_random_memory_access_pattern_with_dirty_page_tracking, MADV_RANDOM);
                     break;
                 default:
                     assert(false);
             }
             printf("%f\n", (double)(end_time - start_time) / CLOCKS_PER_SEC);
         } break;
+        case 'p': {
+            // Build page tables of identity mappings from 1 GiB to 1 TiB, with and without huge leaves
+            for(uint64_t huge = 0; huge < 2; ++huge)
+                for(uint64_t length = 1UL << 30; length <= 1UL << 40; length *= 4) {
+                    struct guest_internal_mapping mappings[2] = {
+                        { 0, 0, (uint8_t)(MAPPING_READABLE | MAPPING_WRITABLE | (huge ? MAPPING_HUGE : 0)) },
+                        { length, 0, MAPPING_GAP },
+                    };
+                    // The VM has no clock before its first vCPU
+                    struct timespec start_time, end_time;
+                    assert(clock_gettime(CLOCK_MONOTONIC, &start_time) == 0);
+                    struct page_table* page_table = create_page_table(vm, BENCHMARK_PAGE_TABLE_PHYSICAL_ADDRESS, 2, mappings);
+                    assert(clock_gettime(CLOCK_MONOTONIC, &end_time) == 0);
+                    uint64_t number_of_entries = length / (huge ? GUEST_HUGE_PAGE_SIZE : GUEST_PAGE_SIZE);
+                    double seconds = (double)(end_time.tv_sec - start_time.tv_sec) + (double)(end_time.tv_nsec - start_time.tv_nsec) / 1000000000.0;
+                    printf("%5" PRIu64 " GiB %s: %10" PRIu64 " leaves in %f s, %.0f leaves/s\n", length >> 30, huge ? "huge" : "page", number_of_entries, seconds, (double)number_of_entries / seconds);
+                    destroy_page_table(page_table);
+                }
+        } break;
     }
 
     destroy_loaded_object(loaded_object);
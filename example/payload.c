@@ -1,18 +1,164 @@
 #include <guest.h>
 
-EXPORT ALIGN(0x4000) uint8_t empty_pages[0x10000000UL];
+// Larger translation granules need larger alignment
+#define PAYLOAD_PAGE_SIZE (GUEST_PAGE_SIZE > 0x4000 ? GUEST_PAGE_SIZE : 0x4000)
+
+EXPORT ALIGN(PAYLOAD_PAGE_SIZE) uint8_t empty_pages[0x10000000UL];
 EXPORT uint64_t used_memory = 0x40000000UL;
+EXPORT uint64_t test_timestamp = 0;
+EXPORT uint64_t* test_shared_buffer = NULL;
+EXPORT uint64_t test_heap_object = 0;
+EXPORT uint64_t test_lazy_value = 0;
 
 #include "benchmark.h"
 
-void page_fault_handler(uint64_t fault_instruction_pointer, uint64_t fault_access_address, uint64_t fault_code) {
-    (void)fault_instruction_pointer;
-    (void)fault_code;
-    used_memory = fault_access_address;
+EXPORT uint64_t number_of_written_pages = 0;
+EXPORT uint64_t written_pages[sizeof(empty_pages) / GUEST_PAGE_SIZE];
+
+struct interrupt_frame* page_fault_handler(struct interrupt_frame* frame) {
+    if(IS_WRITE_PROTECTION_FAULT(frame->error_code) && frame->fault_address - (uint64_t)empty_pages < sizeof(empty_pages)) {
+        // Dirty page tracking: Log the page and let the write through from now on
+        set_page_writable(frame->fault_address, true);
+        written_pages[number_of_written_pages++] = frame->fault_address / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+        return frame;
+    }
+    used_memory = frame->fault_address;
     EXIT
+    return frame;
 }
 
 EXPORT void test() {
+    test_timestamp = get_monotonic_time();
+    register_interrupt_handler(INTERRUPT_VECTOR_PAGE_FAULT, page_fault_handler);
+    // Alias the first empty page at an address which needs new intermediate tables
+    uint64_t physical_address;
+    if(translate_address((uint64_t)empty_pages, &physical_address) &&
+       map_range(TEST_ALIAS_ADDRESS, physical_address, GUEST_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITABLE)) {
+        *(volatile uint64_t*)TEST_ALIAS_ADDRESS = TEST_ALIAS_VALUE;
+        unmap_range(TEST_ALIAS_ADDRESS, GUEST_PAGE_SIZE);
+    }
+    // Zero copy access to host memory
+    if(test_shared_buffer)
+        *test_shared_buffer += 1;
+    // Host memory which is only filled on first touch
+    test_lazy_value = *(volatile uint64_t*)(TEST_LAZY_ADDRESS + TEST_LAZY_OFFSET);
+    // Freed objects are reused by the same vCPU, large ones come from their own pages
+    static struct heap_cache heap_cache;
+    uint64_t* object = allocate_memory(&heap_cache, 24);
+    free_memory(&heap_cache, object, 24);
+    uint8_t* large_object = allocate_memory(&heap_cache, 0x400000);
+    if(object && object == allocate_memory(&heap_cache, 32) && large_object) {
+        large_object[0x3FFFFF] = 1;
+        // Freeing a huge object returns its memory to the host, so it reads zeros afterwards
+        large_object[0x1000] = 1;
+        free_memory(&heap_cache, large_object, 0x400000);
+        if(large_object == allocate_memory(&heap_cache, 0x400000) && large_object[0x1000] == 0)
+            test_heap_object = (uint64_t)object;
+    }
+    // Unhandled, the host skips it
+    INVALID_INSTRUCTION
     ((uint8_t*)0xDEADBEEF)[0] = 0;
     EXIT
 }
+
+EXPORT uint64_t test_load(uint64_t address) {
+    return *(volatile uint64_t*)address;
+}
+
+EXPORT uint64_t test_call(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f) {
+    return a + b * 2 + c * 3 + d * 4 + e * 5 + f * 6 + test_lazy_value;
+}
+
+EXPORT uint64_t test_secondary_sum = 0;
+
+uint64_t add_on_secondary_vcpu(uint64_t context) {
+    return __atomic_add_fetch(&test_secondary_sum, context, __ATOMIC_SEQ_CST);
+}
+
+// Starts the same secondary vCPU repeatedly, each start has to wait for the previous one to finish
+EXPORT uint64_t test_start_vcpu() {
+    if(start_vcpu(NUMBER_OF_STARTABLE_VCPUS, (uint64_t)add_on_secondary_vcpu, 0) != PSCI_INVALID_PARAMETERS)
+        return 0;
+    for(uint64_t start = 1; start <= 3; ++start) {
+        int64_t result;
+        while((result = start_vcpu(1, (uint64_t)add_on_secondary_vcpu, start)) == PSCI_ALREADY_ON);
+        if(result != PSCI_SUCCESS)
+            return 0;
+        while(__atomic_load_n(&test_secondary_sum, __ATOMIC_SEQ_CST) < start * (start + 1) / 2);
+    }
+    return test_secondary_sum;
+}
+
+// Replaces the code at code_address by one which doubles its argument and runs it
+EXPORT uint64_t test_jit(uint64_t code_address, uint64_t argument) {
+#ifdef __x86_64__
+    static const uint8_t code[] = { 0x48, 0x8D, 0x04, 0x3F, 0xC3 }; // lea (%rdi,%rdi), %rax; ret
+#elif __aarch64__
+    static const uint32_t code[] = { 0xD37FF800, 0xD65F03C0 }; // lsl x0, x0, #1; ret
+#endif
+    if(!publish_code(code_address, code, sizeof(code)))
+        return 0;
+    return ((uint64_t (*)(uint64_t))code_address)(argument);
+}
+
+#ifndef __APPLE__
+extern uint8_t user_text_start[], user_text_end[];
+ALIGN(PAYLOAD_PAGE_SIZE) uint8_t user_stack[PAYLOAD_PAGE_SIZE];
+EXPORT uint64_t test_user_result = 0;
+
+// Runs in user mode, so it may only touch its own text and stack
+__attribute__((section(".user_text"))) void user_main(uint64_t argument) {
+    uint64_t result = system_call(TEST_SYSTEM_CALL_GUEST, argument, 0, 0);
+    result = system_call(TEST_SYSTEM_CALL_HOST, result, 0, 0);
+    system_call(SYSTEM_CALL_EXIT, result, 0, 0);
+}
+
+uint64_t double_system_call(uint64_t number, uint64_t arguments[6]) {
+    (void)number;
+    return arguments[0] * 2;
+}
+
+EXPORT void test_user_mode(uint64_t argument) {
+    initialize_user_mode();
+    if(register_system_call_handler(TEST_SYSTEM_CALL_GUEST, double_system_call) &&
+       !register_system_call_handler(NUMBER_OF_SYSTEM_CALLS, double_system_call) &&
+       forward_system_call_to_host(TEST_SYSTEM_CALL_HOST) &&
+       protect_range((uint64_t)user_text_start, (uint64_t)(user_text_end - user_text_start), MAPPING_READABLE | MAPPING_EXECUTABLE | MAPPING_USER) &&
+       protect_range((uint64_t)user_stack, sizeof(user_stack), MAPPING_READABLE | MAPPING_WRITABLE | MAPPING_USER))
+        test_user_result = run_in_user_mode((uint64_t)user_main, (uint64_t)&user_stack[sizeof(user_stack)], argument);
+}
+#endif
+
+EXPORT uint64_t test_started_tasks = 0;
+
+static uint64_t sum_recursively(volatile uint8_t* previous, uint64_t depth) {
+    // Every level occupies roughly a page of the task stack
+    volatile uint8_t frame[GUEST_PAGE_SIZE - 64];
+    frame[0] = (uint8_t)depth;
+    frame[sizeof(frame) - 1] = previous ? previous[0] : 0;
+    return depth == 0 ? frame[0] : frame[0] + sum_recursively(frame, depth - 1);
+}
+
+// Tasks only finish once all of them started, which needs preemption with more tasks than vCPUs, and the host counted itself in
+EXPORT uint64_t test_task(uint64_t argument) {
+    yield_task();
+    __atomic_add_fetch(&test_started_tasks, 1, __ATOMIC_SEQ_CST);
+    while(__atomic_load_n(&test_started_tasks, __ATOMIC_SEQ_CST) <= TEST_NUMBER_OF_TASKS);
+    return sum_recursively(NULL, argument);
+}
+
+void start_dirty_page_tracking() {
+    register_interrupt_handler(INTERRUPT_VECTOR_PAGE_FAULT, page_fault_handler);
+    for(uint64_t offset = 0; offset < used_memory && offset < sizeof(empty_pages); offset += GUEST_PAGE_SIZE)
+        set_page_writable((uint64_t)&empty_pages[offset], false);
+}
+
+EXPORT void benchmark_linear_memory_access_pattern_with_dirty_page_tracking() {
+    start_dirty_page_tracking();
+    benchmark_linear_memory_access_pattern();
+}
+
+EXPORT void benchmark_random_memory_access_pattern_with_dirty_page_tracking() {
+    start_dirty_page_tracking();
+    benchmark_random_memory_access_pattern();
+}
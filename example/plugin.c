@@ -0,0 +1,33 @@
+#include <guest.h>
+
+// Another build with a different version replaces the code of a loaded instance
+#ifndef PLUGIN_VERSION
+#define PLUGIN_VERSION 1
+#endif
+
+// Provided by the runtime (payload) this plugin is loaded into
+EXPORT uint64_t test_call(uint64_t a, uint64_t b, uint64_t c, uint64_t d, uint64_t e, uint64_t f);
+
+EXPORT uint64_t plugin_counter = 0;
+static uint64_t number_of_calls = 0;
+// Volatile keeps the compiler from folding these, so that they need relocations
+static uint64_t* volatile counter_pointer = &plugin_counter;
+static uint64_t* volatile number_of_calls_pointer = &number_of_calls;
+static uint64_t (*volatile runtime_function)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t, uint64_t) = test_call;
+
+#if PLUGIN_VERSION >= 3
+// Moves the functions behind it, so this build can not replace a loaded instance
+EXPORT uint64_t plugin_helper(uint64_t argument) {
+    return argument * PLUGIN_VERSION + 1;
+}
+#endif
+
+EXPORT uint64_t plugin_function(uint64_t argument) {
+    *counter_pointer += argument;
+    ++*number_of_calls_pointer;
+    return runtime_function(plugin_counter, number_of_calls, 0, 0, 0, 0) + test_call(0, 0, 0, 0, 0, argument);
+}
+
+EXPORT uint64_t plugin_version(void) {
+    return PLUGIN_VERSION;
+}
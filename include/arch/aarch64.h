@@ -4,18 +4,26 @@
 #define PT_PRE           (1UL << 0)   // present / valid
 #define PT_NOT_LEAF      (1UL << 1)   // table not a block
 #define PT_MEM           (0UL << 2)   // attribute index: normal memory
+#define PT_MEM_WT        (1UL << 2)   // attribute index: normal memory, write-through
+#define PT_MEM_NC        (2UL << 2)   // attribute index: normal memory, non-cacheable
+#define PT_DEVICE        (3UL << 2)   // attribute index: device memory
 #define PT_USER          (1UL << 6)   // unprivileged
 #define PT_RO            (1UL << 7)   // read-only
 #define PT_OSH           (2UL << 8)   // outter shareable
 #define PT_ISH           (3UL << 8)   // inner shareable
 #define PT_ACC           (1UL << 10)  // accessed flag
 #define PT_NG            (1UL << 11)  // remove from TLB on context switch
+#define PT_DBM           (1UL << 51)  // dirty bit modifier: the MMU clears PT_RO on write
 #define PT_CONT          (1UL << 52)  // contiguous
 #define PT_PNX           (1UL << 53)  // no execute (privileged)
 #define PT_NX            (1UL << 54)  // no execute
+#define PT_TABLE_NO_EL0  (1UL << 61)  // APTable: no unprivileged access below
+#define PT_BRANCH        (PT_ISH | PT_ACC | PT_NOT_LEAF | PT_PRE)
+#define PT_SELF_MAP      (PT_BRANCH | PT_TABLE_NO_EL0)
 
 // MSRs
 #define ID_AA64MMFR0_EL1 0xC038
+#define ID_AA64MMFR1_EL1 0xC039
 #define SCTLR_EL1        0xC080
 #define TTBR0_EL1        0xC100
 #define TTBR1_EL1        0xC101
@@ -23,5 +31,118 @@
 #define MAIR_EL1         0xC510
 #define VBAR_EL1         0xC600
 
+// PSTATE bits
+#define PSTATE_I         (1UL << 7)   // IRQs masked
+
+// Interrupt vectors: exception classes of synchronous exceptions followed by IRQ, FIQ and SError
+#define NUMBER_OF_INTERRUPT_VECTORS         0x43
+#define INTERRUPT_VECTOR_INVALID_OPCODE     0x00
+#define INTERRUPT_VECTOR_SUPERVISOR_CALL    0x15
+#define INTERRUPT_VECTOR_INSTRUCTION_ABORT  0x21
+#define INTERRUPT_VECTOR_PC_ALIGNMENT       0x22
+#define INTERRUPT_VECTOR_PAGE_FAULT         0x25
+#define INTERRUPT_VECTOR_SP_ALIGNMENT       0x26
+#define INTERRUPT_VECTOR_BREAK_POINT        0x3C
+#define INTERRUPT_VECTOR_IRQ                0x40
+#define INTERRUPT_VECTOR_FIQ                0x41
+#define INTERRUPT_VECTOR_SERROR             0x42
+#define INTERRUPT_VECTOR_TIMER              INTERRUPT_VECTOR_IRQ
+
+#define IS_WRITE_PROTECTION_FAULT(error_code) (((error_code) & (1UL << 6)) != 0 && ((error_code) & 0x3C) == 0x0C)
+
+struct interrupt_frame {
+    uint64_t x[31];
+    uint64_t stack_pointer;
+    uint64_t instruction_pointer; // ELR_EL1
+    uint64_t flags; // SPSR_EL1
+    uint64_t vector;
+    uint64_t error_code; // ESR_EL1
+    uint64_t fault_address; // FAR_EL1
+    uint64_t padding;
+};
+
+// Hypercalls are SMCCC fast calls in the OEM service range, the function id goes in x0 and the arguments in x1, x2, x3
+#define HYPERCALL_FUNCTION_ID 0xC3000000UL
+#define HYPERCALL_REGISTERS { 0, 1, 2, 3 }
+// Forwarded to the host as well, which passes target, entry point and context on like a hypercall
+#define PSCI_CPU_ON 0xC4000003UL
+// AAPCS64: x0 to x7
+#define ARGUMENT_REGISTERS { 0, 1, 2, 3, 4, 5, 6, 7 }
+
+static inline uint64_t smccc_call(uint64_t function_id, uint64_t argument0, uint64_t argument1, uint64_t argument2) {
+    register uint64_t x0 __asm__("x0") = function_id;
+    register uint64_t x1 __asm__("x1") = argument0;
+    register uint64_t x2 __asm__("x2") = argument1;
+    register uint64_t x3 __asm__("x3") = argument2;
+    __asm__ volatile("hvc #0\n" : "+r"(x0) : "r"(x1), "r"(x2), "r"(x3) : "memory");
+    return x0;
+}
+
+static inline uint64_t hypercall(uint64_t number, uint64_t argument0, uint64_t argument1, uint64_t argument2) {
+    return smccc_call(HYPERCALL_FUNCTION_ID | number, argument0, argument1, argument2);
+}
+
 #define EXIT __asm__("ldr x0, #8\nhvc #0\n.long 0x84000008\n");
 #define BREAK_POINT __asm__(".inst 0xD4200000\n");
+#define INVALID_INSTRUCTION __asm__("udf #0\n");
+#define INVALID_INSTRUCTION_LENGTH 4
+
+static inline uint64_t read_counter() {
+    uint64_t value;
+    __asm__ volatile("isb\nmrs %0, CNTVCT_EL0\n" : "=r"(value));
+    return value;
+}
+
+static inline void enable_interrupts() {
+    __asm__ volatile("msr DAIFClr, #2\n" : : : "memory");
+}
+
+static inline void disable_interrupts() {
+    __asm__ volatile("msr DAIFSet, #2\n" : : : "memory");
+}
+
+static inline bool are_interrupts_enabled() {
+    uint64_t flags;
+    __asm__ volatile("mrs %0, DAIF\n" : "=r"(flags) : : "memory");
+    return (flags & PSTATE_I) == 0;
+}
+
+// A pending interrupt ends WFI even while it is masked, it is then taken once unmasked
+static inline void wait_for_interrupt() {
+    __asm__ volatile("wfi\nmsr DAIFClr, #2\nisb\nmsr DAIFSet, #2\n" : : : "memory");
+}
+
+// System calls follow the Linux convention: the number goes in x8, the arguments in x0 to x5 and the result in x0
+#define SYSTEM_CALL_NUMBER(frame) ((frame)->x[8])
+#define SYSTEM_CALL_ARGUMENTS(frame) { (frame)->x[0], (frame)->x[1], (frame)->x[2], (frame)->x[3], (frame)->x[4], (frame)->x[5] }
+#define SYSTEM_CALL_RESULT(frame) ((frame)->x[0])
+
+static inline uint64_t system_call(uint64_t number, uint64_t argument0, uint64_t argument1, uint64_t argument2) {
+    register uint64_t x8 __asm__("x8") = number;
+    register uint64_t x0 __asm__("x0") = argument0;
+    register uint64_t x1 __asm__("x1") = argument1;
+    register uint64_t x2 __asm__("x2") = argument2;
+    __asm__ volatile("svc #0\n" : "+r"(x0) : "r"(x8), "r"(x1), "r"(x2) : "memory");
+    return x0;
+}
+
+static inline void invalidate_tlb_entry(uint64_t virtual_address) {
+    __asm__ volatile("dsb ishst\ntlbi vaae1, %0\ndsb nsh\nisb\n" : : "r"(virtual_address >> 12) : "memory");
+}
+
+static inline void flush_tlb() {
+    __asm__ volatile("dsb ishst\ntlbi vmalle1\ndsb nsh\nisb\n" : : : "memory");
+}
+
+// Makes stores to code visible to instruction fetches of all vCPUs, the others still need a context synchronization event
+static inline void synchronize_instruction_cache(uint64_t virtual_address, uint64_t length) {
+    uint64_t cache_type;
+    __asm__ volatile("mrs %0, CTR_EL0\n" : "=r"(cache_type));
+    uint64_t data_line_size = 4UL << ((cache_type >> 16) & 0xF), instruction_line_size = 4UL << (cache_type & 0xF);
+    for(uint64_t line = virtual_address & ~(data_line_size - 1); line < virtual_address + length; line += data_line_size)
+        __asm__ volatile("dc cvau, %0\n" : : "r"(line) : "memory");
+    __asm__ volatile("dsb ish\n" : : : "memory");
+    for(uint64_t line = virtual_address & ~(instruction_line_size - 1); line < virtual_address + length; line += instruction_line_size)
+        __asm__ volatile("ic ivau, %0\n" : : "r"(line) : "memory");
+    __asm__ volatile("dsb ish\nisb\n" : : : "memory");
+}
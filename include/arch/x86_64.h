@@ -4,11 +4,19 @@
 #define PT_PRE           (1UL << 0)   // present / valid
 #define PT_RW            (1UL << 1)   // read-write
 #define PT_USER          (1UL << 2)   // unprivileged
+#define PT_PWT           (1UL << 3)   // page attribute table index bit 0
+#define PT_PCD           (1UL << 4)   // page attribute table index bit 1
 #define PT_ACC           (1UL << 5)   // accessed flag
 #define PT_DIRTY         (1UL << 6)   // write accessed flag
 #define PT_LEAF          (1UL << 7)   // block not a table
 #define PT_G             (1UL << 8)   // keep in TLB on context switch
 #define PT_NX            (1UL << 63)  // no execute
+// Intermediate levels allow everything, leaves decide. The self map is only reachable from the supervisor.
+#define PT_BRANCH        (PT_PRE | PT_RW | PT_USER)
+#define PT_SELF_MAP      (PT_PRE | PT_RW)
+
+// Page attribute table: PWT and PCD select write-back, write-through, write-combining or uncached
+#define PAT_MEMORY_TYPES 0x0007040600010406UL
 
 // CR0 bits
 #define CR0_PE           (1U << 0)
@@ -16,14 +24,139 @@
 #define CR0_WP           (1U << 16)
 #define CR0_PG           (1U << 31)
 
+// CR3 bits
+#define CR3_PWT          (1U << 3)
+
 // CR4 bits
 #define CR4_PAE          (1U << 5)
+#define CR4_LA57         (1U << 12)
 #define CR4_VMXE         (1U << 13)
 
+// CPUID bits
+#define CPUID_7_ECX_LA57 (1U << 16)
+
+// MSRs
+#define MSR_IA32_TSC     0x10
+#define MSR_IA32_PAT     0x277
+#define MSR_STAR         0xC0000081
+#define MSR_LSTAR        0xC0000082
+#define MSR_SFMASK       0xC0000084
+#define MSR_GS_BASE      0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
 // EFER bits
+#define EFER_SCE         (1U << 0)
 #define EFER_LME         (1U << 8)
 #define EFER_LMA         (1U << 10)
 #define EFER_NXE         (1U << 11)
 
+// RFLAGS bits
+#define RFLAGS_IF        (1UL << 9)
+
+// Interrupt vectors
+#define NUMBER_OF_INTERRUPT_VECTORS         256
+#define INTERRUPT_VECTOR_DIVIDE_ERROR       0
+#define INTERRUPT_VECTOR_BREAK_POINT        3
+#define INTERRUPT_VECTOR_INVALID_OPCODE     6
+#define INTERRUPT_VECTOR_GENERAL_PROTECTION 13
+#define INTERRUPT_VECTOR_PAGE_FAULT         14
+#define INTERRUPT_VECTOR_ALIGNMENT_CHECK    17
+#define INTERRUPT_VECTOR_TIMER              32
+
+#define IS_WRITE_PROTECTION_FAULT(error_code) (((error_code) & 3) == 3)
+
+struct interrupt_frame {
+    uint64_t fault_address; // CR2
+    uint64_t rax, rbx, rcx, rdx, rsi, rdi, rbp, r8, r9, r10, r11, r12, r13, r14, r15;
+    uint64_t vector;
+    uint64_t error_code;
+    uint64_t instruction_pointer;
+    uint64_t code_segment;
+    uint64_t flags;
+    uint64_t stack_pointer;
+    uint64_t stack_segment;
+};
+
+// Interrupts from user mode switch to rsp0, vectors with an IST index always switch to that stack
+struct task_state_segment {
+    uint32_t reserved0;
+    uint64_t stack_pointers[3];
+    uint64_t reserved1;
+    uint64_t interrupt_stack_table[7];
+    uint64_t reserved2;
+    uint16_t reserved3;
+    uint16_t io_map_base;
+} __attribute__((packed));
+
+// Hypercalls leave the VM through an I/O port, the number goes in rax and the arguments in rdi, rsi, rdx
+#define HYPERCALL_PORT 0xE9
+#define HYPERCALL_REGISTERS { 0, 5, 4, 3 }
+// System V calling convention: rdi, rsi, rdx, rcx, r8, r9
+#define ARGUMENT_REGISTERS { 5, 4, 3, 2, 8, 9 }
+
+static inline uint64_t hypercall(uint64_t number, uint64_t argument0, uint64_t argument1, uint64_t argument2) {
+    uint64_t result = number;
+    __asm__ volatile("outl %%eax, %1\n" : "+a"(result) : "i"(HYPERCALL_PORT), "D"(argument0), "S"(argument1), "d"(argument2) : "memory");
+    return result;
+}
+
 #define EXIT __asm__("hlt\n");
 #define BREAK_POINT __asm__("int $3\n");
+#define INVALID_INSTRUCTION __asm__("ud2\n");
+#define INVALID_INSTRUCTION_LENGTH 2
+
+static inline uint64_t read_counter() {
+    uint32_t low, high;
+    __asm__ volatile("rdtsc\n" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline void enable_interrupts() {
+    __asm__ volatile("sti\n" : : : "memory");
+}
+
+static inline void disable_interrupts() {
+    __asm__ volatile("cli\n" : : : "memory");
+}
+
+static inline bool are_interrupts_enabled() {
+    uint64_t flags;
+    __asm__ volatile("pushfq\npopq %0\n" : "=r"(flags) : : "memory");
+    return (flags & RFLAGS_IF) != 0;
+}
+
+// STI only takes effect after the next instruction, so no interrupt is lost between the two
+static inline void wait_for_interrupt() {
+    __asm__ volatile("sti\nhlt\ncli\n" : : : "memory");
+}
+
+static inline void write_msr(uint32_t index, uint64_t value) {
+    __asm__ volatile("wrmsr\n" : : "c"(index), "a"((uint32_t)value), "d"((uint32_t)(value >> 32)));
+}
+
+// System calls follow the Linux convention: the number goes in rax, the arguments in rdi, rsi, rdx, r10, r8, r9 and the result in rax
+#define SYSTEM_CALL_NUMBER(frame) ((frame)->rax)
+#define SYSTEM_CALL_ARGUMENTS(frame) { (frame)->rdi, (frame)->rsi, (frame)->rdx, (frame)->r10, (frame)->r8, (frame)->r9 }
+#define SYSTEM_CALL_RESULT(frame) ((frame)->rax)
+
+static inline uint64_t system_call(uint64_t number, uint64_t argument0, uint64_t argument1, uint64_t argument2) {
+    uint64_t result = number;
+    __asm__ volatile("syscall\n" : "+a"(result) : "D"(argument0), "S"(argument1), "d"(argument2) : "rcx", "r11", "memory");
+    return result;
+}
+
+static inline void invalidate_tlb_entry(uint64_t virtual_address) {
+    __asm__ volatile("invlpg (%0)\n" : : "r"(virtual_address) : "memory");
+}
+
+static inline void flush_tlb() {
+    uint64_t cr3;
+    __asm__ volatile("movq %%cr3, %0\nmovq %0, %%cr3\n" : "=r"(cr3) : : "memory");
+}
+
+// Instruction fetches snoop stores to code, only the compiler has to keep them in order
+static inline void synchronize_instruction_cache(uint64_t virtual_address, uint64_t length) {
+    (void)virtual_address;
+    (void)length;
+    __asm__ volatile("" : : : "memory");
+}
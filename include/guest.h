@@ -3,6 +3,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "mapping.h"
 
 #ifdef __APPLE__
 #define SYMBOL_NAME_PREFIX "_"
@@ -12,19 +13,195 @@
 
 #define EXPORT __attribute__((visibility("default")))
 #define ALIGN(bytes) __attribute__((aligned(bytes)))
+#define STRINGIFY(value) #value
+#define EXPAND_AND_STRINGIFY(value) STRINGIFY(value)
 
 #ifdef __x86_64__
 #include "arch/x86_64.h"
 #elif __aarch64__
 #include "arch/aarch64.h"
 #endif
+// EXIT returns VCPU_EXIT_HALT to the host. On x86 it is a hlt, which the kernel handles itself once
+// create_interrupt_controller_of_vm was called, so the vCPU sleeps until an interrupt instead.
 
-#define GUEST_PAGE_TABLE_LEVELS 4
-#define GUEST_HUGE_PAGE_TABLE_LEVELS 0
+// Translation granule, AArch64 also offers 16 KiB (14) and 64 KiB (16) pages, e.g. make GUEST_PAGE_SHIFT=14
+#ifndef GUEST_PAGE_SHIFT
+#define GUEST_PAGE_SHIFT 12
+#endif
+#if GUEST_PAGE_SHIFT == 12
+// 3 levels cover 512 GiB, 4 levels 256 TiB and 5 levels 128 PiB of virtual address space
+#define GUEST_PAGE_TABLE_MINIMUM_LEVELS 3
+#define GUEST_PAGE_TABLE_DEFAULT_LEVELS 4
+#define GUEST_PAGE_TABLE_MAXIMUM_LEVELS 5
+#elif GUEST_PAGE_SHIFT == 14 && defined(__aarch64__)
+// 2 levels cover 64 GiB and 3 levels 128 TiB
+#define GUEST_PAGE_TABLE_MINIMUM_LEVELS 2
+#define GUEST_PAGE_TABLE_DEFAULT_LEVELS 3
+#define GUEST_PAGE_TABLE_MAXIMUM_LEVELS 3
+#elif GUEST_PAGE_SHIFT == 16 && defined(__aarch64__)
+// 2 levels cover 4 TiB
+#define GUEST_PAGE_TABLE_MINIMUM_LEVELS 2
+#define GUEST_PAGE_TABLE_DEFAULT_LEVELS 2
+#define GUEST_PAGE_TABLE_MAXIMUM_LEVELS 2
+#else
+#error Unsupported translation granule
+#endif
+#define GUEST_HUGE_PAGE_TABLE_LEVELS 1 // of mappings with MAPPING_HUGE
 #define GUEST_PAGE_TABLE_ENTRY_SHIFT 3
-#define GUEST_ENTRIES_PER_PAGE_SHIFT 9
+#define GUEST_ENTRIES_PER_PAGE_SHIFT (GUEST_PAGE_SHIFT - GUEST_PAGE_TABLE_ENTRY_SHIFT)
 #define GUEST_ENTRIES_PER_PAGE (1UL << GUEST_ENTRIES_PER_PAGE_SHIFT)
 #define GUEST_PAGE_SIZE (1UL << (GUEST_ENTRIES_PER_PAGE_SHIFT + GUEST_PAGE_TABLE_ENTRY_SHIFT))
+#define GUEST_HUGE_PAGE_SIZE (GUEST_PAGE_SIZE << GUEST_ENTRIES_PER_PAGE_SHIFT)
 #define GUEST_ENTRY_ADDRESS_MASK (~((0xFFFFUL << 48) | (GUEST_PAGE_SIZE - 1)))
+#define GUEST_PAGE_TABLE_SELF_MAP_INDEX 255UL
+// The layout of the address space scales with the depth of the page table
+#define GUEST_VIRTUAL_ADDRESS_BITS(levels) (GUEST_ENTRIES_PER_PAGE_SHIFT * (levels) + GUEST_ENTRIES_PER_PAGE_SHIFT + GUEST_PAGE_TABLE_ENTRY_SHIFT)
+#define GUEST_PAGE_TABLE_SELF_MAP_ADDRESS(levels) (GUEST_PAGE_TABLE_SELF_MAP_INDEX << (GUEST_ENTRIES_PER_PAGE_SHIFT * (levels) + GUEST_PAGE_TABLE_ENTRY_SHIFT))
+#define GUEST_SHARED_BUFFER_ADDRESS(levels) (GUEST_PAGE_TABLE_SELF_MAP_ADDRESS(levels) / 2)
+#define GUEST_HEAP_ADDRESS(levels) (GUEST_SHARED_BUFFER_ADDRESS(levels) / 2)
+// The last page below the self map, publish_code writes through it so that executable mappings never change
+#define GUEST_CODE_ALIAS_ADDRESS(levels) (GUEST_PAGE_TABLE_SELF_MAP_ADDRESS(levels) - GUEST_PAGE_SIZE)
+
+#define GUEST_PAGE_TABLE_LEVEL_SHIFT(level) (GUEST_ENTRIES_PER_PAGE_SHIFT * (level) + GUEST_ENTRIES_PER_PAGE_SHIFT + GUEST_PAGE_TABLE_ENTRY_SHIFT)
+
+// Lets the host and the guest run the same page table code on their respective view of the tables
+struct page_table_access {
+    uint64_t root;
+    size_t levels;
+    void* context;
+    // Returns the table at the given physical address which covers virtual_address at the given level
+    uint64_t* (*resolve_table)(void* context, uint64_t physical_address, uint64_t virtual_address, size_t level);
+    // Returns an already zeroed table page or NULL if the pool is exhausted
+    uint64_t* (*allocate_table)(void* context, uint64_t* physical_address);
+    // Set when a present entry was modified, the owner has to invalidate the TLB and clear it
+    bool tlb_is_stale;
+};
+
+bool walk_page_table(struct page_table_access* access, bool write_access, uint64_t virtual_address, uint64_t* physical_address);
+uint64_t get_leaf_entry_of_mapping(uint8_t flags);
+// Returns the present entry which maps virtual_address, possibly a huge one, or NULL
+uint64_t* find_leaf_entry_in_page_table(struct page_table_access* access, uint64_t virtual_address);
+bool write_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t physical_address, uint64_t length, uint8_t flags);
+bool clear_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length);
+bool protect_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length, uint8_t flags);
+// Makes a table of the given level cover virtual_address, the entry pointing to it has to be empty before
+bool link_table_into_page_table(struct page_table_access* access, uint64_t virtual_address, size_t level, uint64_t table_physical_address);
+bool unlink_table_from_page_table(struct page_table_access* access, uint64_t virtual_address, size_t level);
+// Stores PAGE_MAPPED, PAGE_ACCESSED and PAGE_DIRTY of every page in the range and clears those of clear_flags in the leaves
+void harvest_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length, uint8_t clear_flags, uint8_t page_flags[]);
+
+// Depth of the page table the guest runs on, the host sets it when it creates a vCPU for a loaded object
+size_t get_page_table_levels();
+uint64_t* get_page_table_entry(uint64_t virtual_address, size_t level);
+uint64_t* find_page_table_entry(uint64_t virtual_address);
+bool set_page_writable(uint64_t virtual_address, bool writable);
+bool translate_address(uint64_t virtual_address, uint64_t* physical_address);
+bool map_range(uint64_t virtual_address, uint64_t physical_address, uint64_t length, uint8_t flags);
+bool unmap_range(uint64_t virtual_address, uint64_t length);
+bool protect_range(uint64_t virtual_address, uint64_t length, uint8_t flags);
+// Copies code to pages which are mapped already through a writable alias, their own mappings are left as they are
+bool publish_code(uint64_t virtual_address, const void* code, uint64_t length);
+// On x86-64 changes only invalidate the TLB of the vCPU which made them, the others flush theirs once they call this.
+// The scheduler does so at every task switch and timer tick, other code running on several vCPUs has to do it itself.
+void synchronize_tlb(uint64_t* generation);
+void discard_range(uint64_t virtual_address, uint64_t length);
+
+#define NUMBER_OF_HYPERCALLS 256
+#define HYPERCALL_EXCEPTION   0
+#define HYPERCALL_GROW_HEAP   1
+#define HYPERCALL_DISCARD     2
+#define HYPERCALL_RETURN      3
+#define HYPERCALL_SYSTEM_CALL 4
+#define HYPERCALL_START_VCPU  5
+
+// vCPUs the guest starts itself are numbered independently of the ones the host created
+#define NUMBER_OF_STARTABLE_VCPUS 64
+#define STARTED_VCPU_STACK_SIZE 0x10000
+// Same results as PSCI CPU_ON
+#define PSCI_SUCCESS             0
+#define PSCI_INVALID_PARAMETERS -2
+#define PSCI_ALREADY_ON         -4
+#define PSCI_INTERNAL_FAILURE   -6
+// The target calls entry_point(context) in the current address space on a stack of its own and stops once it returns
+int64_t start_vcpu(uint64_t target, uint64_t entry_point, uint64_t context);
+
+typedef struct interrupt_frame* (*interrupt_handler)(struct interrupt_frame* frame);
+// Returns the handler it replaced, so that the new one can chain to it
+interrupt_handler register_interrupt_handler(uint64_t vector, interrupt_handler handler);
+#ifdef __x86_64__
+// Loads the task register of the calling vCPU, get_task_state_segment returns NULL until it did
+void load_task_state_segment(uint64_t address, uint64_t limit);
+struct task_state_segment* get_task_state_segment();
+// Every vCPU has to load a task state segment which provides the stack first
+void set_interrupt_stack_of_vector(uint64_t vector, uint8_t interrupt_stack_table_index);
+#endif
+
+#define NUMBER_OF_SYSTEM_CALLS 512
+#define SYSTEM_CALL_EXIT       60
+typedef uint64_t (*system_call_handler)(uint64_t number, uint64_t arguments[6]);
+// Every vCPU which runs user mode calls initialize_user_mode first, which reuses the task state segment it loaded before.
+// Only one vCPU may be in user mode at a time, a second one entering it traps on an invalid instruction.
+void initialize_user_mode();
+// Both fail if the number is not below NUMBER_OF_SYSTEM_CALLS
+bool register_system_call_handler(uint64_t number, system_call_handler handler);
+bool forward_system_call_to_host(uint64_t number);
+uint64_t run_in_user_mode(uint64_t entry_point, uint64_t stack_pointer, uint64_t argument);
+void leave_user_mode(uint64_t result);
+
+struct guest_clock {
+    uint64_t version;
+    uint64_t counter_timestamp;
+    uint64_t monotonic_timestamp;
+    uint64_t realtime_offset;
+    uint64_t nanoseconds_per_tick; // 32.32 fixed point
+};
+
+uint64_t convert_counter_using_clock(const volatile struct guest_clock* clock, uint64_t counter);
+uint64_t get_monotonic_time();
+uint64_t get_realtime();
+// One shot timer of the current vCPU, it raises INTERRUPT_VECTOR_TIMER and needs create_interrupt_controller_of_vm
+bool initialize_local_timer();
+void arm_local_timer(uint64_t nanoseconds);
+void acknowledge_local_timer();
+
+// Tasks are handed over in both directions through bounded queues, completions carry the result in argument
+#define TASK_QUEUE_LENGTH 1024
+struct task_queue_entry {
+    uint64_t turn; // even while free and odd while occupied, counting up with every lap around the queue
+    uint64_t function;
+    uint64_t argument;
+    uint64_t id;
+};
+
+struct task_queue {
+    ALIGN(64) uint64_t push_position;
+    ALIGN(64) uint64_t pop_position;
+    ALIGN(64) struct task_queue_entry entries[TASK_QUEUE_LENGTH];
+};
+
+bool push_to_task_queue(struct task_queue* queue, const struct task_queue_entry* entry);
+bool pop_from_task_queue(struct task_queue* queue, struct task_queue_entry* entry);
+bool is_task_queue_empty(struct task_queue* queue);
+
+// Every vCPU which calls run_scheduler multiplexes tasks from task_submissions onto itself and steals from the others.
+// The scheduler takes over the timer vector, page faults outside of task stacks go to the previously registered handler.
+#define SCHEDULER_MAXIMUM_PROCESSORS 64
+#define SCHEDULER_STACK_SIZE 0x10000 // per vCPU, its top part is reserved for exceptions
+#define SCHEDULER_TIME_SLICE 1000000 // nanoseconds
+#define TASK_STACK_SIZE 0x40000 // including the guard page, committed on first touch
+#define TASK_STACK_ADDRESS(levels) (GUEST_HEAP_ADDRESS(levels) / 2)
+typedef uint64_t (*task_function)(uint64_t argument);
+uint64_t run_scheduler(uint64_t processor_index, uint64_t time_slice);
+void yield_task();
+
+// Size classes are powers of two from 16 bytes to 32 KiB, larger allocations are served in whole pages
+#define HEAP_NUMBER_OF_SIZE_CLASSES 12
+// Each vCPU brings its own cache, so that its fast paths need no locks
+struct heap_cache {
+    void* free_lists[HEAP_NUMBER_OF_SIZE_CLASSES];
+    uint64_t lengths[HEAP_NUMBER_OF_SIZE_CLASSES];
+};
 
-bool walk_page_table(bool write_access, uint64_t access_offset, uint64_t virtual_address, uint64_t* physical_address);
+void* grow_heap(uint64_t length);
+void* allocate_memory(struct heap_cache* cache, uint64_t size);
+void free_memory(struct heap_cache* cache, void* pointer, uint64_t size);
@@ -0,0 +1,22 @@
+#pragma once
+
+// Flags of mappings, shared by the host API and the guest
+#define MAPPING_GAP        0
+#define MAPPING_READABLE   (1 << 0)
+#define MAPPING_WRITABLE   (1 << 1)
+#define MAPPING_EXECUTABLE (1 << 2)
+#define MAPPING_USER       (1 << 3)
+// Lets create_page_table use huge pages, which can not be remapped in parts later on but are split when parts of them are
+// unmapped or protected, both addresses have to be aligned to them
+#define MAPPING_HUGE       (1 << 4)
+// Memory type, write-back unless one of these is given. Uncached is device memory on AArch64, which needs aligned accesses.
+// Hypervisors may keep guest memory write-back regardless, like KVM on x86-64 without assigned devices.
+#define MAPPING_WRITE_THROUGH   (1 << 5)
+#define MAPPING_WRITE_COMBINING (2 << 5)
+#define MAPPING_UNCACHED        (3 << 5)
+#define MAPPING_MEMORY_TYPE     (3 << 5)
+
+// State of a guest page reported by scan_access_of_page_table and harvest_page_table_range
+#define PAGE_MAPPED        (1 << 0)
+#define PAGE_ACCESSED      (1 << 1)
+#define PAGE_DIRTY         (1 << 2)
@@ -3,6 +3,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <sys/uio.h>
+#include "mapping.h"
 
 #if !defined(__x86_64__) && !defined(__aarch64__)
 #error Unsupported OS
@@ -18,36 +20,123 @@ struct host_to_guest_mapping {
     uint64_t length;
 };
 
-#define MAPPING_GAP        0
-#define MAPPING_READABLE   (1 << 0)
-#define MAPPING_WRITABLE   (1 << 1)
-#define MAPPING_EXECUTABLE (1 << 2)
 struct guest_internal_mapping {
     uint64_t virtual_address;
     uint64_t physical_address;
     uint8_t flags;
 };
 
+// On Linux the first one installs a process wide handler for SIGUSR2, which interrupts vCPU threads.
+// Applications which use that signal themselves build with make VCPU_KICK_SIGNAL=<another signal>.
 struct vm* create_vm();
 void destroy_vm(struct vm* vm);
+// Gives vCPUs created afterwards a local timer, a halted vCPU then waits inside the VM for its interrupts
+void create_interrupt_controller_of_vm(struct vm* vm);
+// Page tables created afterwards, including those of loaded objects but not of images, walk this many levels.
+// 3 levels cover 512 GiB and save a step on every TLB miss, 4 (the default) cover 256 TiB and 5 cover 128 PiB.
+// Returns false and keeps the previous depth if the vCPUs can not use it.
+bool set_page_table_levels_of_vm(struct vm* vm, size_t levels);
+// Returns once no vCPU is inside the guest, until the matching resume_vm none enters it again
+void pause_vm(struct vm* vm);
+void resume_vm(struct vm* vm);
 void map_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping);
 void unmap_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping);
+// Fills the host page at the given offset into the mapping, returns false to leave it zeroed instead
+typedef bool (*fill_memory_callback)(void* context, uint64_t offset, void* host_address, uint64_t length);
+void map_lazy_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping, fill_memory_callback fill, void* context);
 bool resolve_address_of_vm(struct vm* vm, uint64_t guest_address, void** host_address, uint64_t length);
-void create_page_table(struct host_to_guest_mapping* page_table, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]);
-bool resolve_address_using_page_table(struct host_to_guest_mapping* page_table, bool write_access, uint64_t virtual_address, uint64_t* physical_address);
+void discard_memory_of_vm(struct vm* vm, uint64_t guest_address, uint64_t length);
+uint64_t get_monotonic_time_of_vm(struct vm* vm);
+uint64_t get_realtime_of_vm(struct vm* vm);
 
-struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table, uint64_t interrupt_table_pointer);
+struct page_table* create_page_table(struct vm* vm, uint64_t guest_address, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]);
+void destroy_page_table(struct page_table* page_table);
+// Translations are cached until the host changes the tables or a vCPU exits, so while vCPUs run they may miss changes the
+// guest made to its tables, results are only exact between pause_vm and resume_vm
+bool resolve_address_using_page_table(struct page_table* page_table, bool write_access, uint64_t virtual_address, uint64_t* physical_address);
+// Fills host iovecs for the range, merging pages which are contiguous in host memory, and stops at the first page it can not translate
+uint64_t translate_range_of_page_table(struct page_table* page_table, bool write_access, uint64_t virtual_address, uint64_t length, uint64_t number_of_iovecs, struct iovec iovecs[number_of_iovecs]);
+void map_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t physical_address, uint64_t length, uint8_t flags);
+void unmap_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length);
+// Replaces the flags of the mapped pages, including the memory type, which falls back to write-back unless flags give one
+void protect_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length, uint8_t flags);
+// Returns the entry which maps the page, possibly a huge one, or 0 if there is none
+uint64_t get_leaf_entry_of_page_table(struct page_table* page_table, uint64_t virtual_address);
+// Copies code into pages which are mapped already, vCPUs can run it as soon as they enter the guest next
+bool publish_code_of_page_table(struct page_table* page_table, uint64_t virtual_address, const void* code, uint64_t length);
+// Tables which page tables of the same VM can share, each distinct table page is stored once.
+// The root is a table of the given level (0 being the one of pages), the mappings are relative to the start of the range it covers.
+// Creating one with the same mappings again returns the existing one, every creation needs a matching destruction.
+struct page_table_subtree* create_page_table_subtree(struct vm* vm, size_t level, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]);
+void destroy_page_table_subtree(struct page_table_subtree* subtree);
+// The covered range has to be unused. The tables are read only for the host and the guest, writes of the guest exit to the host.
+bool graft_subtree_into_page_table(struct page_table* page_table, struct page_table_subtree* subtree, uint64_t virtual_address);
+bool prune_subtree_from_page_table(struct page_table* page_table, uint64_t virtual_address);
+struct page_access_statistics {
+    uint64_t number_of_mapped_pages, number_of_accessed_pages, number_of_dirty_pages;
+};
+// Reports which pages of the range were accessed and written since their bits were cleared last, optionally clearing them again.
+// Both arrays hold a byte per guest page and may be NULL, ages count the scans since a page was accessed last and saturate at 255.
+// Bits only get cleared where the MMU sets them again, grafted subtrees always report theirs as set. Running vCPUs only notice once they enter
+// the guest again, so sample between pause_vm and resume_vm for exact working sets.
+void scan_access_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length, bool clear, uint8_t page_flags[], uint8_t ages[], struct page_access_statistics* statistics);
+uint64_t grow_heap_of_page_table(struct page_table* page_table, uint64_t length);
+void discard_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length);
+
+#define VCPU_EXIT_HALT        0
+#define VCPU_EXIT_EXCEPTION   1
+#define VCPU_EXIT_UNKNOWN     2
+#define VCPU_EXIT_RETURN      3
+#define VCPU_EXIT_SYSTEM_CALL 4
+struct vcpu* create_vcpu(struct vm* vm, struct page_table* page_table, uint64_t interrupt_table_pointer);
 void destroy_vcpu(struct vcpu* vcpu);
-struct host_to_guest_mapping* get_page_table_of_vcpu(struct vcpu* vcpu);
+struct page_table* get_page_table_of_vcpu(struct vcpu* vcpu);
+// The buffer has to start and end on page boundaries of both the host and the guest
+void share_host_buffer_with_vcpu(struct vcpu* vcpu, void* host_address, uint64_t length, uint8_t flags, uint64_t* guest_virtual_address);
+void unshare_host_buffer_with_vcpu(struct vcpu* vcpu, uint64_t guest_virtual_address);
 uint64_t get_register_of_vcpu(struct vcpu* vcpu, uint64_t register_index);
 void set_register_of_vcpu(struct vcpu* vcpu, uint64_t register_index, uint64_t value);
-void run_vcpu(struct vcpu* vcpu);
+uint64_t run_vcpu(struct vcpu* vcpu);
+uint64_t call_guest_function(struct vcpu* vcpu, uint64_t function_address, uint64_t number_of_arguments, const uint64_t arguments[number_of_arguments], uint64_t* return_value);
+struct interrupt_frame* get_exception_frame_of_vcpu(struct vcpu* vcpu);
+uint64_t get_system_call_of_vcpu(struct vcpu* vcpu, uint64_t arguments[6]);
+void set_system_call_result_of_vcpu(struct vcpu* vcpu, uint64_t result);
+
+// Restoring reverts the memory the guest wrote to, page tables the host edited since the snapshot are left as they are
+struct vm_snapshot* snapshot_vm(struct vm* vm, uint64_t number_of_vcpus, struct vcpu* vcpus[number_of_vcpus]);
+void restore_vm(struct vm_snapshot* snapshot);
+void destroy_vm_snapshot(struct vm_snapshot* snapshot);
 
 struct loaded_object* create_loaded_object(struct vm* vm, const char* path);
+// Same as create_loaded_object, but reads the object file from a buffer
+struct loaded_object* create_loaded_object_from_memory(struct vm* vm, const void* data, uint64_t length);
+// Loads a position independent ELF object into the page table of runtime, symbols resolve against the runtime and earlier modules
+struct loaded_object* create_loaded_module(struct loaded_object* runtime, const char* path, uint64_t base_address);
+// Modules have to be destroyed before their runtime
 void destroy_loaded_object(struct loaded_object* loaded_object);
+// Swaps the code and read only data of an ELF object for those of another build while the vCPUs are paused.
+// The writable data is kept as it is, so its layout must not change, and relocations are applied again.
+// Exported functions have to stay where they are, as vCPUs may be inside of them and the guest may point to them.
+// Returns false and leaves the object alone if the new file does not fit. Other host threads must not use the object meanwhile.
+bool replace_code_of_loaded_object(struct loaded_object* loaded_object, const char* path);
 bool resolve_symbol_virtual_address_in_loaded_object(struct loaded_object* loaded_object, const char* symbol_name, uint64_t* virtual_address);
 bool resolve_symbol_host_address_in_loaded_object(struct loaded_object* loaded_object, bool write_access, const char* symbol_name, uint64_t length, void** host_address);
+struct page_table* get_page_table_of_loaded_object(struct loaded_object* loaded_object);
 struct vcpu* create_vcpu_for_loaded_object(struct loaded_object* loaded_object, const char* interrupt_table, const char* entry_point);
+struct loaded_image* create_loaded_image(const char* path);
+// Maps the image which an earlier call built from the same file content, or builds it and stores it in the cache directory
+struct loaded_image* create_loaded_image_using_cache(const char* path, const char* cache_directory);
+struct loaded_image* create_loaded_image_from_file_descriptor(int fd);
+void destroy_loaded_image(struct loaded_image* loaded_image);
+int get_file_descriptor_of_loaded_image(struct loaded_image* loaded_image);
+struct loaded_object* create_loaded_object_from_image(struct vm* vm, struct loaded_image* loaded_image);
+
+// Runs tasks of the guest scheduler on vCPUs of their own, each one sleeps on the host while there is nothing to do
+struct scheduler* create_scheduler_for_loaded_object(struct loaded_object* loaded_object, uint64_t number_of_vcpus);
+// Waits for all submitted tasks to finish, beyond TASK_QUEUE_LENGTH of them their completions have to be collected meanwhile
+void destroy_scheduler(struct scheduler* scheduler);
+bool submit_task_to_scheduler(struct scheduler* scheduler, uint64_t function_address, uint64_t argument, uint64_t id);
+bool collect_completed_task_of_scheduler(struct scheduler* scheduler, uint64_t* id, uint64_t* result);
 
 struct debugger_server* create_debugger_server(uint64_t number_of_vcpus, struct vcpu* vcpus[number_of_vcpus], uint16_t port, bool localhost_only);
 void destroy_debugger_server(struct debugger_server* debugger);
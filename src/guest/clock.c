@@ -0,0 +1,78 @@
+#include <guest.h>
+
+EXPORT ALIGN(0x1000) volatile struct guest_clock guest_clock;
+
+static uint64_t read_guest_clock(uint64_t* realtime_offset) {
+    uint64_t version, monotonic_time;
+    do {
+        version = guest_clock.version;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        monotonic_time = convert_counter_using_clock(&guest_clock, read_counter());
+        *realtime_offset = guest_clock.realtime_offset;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while((version & 1) != 0 || version != guest_clock.version);
+    return monotonic_time;
+}
+
+uint64_t get_monotonic_time() {
+    uint64_t realtime_offset;
+    return read_guest_clock(&realtime_offset);
+}
+
+uint64_t get_realtime() {
+    uint64_t realtime_offset;
+    uint64_t monotonic_time = read_guest_clock(&realtime_offset);
+    return monotonic_time + realtime_offset;
+}
+
+#ifdef __x86_64__
+// The local APIC is identity mapped, KVM clocks its timer at 1 GHz
+#define LOCAL_APIC_ADDRESS             0xFEE00000UL
+#define LOCAL_APIC_END_OF_INTERRUPT    0xB0
+#define LOCAL_APIC_SPURIOUS_VECTOR     0xF0
+#define LOCAL_APIC_TIMER_VECTOR        0x320
+#define LOCAL_APIC_TIMER_INITIAL_COUNT 0x380
+#define LOCAL_APIC_TIMER_DIVIDE        0x3E0
+
+static inline void write_local_apic(uint64_t offset, uint32_t value) {
+    *(volatile uint32_t*)(LOCAL_APIC_ADDRESS + offset) = value;
+}
+#endif
+
+bool initialize_local_timer() {
+#ifdef __x86_64__
+    if(!map_range(LOCAL_APIC_ADDRESS, LOCAL_APIC_ADDRESS, GUEST_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITABLE))
+        return false;
+    write_local_apic(LOCAL_APIC_SPURIOUS_VECTOR, 0x100 | 0xFF); // software enable
+    write_local_apic(LOCAL_APIC_TIMER_DIVIDE, 0xB); // divide by 1
+    write_local_apic(LOCAL_APIC_TIMER_VECTOR, INTERRUPT_VECTOR_TIMER); // one shot
+#elif __aarch64__
+    __asm__ volatile("msr CNTV_CTL_EL0, xzr\nisb\n");
+#endif
+    return true;
+}
+
+// Zero stops the timer
+void arm_local_timer(uint64_t nanoseconds) {
+#ifdef __x86_64__
+    write_local_apic(LOCAL_APIC_TIMER_INITIAL_COUNT, (nanoseconds > UINT32_MAX) ? UINT32_MAX : (uint32_t)nanoseconds);
+#elif __aarch64__
+    if(nanoseconds == 0) {
+        __asm__ volatile("msr CNTV_CTL_EL0, xzr\nisb\n");
+        return;
+    }
+    uint64_t frequency;
+    __asm__ volatile("mrs %0, CNTFRQ_EL0\n" : "=r"(frequency));
+    uint64_t ticks = nanoseconds * frequency / 1000000000UL;
+    __asm__ volatile("msr CNTV_TVAL_EL0, %0\nmsr CNTV_CTL_EL0, %1\nisb\n" : : "r"((ticks > INT32_MAX) ? INT32_MAX : ticks), "r"(1UL));
+#endif
+}
+
+void acknowledge_local_timer() {
+#ifdef __x86_64__
+    write_local_apic(LOCAL_APIC_END_OF_INTERRUPT, 0);
+#elif __aarch64__
+    // Disabling the timer lowers its interrupt line
+    __asm__ volatile("msr CNTV_CTL_EL0, xzr\nisb\n");
+#endif
+}
@@ -0,0 +1,166 @@
+#include <guest.h>
+
+#define SMALLEST_SIZE_CLASS_SHIFT 4
+#define SLAB_SIZE (1UL << 16)
+// A cache keeps at most this many objects per size class, the rest is handed back to the global lists
+#define CACHE_LIMIT 256
+#define MINIMUM_HEAP_GROWTH GUEST_HUGE_PAGE_SIZE
+// Freed page runs at least this large give their memory back to the host
+#define DISCARD_THRESHOLD GUEST_HUGE_PAGE_SIZE
+
+struct free_object {
+    struct free_object* next;
+};
+
+struct free_pages {
+    struct free_pages* next;
+    uint64_t length;
+};
+
+static bool heap_lock;
+static uint64_t heap_top, heap_end, heap_size;
+static struct free_object* free_lists[HEAP_NUMBER_OF_SIZE_CLASSES];
+static struct free_pages* free_pages;
+
+// Holders can not be preempted, so a scheduler waiting for the lock never waits for a task parked on its own vCPU
+static bool lock_heap() {
+    bool were_interrupts_enabled = are_interrupts_enabled();
+    disable_interrupts();
+    while(__atomic_test_and_set(&heap_lock, __ATOMIC_ACQUIRE));
+    return were_interrupts_enabled;
+}
+
+static void unlock_heap(bool were_interrupts_enabled) {
+    __atomic_clear(&heap_lock, __ATOMIC_RELEASE);
+    if(were_interrupts_enabled)
+        enable_interrupts();
+}
+
+void* grow_heap(uint64_t length) {
+    return (void*)hypercall(HYPERCALL_GROW_HEAP, length, 0, 0);
+}
+
+// Has to be called with the heap locked
+static void* carve_from_heap(uint64_t length) {
+    if(heap_end - heap_top < length) {
+        // Grow at least geometrically, so that the number of memory slots used stays small
+        uint64_t growth = heap_size;
+        if(growth < length)
+            growth = length;
+        if(growth < MINIMUM_HEAP_GROWTH)
+            growth = MINIMUM_HEAP_GROWTH;
+        growth = (growth + MINIMUM_HEAP_GROWTH - 1) / MINIMUM_HEAP_GROWTH * MINIMUM_HEAP_GROWTH;
+        uint64_t chunk = (uint64_t)grow_heap(growth);
+        if(chunk == 0)
+            return NULL;
+        // Chunks are contiguous, unless the host had to skip some of the window
+        if(chunk != heap_end)
+            heap_top = chunk;
+        heap_end = chunk + growth;
+        heap_size += growth;
+    }
+    void* pointer = (void*)heap_top;
+    heap_top += length;
+    return pointer;
+}
+
+static uint64_t get_size_class(uint64_t size) {
+    uint64_t size_class = 0;
+    while((1UL << (size_class + SMALLEST_SIZE_CLASS_SHIFT)) < size)
+        ++size_class;
+    return size_class;
+}
+
+static bool refill_cache(struct heap_cache* cache, uint64_t size_class) {
+    uint64_t object_size = 1UL << (size_class + SMALLEST_SIZE_CLASS_SHIFT);
+    bool were_interrupts_enabled = lock_heap();
+    if(!free_lists[size_class]) {
+        uint8_t* slab = carve_from_heap(SLAB_SIZE);
+        if(!slab) {
+            unlock_heap(were_interrupts_enabled);
+            return false;
+        }
+        for(uint64_t offset = SLAB_SIZE; offset > 0; offset -= object_size) {
+            struct free_object* object = (struct free_object*)&slab[offset - object_size];
+            object->next = free_lists[size_class];
+            free_lists[size_class] = object;
+        }
+    }
+    // Take up to half of the cache limit, so that the next free does not hand everything back
+    struct free_object* first = free_lists[size_class];
+    struct free_object* last = first;
+    uint64_t count = 1;
+    for(; count < CACHE_LIMIT / 2 && last->next; ++count)
+        last = last->next;
+    free_lists[size_class] = last->next;
+    unlock_heap(were_interrupts_enabled);
+    last->next = cache->free_lists[size_class];
+    cache->free_lists[size_class] = first;
+    cache->lengths[size_class] += count;
+    return true;
+}
+
+void* allocate_memory(struct heap_cache* cache, uint64_t size) {
+    uint64_t size_class = get_size_class(size);
+    if(size_class >= HEAP_NUMBER_OF_SIZE_CLASSES) {
+        uint64_t length = (size + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+        bool were_interrupts_enabled = lock_heap();
+        // First fit among the freed page runs, splitting off the tail
+        for(struct free_pages** link = &free_pages; *link; link = &(*link)->next) {
+            struct free_pages* run = *link;
+            if(run->length < length)
+                continue;
+            void* pointer;
+            if(run->length == length) {
+                *link = run->next;
+                pointer = run;
+            } else {
+                run->length -= length;
+                pointer = (uint8_t*)run + run->length;
+            }
+            unlock_heap(were_interrupts_enabled);
+            return pointer;
+        }
+        void* pointer = carve_from_heap(length);
+        unlock_heap(were_interrupts_enabled);
+        return pointer;
+    }
+    if(!cache->free_lists[size_class] && !refill_cache(cache, size_class))
+        return NULL;
+    struct free_object* object = cache->free_lists[size_class];
+    cache->free_lists[size_class] = object->next;
+    --cache->lengths[size_class];
+    return object;
+}
+
+void free_memory(struct heap_cache* cache, void* pointer, uint64_t size) {
+    uint64_t size_class = get_size_class(size);
+    if(size_class >= HEAP_NUMBER_OF_SIZE_CLASSES) {
+        struct free_pages* run = (struct free_pages*)pointer;
+        run->length = (size + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+        // Everything but the first page, which holds the free list entry
+        if(run->length >= DISCARD_THRESHOLD)
+            discard_range((uint64_t)pointer + GUEST_PAGE_SIZE, run->length - GUEST_PAGE_SIZE);
+        bool were_interrupts_enabled = lock_heap();
+        run->next = free_pages;
+        free_pages = run;
+        unlock_heap(were_interrupts_enabled);
+        return;
+    }
+    struct free_object* object = (struct free_object*)pointer;
+    object->next = cache->free_lists[size_class];
+    cache->free_lists[size_class] = object;
+    if(++cache->lengths[size_class] <= CACHE_LIMIT)
+        return;
+    // Hand half of the cache back so that other vCPUs can use it
+    struct free_object* first = cache->free_lists[size_class];
+    struct free_object* last = first;
+    for(uint64_t i = 1; i < CACHE_LIMIT / 2; ++i)
+        last = last->next;
+    cache->free_lists[size_class] = last->next;
+    cache->lengths[size_class] -= CACHE_LIMIT / 2;
+    bool were_interrupts_enabled = lock_heap();
+    last->next = free_lists[size_class];
+    free_lists[size_class] = first;
+    unlock_heap(were_interrupts_enabled);
+}
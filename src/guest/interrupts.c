@@ -1,31 +1,64 @@
 #include <guest.h>
 
 #ifdef __x86_64__
+// Every stub pushes a dummy error code (unless the CPU pushes one) and its vector
 __asm__(
-    ".global " SYMBOL_NAME_PREFIX "break_point_isr\n"
-    SYMBOL_NAME_PREFIX "break_point_isr:\n"
-    "iretq\n"
-);
-
-__asm__(
-    ".global " SYMBOL_NAME_PREFIX "page_fault_isr\n"
-    SYMBOL_NAME_PREFIX "page_fault_isr:\n"
+    ".align 16\n"
+    ".global " SYMBOL_NAME_PREFIX "interrupt_stubs\n"
+    SYMBOL_NAME_PREFIX "interrupt_stubs:\n"
+    ".set interrupt_vector, 0\n"
+    ".rept 256\n"
+    ".align 16\n"
+    ".if interrupt_vector != 8 && (interrupt_vector < 10 || interrupt_vector > 14) && interrupt_vector != 17 && interrupt_vector != 21 && interrupt_vector != 29 && interrupt_vector != 30\n"
+    "push $0\n"
+    ".endif\n"
+    "push $interrupt_vector\n"
+    "jmp interrupt_entry\n"
+    ".set interrupt_vector, interrupt_vector + 1\n"
+    ".endr\n"
+    "interrupt_entry:\n"
+    "push %r15\n"
+    "push %r14\n"
+    "push %r13\n"
+    "push %r12\n"
+    "push %r11\n"
+    "push %r10\n"
+    "push %r9\n"
+    "push %r8\n"
+    "push %rbp\n"
     "push %rdi\n"
     "push %rsi\n"
     "push %rdx\n"
-    "movq 0x20(%rsp), %rdi\n"
-    "movq %cr2, %rsi\n"
-    "movq 0x18(%rsp), %rdx\n"
-    "call " SYMBOL_NAME_PREFIX "page_fault_handler\n"
+    "push %rcx\n"
+    "push %rbx\n"
+    "push %rax\n"
+    "movq %cr2, %rax\n"
+    "push %rax\n"
+    "movq %rsp, %rdi\n"
+    "andq $-16, %rsp\n"
+    "call " SYMBOL_NAME_PREFIX "dispatch_interrupt\n"
+    "movq %rax, %rsp\n"
+    "addq $8, %rsp\n"
+    "pop %rax\n"
+    "pop %rbx\n"
+    "pop %rcx\n"
     "pop %rdx\n"
     "pop %rsi\n"
     "pop %rdi\n"
-    "addq $8, %rsp\n"
+    "pop %rbp\n"
+    "pop %r8\n"
+    "pop %r9\n"
+    "pop %r10\n"
+    "pop %r11\n"
+    "pop %r12\n"
+    "pop %r13\n"
+    "pop %r14\n"
+    "pop %r15\n"
+    "addq $16, %rsp\n"
     "iretq\n"
 );
 
-extern void break_point_isr();
-extern void page_fault_isr();
+extern uint8_t interrupt_stubs[];
 
 union interrupt_gate_64 {
     struct {
@@ -34,60 +67,200 @@ union interrupt_gate_64 {
         uint8_t ist;
         uint8_t type_attributes;
         uint8_t padding1[2];
-        void(*handler)();
+        void* handler;
     };
     uint64_t entries[2];
 };
 
+#define INTERRUPT_GATE(vector) [vector] = { .type_attributes = 0x8E, .segment_selector = 8, .handler = &interrupt_stubs[(vector) * 16] }
+#define INTERRUPT_GATES_4(vector) INTERRUPT_GATE(vector), INTERRUPT_GATE(vector + 1), INTERRUPT_GATE(vector + 2), INTERRUPT_GATE(vector + 3)
+#define INTERRUPT_GATES_16(vector) INTERRUPT_GATES_4(vector), INTERRUPT_GATES_4(vector + 4), INTERRUPT_GATES_4(vector + 8), INTERRUPT_GATES_4(vector + 12)
+#define INTERRUPT_GATES_64(vector) INTERRUPT_GATES_16(vector), INTERRUPT_GATES_16(vector + 16), INTERRUPT_GATES_16(vector + 32), INTERRUPT_GATES_16(vector + 48)
+
 EXPORT ALIGN(0x1000) union interrupt_gate_64 interrupt_table[512] = {
-    [3] = { .type_attributes = 0x8F, .segment_selector = 8, .handler = break_point_isr },
-    [14] = { .type_attributes = 0x8F, .segment_selector = 8, .handler = page_fault_isr },
+    INTERRUPT_GATES_64(0), INTERRUPT_GATES_64(64), INTERRUPT_GATES_64(128), INTERRUPT_GATES_64(192),
     [256] = { .entries = { 0, 0x00209B0000000000UL } }, // GDT entry: code segment
     [257] = { .entries = { 0x00008B0000000FFFUL, 0 } }, // GDT entry: task state segment
+    [258] = { .entries = { 0x00209B0000000000UL, 0x0000930000000000UL } }, // GDT entries: kernel code and data segment
+    [259] = { .entries = { 0x0000F30000000000UL, 0x0020FB0000000000UL } }, // GDT entries: user data and code segment
 };
+
+// Task state segments take descriptors from here on, each keeps its own so that the task register leads back to it
+#define FIRST_TASK_STATE_SEGMENT_DESCRIPTOR 260
+#define END_OF_TASK_STATE_SEGMENT_DESCRIPTORS 512
+
+static bool task_state_segment_lock;
+static uint64_t number_of_task_state_segments;
+
+static uint64_t get_base_of_task_state_segment_descriptor(uint64_t index) {
+    return (interrupt_table[index].entries[0] >> 16 & 0xFFFFFFUL) | (interrupt_table[index].entries[0] >> 56 << 24) | (interrupt_table[index].entries[1] << 32);
+}
+
+void load_task_state_segment(uint64_t address, uint64_t limit) {
+    while(__atomic_test_and_set(&task_state_segment_lock, __ATOMIC_ACQUIRE));
+    uint64_t index = FIRST_TASK_STATE_SEGMENT_DESCRIPTOR;
+    while(index < FIRST_TASK_STATE_SEGMENT_DESCRIPTOR + number_of_task_state_segments && get_base_of_task_state_segment_descriptor(index) != address)
+        ++index;
+    if(index == END_OF_TASK_STATE_SEGMENT_DESCRIPTORS)
+        INVALID_INSTRUCTION
+    if(index == FIRST_TASK_STATE_SEGMENT_DESCRIPTOR + number_of_task_state_segments)
+        ++number_of_task_state_segments;
+    // LTR only accepts an available (not busy) task state segment
+    interrupt_table[index].entries[0] = (limit & 0xFFFFUL) | ((address & 0xFFFFFFUL) << 16) | (0x89UL << 40) | ((limit >> 16 & 0xFUL) << 48) | ((address >> 24 & 0xFFUL) << 56);
+    interrupt_table[index].entries[1] = address >> 32;
+    __asm__ volatile("ltr %w0\n" : : "r"((index - 256) * 16) : "memory");
+    __atomic_clear(&task_state_segment_lock, __ATOMIC_RELEASE);
+}
+
+struct task_state_segment* get_task_state_segment() {
+    uint64_t selector = 0;
+    __asm__ volatile("str %w0\n" : "+r"(selector));
+    // The host starts every vCPU with a placeholder below the first descriptor
+    if(selector < (FIRST_TASK_STATE_SEGMENT_DESCRIPTOR - 256) * 16)
+        return NULL;
+    return (struct task_state_segment*)get_base_of_task_state_segment_descriptor(256 + selector / 16);
+}
+
+void set_interrupt_stack_of_vector(uint64_t vector, uint8_t interrupt_stack_table_index) {
+    interrupt_table[vector].ist = interrupt_stack_table_index;
+}
 #elif __aarch64__
+// Every table entry reserves the frame, saves x0 and x1 and passes its own index in x0
 __asm__(
     ".align	14\n"
     ".global " SYMBOL_NAME_PREFIX "interrupt_table\n"
     SYMBOL_NAME_PREFIX "interrupt_table:\n"
-    "sub sp, sp, #0x20\n"
+    ".set interrupt_vector, 0\n"
+    ".rept 16\n"
+    ".align	7\n"
+    "sub sp, sp, #0x130\n"
     "stp x0, x1, [sp, #0x00]\n"
+    "mov x0, #interrupt_vector\n"
+    "b interrupt_entry\n"
+    ".set interrupt_vector, interrupt_vector + 1\n"
+    ".endr\n"
+    "interrupt_entry:\n"
     "stp x2, x3, [sp, #0x10]\n"
-    "mrs x0, ELR_EL1\n"
-    "mrs x1, FAR_EL1\n"
+    "stp x4, x5, [sp, #0x20]\n"
+    "stp x6, x7, [sp, #0x30]\n"
+    "stp x8, x9, [sp, #0x40]\n"
+    "stp x10, x11, [sp, #0x50]\n"
+    "stp x12, x13, [sp, #0x60]\n"
+    "stp x14, x15, [sp, #0x70]\n"
+    "stp x16, x17, [sp, #0x80]\n"
+    "stp x18, x19, [sp, #0x90]\n"
+    "stp x20, x21, [sp, #0xA0]\n"
+    "stp x22, x23, [sp, #0xB0]\n"
+    "stp x24, x25, [sp, #0xC0]\n"
+    "stp x26, x27, [sp, #0xD0]\n"
+    "stp x28, x29, [sp, #0xE0]\n"
+    "str x30, [sp, #0xF0]\n"
+    // Entries 4 to 7 interrupted code running on SP_EL1, all others on SP_EL0
+    "and x1, x0, #0xC\n"
+    "cmp x1, #4\n"
+    "b.ne 1f\n"
+    "add x1, sp, #0x130\n"
+    "b 2f\n"
+    "1:\n"
+    "mrs x1, SP_EL0\n"
+    "2:\n"
+    "str x1, [sp, #0xF8]\n"
+    "mrs x1, ELR_EL1\n"
+    "str x1, [sp, #0x100]\n"
+    "mrs x1, SPSR_EL1\n"
+    "str x1, [sp, #0x108]\n"
     "mrs x2, ESR_EL1\n"
-    "lsr x3, x2, #24\n"
-    "and x3, x3, #0xFC\n"
-    "cmp x3, #0x94\n"
-    "beq 1f\n"
-    "cmp x3, #0xF0\n"
-    "beq 2f\n"
-    "b return_from_exception\n"
+    "str x2, [sp, #0x118]\n"
+    "mrs x1, FAR_EL1\n"
+    "str x1, [sp, #0x120]\n"
+    // Synchronous exceptions are dispatched by exception class, IRQ, FIQ and SError after those
+    "ands x1, x0, #3\n"
+    "b.ne 1f\n"
+    "lsr x1, x2, #26\n"
+    "b 2f\n"
     "1:\n"
-    "bl " SYMBOL_NAME_PREFIX "page_fault_handler\n"
-    "b return_from_exception\n"
+    "add x1, x1, #0x3F\n"
     "2:\n"
-    "add x0, x0, 4\n"
-    "msr ELR_EL1, x0\n"
-    "b return_from_exception\n"
-    "return_from_exception:\n"
-    "ldp x0, x1, [sp, #0x00]\n"
-    "ldp x2, x3, [sp, #0x10]\n"
-    "add sp, sp, #0x20\n"
+    "str x1, [sp, #0x110]\n"
+    "mov x0, sp\n"
+    "bl " SYMBOL_NAME_PREFIX "dispatch_interrupt\n"
+    "ldr x1, [x0, #0x100]\n"
+    "msr ELR_EL1, x1\n"
+    "ldr x1, [x0, #0x108]\n"
+    "msr SPSR_EL1, x1\n"
+    "ldr x2, [x0, #0xF8]\n"
+    "and x1, x1, #0xF\n"
+    "cmp x1, #5\n"
+    "b.ne 1f\n"
+    "mov sp, x2\n"
+    "b 2f\n"
+    "1:\n"
+    "msr SP_EL0, x2\n"
+    "add x1, x0, #0x130\n"
+    "mov sp, x1\n"
+    "2:\n"
+    "ldp x2, x3, [x0, #0x10]\n"
+    "ldp x4, x5, [x0, #0x20]\n"
+    "ldp x6, x7, [x0, #0x30]\n"
+    "ldp x8, x9, [x0, #0x40]\n"
+    "ldp x10, x11, [x0, #0x50]\n"
+    "ldp x12, x13, [x0, #0x60]\n"
+    "ldp x14, x15, [x0, #0x70]\n"
+    "ldp x16, x17, [x0, #0x80]\n"
+    "ldp x18, x19, [x0, #0x90]\n"
+    "ldp x20, x21, [x0, #0xA0]\n"
+    "ldp x22, x23, [x0, #0xB0]\n"
+    "ldp x24, x25, [x0, #0xC0]\n"
+    "ldp x26, x27, [x0, #0xD0]\n"
+    "ldp x28, x29, [x0, #0xE0]\n"
+    "ldr x30, [x0, #0xF0]\n"
+    "ldp x0, x1, [x0, #0x00]\n"
     "eret\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
-    ".align	7\n"
-    "b " SYMBOL_NAME_PREFIX "interrupt_table\n"
 );
 #endif
+
+// Return address of functions called by the host, it passes the result on and is resumed only by the next call
+#ifdef __x86_64__
+__asm__(
+    ".global " SYMBOL_NAME_PREFIX "return_to_host\n"
+    SYMBOL_NAME_PREFIX "return_to_host:\n"
+    "movq %rax, %rdi\n"
+    "movl $" EXPAND_AND_STRINGIFY(HYPERCALL_RETURN) ", %eax\n"
+    "outl %eax, $" EXPAND_AND_STRINGIFY(HYPERCALL_PORT) "\n"
+    "jmp " SYMBOL_NAME_PREFIX "return_to_host\n"
+);
+#elif __aarch64__
+__asm__(
+    ".global " SYMBOL_NAME_PREFIX "return_to_host\n"
+    SYMBOL_NAME_PREFIX "return_to_host:\n"
+    "mov x1, x0\n"
+    "movz x0, #0xC300, lsl #16\n" // HYPERCALL_FUNCTION_ID
+    "movk x0, #" EXPAND_AND_STRINGIFY(HYPERCALL_RETURN) "\n"
+    "hvc #0\n"
+    "b " SYMBOL_NAME_PREFIX "return_to_host\n"
+);
+#endif
+
+struct interrupt_frame* break_point_handler(struct interrupt_frame* frame) {
+#ifdef __aarch64__
+    frame->instruction_pointer += 4;
+#endif
+    return frame;
+}
+
+static interrupt_handler interrupt_handlers[NUMBER_OF_INTERRUPT_VECTORS] = {
+    [INTERRUPT_VECTOR_BREAK_POINT] = break_point_handler,
+};
+
+interrupt_handler register_interrupt_handler(uint64_t vector, interrupt_handler handler) {
+    return __atomic_exchange_n(&interrupt_handlers[vector], handler, __ATOMIC_ACQ_REL);
+}
+
+struct interrupt_frame* dispatch_interrupt(struct interrupt_frame* frame) {
+    interrupt_handler handler = interrupt_handlers[frame->vector];
+    if(handler)
+        return handler(frame);
+    // Let the host inspect and possibly modify the frame before resuming
+    hypercall(HYPERCALL_EXCEPTION, (uint64_t)frame, 0, 0);
+    return frame;
+}
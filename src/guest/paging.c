@@ -0,0 +1,182 @@
+#include <guest.h>
+
+#define LEVEL_SHIFT(level) GUEST_PAGE_TABLE_LEVEL_SHIFT(level)
+#define PAGE_TABLE_POOL_PAGES 64
+// Ranges larger than this flush the whole TLB instead of every page
+#define TLB_FLUSH_THRESHOLD (64 * GUEST_PAGE_SIZE)
+
+uint64_t* resolve_table_using_self_map(void* context, uint64_t physical_address, uint64_t virtual_address, size_t level);
+uint64_t* allocate_table_from_pool(void* context, uint64_t* physical_address);
+
+// Exported so that the host can set the depth
+EXPORT struct page_table_access page_table_access = {
+    .root = 0,
+    .levels = GUEST_PAGE_TABLE_DEFAULT_LEVELS,
+    .context = NULL,
+    .resolve_table = resolve_table_using_self_map,
+    .allocate_table = allocate_table_from_pool,
+    .tlb_is_stale = false,
+};
+
+size_t get_page_table_levels() {
+    return page_table_access.levels;
+}
+
+uint64_t* get_page_table_entry(uint64_t virtual_address, size_t level) {
+    // Every pass through the self map entry moves the resulting address one level closer to the root
+    size_t levels = page_table_access.levels;
+    uint64_t address = 0;
+    for(size_t i = 0; i <= level; ++i)
+        address |= GUEST_PAGE_TABLE_SELF_MAP_INDEX << LEVEL_SHIFT(levels - 1 - i);
+    uint64_t entry_offset_mask = (1UL << LEVEL_SHIFT(levels - 1 - level)) - (1UL << GUEST_PAGE_TABLE_ENTRY_SHIFT);
+    return (uint64_t*)(address | ((virtual_address >> (GUEST_ENTRIES_PER_PAGE_SHIFT * (level + 1))) & entry_offset_mask));
+}
+
+uint64_t* find_page_table_entry(uint64_t virtual_address) {
+    for(size_t parent_level = page_table_access.levels; parent_level > 0; --parent_level) {
+        uint64_t* entry = get_page_table_entry(virtual_address, parent_level - 1);
+        if((*entry & PT_PRE) == 0)
+            return NULL;
+#ifdef __x86_64__
+        if(parent_level == 1 || (*entry & PT_LEAF) != 0)
+#elif __aarch64__
+        if(parent_level == 1 || (*entry & PT_NOT_LEAF) == 0)
+#endif
+            return entry;
+    }
+    return NULL;
+}
+
+bool set_page_writable(uint64_t virtual_address, bool writable) {
+    uint64_t* entry = find_page_table_entry(virtual_address);
+    if(!entry)
+        return false;
+#ifdef __x86_64__
+    *entry = writable ? (*entry | PT_RW) : (*entry & ~PT_RW);
+#elif __aarch64__
+    *entry = writable ? (*entry & ~PT_RO) : ((*entry | PT_RO) & ~PT_DBM);
+#endif
+    invalidate_tlb_entry(virtual_address);
+    return true;
+}
+
+static ALIGN(GUEST_PAGE_SIZE) uint64_t page_table_pool[PAGE_TABLE_POOL_PAGES][GUEST_ENTRIES_PER_PAGE];
+static uint64_t page_table_pool_used;
+static bool page_table_lock;
+static uint64_t page_table_generation;
+
+uint64_t* resolve_table_using_self_map(void* context, uint64_t physical_address, uint64_t virtual_address, size_t level) {
+    (void)context;
+    (void)physical_address;
+    return (uint64_t*)((uint64_t)get_page_table_entry(virtual_address, level) & ~(GUEST_PAGE_SIZE - 1));
+}
+
+uint64_t* allocate_table_from_pool(void* context, uint64_t* physical_address) {
+    (void)context;
+    if(page_table_pool_used == PAGE_TABLE_POOL_PAGES)
+        return NULL;
+    uint64_t* entries = page_table_pool[page_table_pool_used];
+    if(!translate_address((uint64_t)entries, physical_address))
+        return NULL;
+    ++page_table_pool_used;
+    return entries;
+}
+
+bool translate_address(uint64_t virtual_address, uint64_t* physical_address) {
+    return walk_page_table(&page_table_access, false, virtual_address, physical_address);
+}
+
+// Like the heap, holders can not be preempted by the scheduler
+static bool lock_page_table() {
+    bool were_interrupts_enabled = are_interrupts_enabled();
+    disable_interrupts();
+    while(__atomic_test_and_set(&page_table_lock, __ATOMIC_ACQUIRE));
+    return were_interrupts_enabled;
+}
+
+static void unlock_page_table(uint64_t virtual_address, uint64_t length, bool were_interrupts_enabled) {
+    if(page_table_access.tlb_is_stale) {
+        page_table_access.tlb_is_stale = false;
+#ifdef __x86_64__
+        if(length > TLB_FLUSH_THRESHOLD)
+            flush_tlb();
+        else
+            for(uint64_t offset = 0; offset < length; offset += GUEST_PAGE_SIZE)
+                invalidate_tlb_entry(virtual_address + offset);
+        // Other vCPUs catch up in synchronize_tlb(), e.g. on the next tick of the scheduler
+        __atomic_add_fetch(&page_table_generation, 1, __ATOMIC_RELEASE);
+#elif __aarch64__
+        // Broadcast to the TLBs of all vCPUs in the inner shareable domain
+        __asm__ volatile("dsb ishst\n" : : : "memory");
+        if(length > TLB_FLUSH_THRESHOLD)
+            __asm__ volatile("tlbi vmalle1is\n" : : : "memory");
+        else
+            for(uint64_t offset = 0; offset < length; offset += GUEST_PAGE_SIZE)
+                __asm__ volatile("tlbi vaae1is, %0\n" : : "r"((virtual_address + offset) >> 12) : "memory");
+        __asm__ volatile("dsb ish\nisb\n" : : : "memory");
+#endif
+    }
+    __atomic_clear(&page_table_lock, __ATOMIC_RELEASE);
+    if(were_interrupts_enabled)
+        enable_interrupts();
+}
+
+bool map_range(uint64_t virtual_address, uint64_t physical_address, uint64_t length, uint8_t flags) {
+    bool were_interrupts_enabled = lock_page_table();
+    bool result = write_page_table_range(&page_table_access, virtual_address, physical_address, length, flags);
+    unlock_page_table(virtual_address, length, were_interrupts_enabled);
+    return result;
+}
+
+bool unmap_range(uint64_t virtual_address, uint64_t length) {
+    bool were_interrupts_enabled = lock_page_table();
+    bool result = clear_page_table_range(&page_table_access, virtual_address, length);
+    unlock_page_table(virtual_address, length, were_interrupts_enabled);
+    return result;
+}
+
+bool protect_range(uint64_t virtual_address, uint64_t length, uint8_t flags) {
+    bool were_interrupts_enabled = lock_page_table();
+    bool result = protect_page_table_range(&page_table_access, virtual_address, length, flags);
+    unlock_page_table(virtual_address, length, were_interrupts_enabled);
+    return result;
+}
+
+bool publish_code(uint64_t virtual_address, const void* code, uint64_t length) {
+    uint64_t alias_address = GUEST_CODE_ALIAS_ADDRESS(page_table_access.levels);
+    bool result = true;
+    bool were_interrupts_enabled = lock_page_table();
+    for(uint64_t offset = 0; result && offset < length; ) {
+        uint64_t page_offset = (virtual_address + offset) % GUEST_PAGE_SIZE, physical_address;
+        uint64_t chunk_length = GUEST_PAGE_SIZE - page_offset;
+        if(chunk_length > length - offset)
+            chunk_length = length - offset;
+        result = translate_address(virtual_address + offset, &physical_address) &&
+                 write_page_table_range(&page_table_access, alias_address, physical_address - page_offset, GUEST_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITABLE);
+        if(!result)
+            break;
+        // Other vCPUs may still cache the alias of an earlier call, only the holder of the lock uses it
+        invalidate_tlb_entry(alias_address);
+        for(uint64_t index = 0; index < chunk_length; ++index)
+            ((volatile uint8_t*)alias_address)[page_offset + index] = ((const uint8_t*)code)[offset + index];
+        offset += chunk_length;
+    }
+    clear_page_table_range(&page_table_access, alias_address, GUEST_PAGE_SIZE);
+    unlock_page_table(alias_address, GUEST_PAGE_SIZE, were_interrupts_enabled);
+    if(result)
+        synchronize_instruction_cache(virtual_address, length);
+    return result;
+}
+
+void synchronize_tlb(uint64_t* generation) {
+    uint64_t current_generation = __atomic_load_n(&page_table_generation, __ATOMIC_ACQUIRE);
+    if(*generation == current_generation)
+        return;
+    *generation = current_generation;
+    flush_tlb();
+}
+
+void discard_range(uint64_t virtual_address, uint64_t length) {
+    // The mappings stay, the next touch of a discarded page reads zeros
+    hypercall(HYPERCALL_DISCARD, virtual_address, length, 0);
+}
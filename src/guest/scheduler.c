@@ -0,0 +1,488 @@
+#include <guest.h>
+
+#define RUN_QUEUE_LENGTH 256
+#define EXCEPTION_STACK_SIZE 0x4000
+// Every so many picks new submissions go first, so that they are not starved by preempted tasks
+#define SUBMISSION_INTERVAL 8
+
+EXPORT ALIGN(0x1000) struct task_queue task_submissions;
+EXPORT ALIGN(0x1000) struct task_queue task_completions;
+
+// Lives at the top of its own stack
+struct scheduler_task {
+    uint64_t stack_pointer;
+    uint64_t function, argument, id;
+    bool is_finished;
+    struct scheduler_task* next_free;
+};
+
+struct run_queue {
+    bool lock;
+    uint64_t head, tail;
+    struct scheduler_task* tasks[RUN_QUEUE_LENGTH];
+};
+
+// The first fields are accessed from assembly
+struct processor {
+    struct processor* self;
+    uint64_t preempted_instruction_pointer;
+    uint64_t preempted_flags;
+    uint64_t preempted_stack_pointer;
+    uint64_t scheduler_stack_pointer;
+    struct scheduler_task* current_task;
+    uint64_t number_of_picks;
+    uint64_t page_table_generation; // of the TLB of this vCPU, see synchronize_tlb
+    bool is_initialized, has_local_timer;
+    struct run_queue run_queue;
+    struct heap_cache page_cache;
+    // Stacks grow from these pages, refilled before every task runs with enough for a whole stack
+    uint64_t number_of_stack_pages;
+    void* stack_pages[TASK_STACK_SIZE / GUEST_PAGE_SIZE];
+#ifdef __x86_64__
+    struct task_state_segment task_state_segment;
+#endif
+};
+
+static struct processor processors[SCHEDULER_MAXIMUM_PROCESSORS];
+static uint64_t number_of_processors;
+static uint64_t next_stack_slot;
+static bool free_tasks_lock;
+static struct scheduler_task* free_tasks;
+static bool are_handlers_registered;
+static interrupt_handler chained_page_fault_handler;
+
+void switch_task_context(uint64_t* saved_stack_pointer, uint64_t stack_pointer);
+void start_task(struct scheduler_task* task);
+void task_entry();
+void preempt_entry();
+
+#ifdef __x86_64__
+// Not raised by hardware, preempt_entry enters it like an interrupt to save the whole task on its own stack
+#define INTERRUPT_VECTOR_PREEMPT (INTERRUPT_VECTOR_TIMER + 1)
+
+__asm__(
+    ".global " SYMBOL_NAME_PREFIX "run_scheduler\n"
+    SYMBOL_NAME_PREFIX "run_scheduler:\n"
+    "push %rbp\n"
+    "movq %rsp, %rbp\n"
+    "movq %rsp, %rdx\n"
+    "subq $" EXPAND_AND_STRINGIFY(EXCEPTION_STACK_SIZE) ", %rsp\n"
+    "andq $-16, %rsp\n"
+    "call " SYMBOL_NAME_PREFIX "schedule_tasks\n"
+    "movq %rbp, %rsp\n"
+    "pop %rbp\n"
+    "ret\n"
+
+    "switch_task_context:\n"
+    "push %rbp\n"
+    "push %rbx\n"
+    "push %r12\n"
+    "push %r13\n"
+    "push %r14\n"
+    "push %r15\n"
+    "movq %rsp, (%rdi)\n"
+    "movq %rsi, %rsp\n"
+    "pop %r15\n"
+    "pop %r14\n"
+    "pop %r13\n"
+    "pop %r12\n"
+    "pop %rbx\n"
+    "pop %rbp\n"
+    "ret\n"
+
+    "task_entry:\n"
+    "movq %rbx, %rdi\n"
+    "call " SYMBOL_NAME_PREFIX "start_task\n"
+    "ud2\n"
+
+    "preempt_entry:\n"
+    "movq %rsp, %gs:24\n"
+    "pushq $0\n"
+    "pushq %gs:24\n"
+    "pushq %gs:16\n"
+    "pushq $8\n"
+    "pushq %gs:8\n"
+    "jmp " SYMBOL_NAME_PREFIX "interrupt_stubs + " EXPAND_AND_STRINGIFY(INTERRUPT_VECTOR_PREEMPT) " * 16\n"
+);
+
+static inline struct processor* get_current_processor() {
+    struct processor* processor;
+    __asm__ volatile("movq %%gs:0, %0\n" : "=r"(processor));
+    return processor;
+}
+#elif __aarch64__
+// Tasks and the scheduler run on SP_EL0, so that exceptions are taken on the untouched SP_EL1
+__asm__(
+    ".global " SYMBOL_NAME_PREFIX "run_scheduler\n"
+    SYMBOL_NAME_PREFIX "run_scheduler:\n"
+    "stp x29, x30, [sp, #-0x10]!\n"
+    "mov x29, sp\n"
+    "mov x2, sp\n"
+    "sub x9, sp, #" EXPAND_AND_STRINGIFY(EXCEPTION_STACK_SIZE) "\n"
+    "msr SP_EL0, x9\n"
+    "msr SPSel, #0\n"
+    "bl " SYMBOL_NAME_PREFIX "schedule_tasks\n"
+    "msr SPSel, #1\n"
+    "ldp x29, x30, [sp], #0x10\n"
+    "ret\n"
+
+    "switch_task_context:\n"
+    "sub sp, sp, #0x60\n"
+    "stp x19, x20, [sp, #0x00]\n"
+    "stp x21, x22, [sp, #0x10]\n"
+    "stp x23, x24, [sp, #0x20]\n"
+    "stp x25, x26, [sp, #0x30]\n"
+    "stp x27, x28, [sp, #0x40]\n"
+    "stp x29, x30, [sp, #0x50]\n"
+    "mov x9, sp\n"
+    "str x9, [x0]\n"
+    "mov sp, x1\n"
+    "ldp x19, x20, [sp, #0x00]\n"
+    "ldp x21, x22, [sp, #0x10]\n"
+    "ldp x23, x24, [sp, #0x20]\n"
+    "ldp x25, x26, [sp, #0x30]\n"
+    "ldp x27, x28, [sp, #0x40]\n"
+    "ldp x29, x30, [sp, #0x50]\n"
+    "add sp, sp, #0x60\n"
+    "ret\n"
+
+    "task_entry:\n"
+    "mov x0, x19\n"
+    "bl " SYMBOL_NAME_PREFIX "start_task\n"
+    "udf #0\n"
+
+    // Builds an interrupt frame on the task stack, IRQs stay masked until the ERET
+    "preempt_entry:\n"
+    "sub sp, sp, #0x130\n"
+    "stp x0, x1, [sp, #0x00]\n"
+    "stp x2, x3, [sp, #0x10]\n"
+    "stp x4, x5, [sp, #0x20]\n"
+    "stp x6, x7, [sp, #0x30]\n"
+    "stp x8, x9, [sp, #0x40]\n"
+    "stp x10, x11, [sp, #0x50]\n"
+    "stp x12, x13, [sp, #0x60]\n"
+    "stp x14, x15, [sp, #0x70]\n"
+    "stp x16, x17, [sp, #0x80]\n"
+    "stp x18, x19, [sp, #0x90]\n"
+    "stp x20, x21, [sp, #0xA0]\n"
+    "stp x22, x23, [sp, #0xB0]\n"
+    "stp x24, x25, [sp, #0xC0]\n"
+    "stp x26, x27, [sp, #0xD0]\n"
+    "stp x28, x29, [sp, #0xE0]\n"
+    "add x1, sp, #0x130\n"
+    "stp x30, x1, [sp, #0xF0]\n"
+    "mrs x0, TPIDR_EL1\n"
+    "ldp x1, x2, [x0, #0x08]\n"
+    "stp x1, x2, [sp, #0x100]\n"
+    "mov x0, sp\n"
+    "bl " SYMBOL_NAME_PREFIX "preempt_task\n"
+    "ldp x1, x2, [x0, #0x100]\n"
+    "msr ELR_EL1, x1\n"
+    "msr SPSR_EL1, x2\n"
+    "ldp x2, x3, [x0, #0x10]\n"
+    "ldp x4, x5, [x0, #0x20]\n"
+    "ldp x6, x7, [x0, #0x30]\n"
+    "ldp x8, x9, [x0, #0x40]\n"
+    "ldp x10, x11, [x0, #0x50]\n"
+    "ldp x12, x13, [x0, #0x60]\n"
+    "ldp x14, x15, [x0, #0x70]\n"
+    "ldp x16, x17, [x0, #0x80]\n"
+    "ldp x18, x19, [x0, #0x90]\n"
+    "ldp x20, x21, [x0, #0xA0]\n"
+    "ldp x22, x23, [x0, #0xB0]\n"
+    "ldp x24, x25, [x0, #0xC0]\n"
+    "ldp x26, x27, [x0, #0xD0]\n"
+    "ldp x28, x29, [x0, #0xE0]\n"
+    "ldr x30, [x0, #0xF0]\n"
+    "add x1, x0, #0x130\n"
+    "mov sp, x1\n"
+    "ldp x0, x1, [x0, #0x00]\n"
+    "eret\n"
+);
+
+static inline struct processor* get_current_processor() {
+    struct processor* processor;
+    __asm__ volatile("mrs %0, TPIDR_EL1\n" : "=r"(processor));
+    return processor;
+}
+#endif
+
+static void lock_run_queue(struct run_queue* run_queue) {
+    while(__atomic_test_and_set(&run_queue->lock, __ATOMIC_ACQUIRE));
+}
+
+static void unlock_run_queue(struct run_queue* run_queue) {
+    __atomic_clear(&run_queue->lock, __ATOMIC_RELEASE);
+}
+
+static void push_to_run_queue(struct run_queue* run_queue, struct scheduler_task* task) {
+    lock_run_queue(run_queue);
+    run_queue->tasks[run_queue->tail++ % RUN_QUEUE_LENGTH] = task;
+    unlock_run_queue(run_queue);
+}
+
+// The owner takes the oldest task, thieves take the newest
+static struct scheduler_task* pop_from_run_queue(struct run_queue* run_queue, bool steal) {
+    struct scheduler_task* task = NULL;
+    lock_run_queue(run_queue);
+    if(run_queue->head != run_queue->tail)
+        task = steal ? run_queue->tasks[--run_queue->tail % RUN_QUEUE_LENGTH] : run_queue->tasks[run_queue->head++ % RUN_QUEUE_LENGTH];
+    unlock_run_queue(run_queue);
+    return task;
+}
+
+// The page fault handler takes pages from here without a lock, the faulting task might be holding the one of the heap
+static void refill_stack_pages(struct processor* processor) {
+    while(processor->number_of_stack_pages < sizeof(processor->stack_pages) / sizeof(processor->stack_pages[0])) {
+        void* page = allocate_memory(&processor->page_cache, GUEST_PAGE_SIZE);
+        if(!page)
+            break;
+        processor->stack_pages[processor->number_of_stack_pages++] = page;
+    }
+}
+
+// Returns NULL once every stack of the window is in use
+static struct scheduler_task* create_task() {
+    while(__atomic_test_and_set(&free_tasks_lock, __ATOMIC_ACQUIRE));
+    struct scheduler_task* task = free_tasks;
+    if(task)
+        free_tasks = task->next_free;
+    __atomic_clear(&free_tasks_lock, __ATOMIC_RELEASE);
+    if(task)
+        return task;
+    // The window holds 2^17 stacks with 3 levels and 2^26 with 4, finished ones are reused and keep the pages they committed
+    size_t levels = get_page_table_levels();
+    uint64_t slot = __atomic_fetch_add(&next_stack_slot, 1, __ATOMIC_RELAXED);
+    if(slot >= (GUEST_HEAP_ADDRESS(levels) - TASK_STACK_ADDRESS(levels)) / TASK_STACK_SIZE)
+        return NULL;
+    // Committing the top page creates the table of pages, into which the page fault handler commits the rest
+    struct processor* processor = get_current_processor();
+    uint64_t top_page_address = TASK_STACK_ADDRESS(levels) + (slot + 1) * TASK_STACK_SIZE - GUEST_PAGE_SIZE, physical_address;
+    if(processor->number_of_stack_pages == 0 ||
+       !translate_address((uint64_t)processor->stack_pages[processor->number_of_stack_pages - 1], &physical_address) ||
+       !map_range(top_page_address, physical_address, GUEST_PAGE_SIZE, MAPPING_READABLE | MAPPING_WRITABLE))
+        return NULL;
+    --processor->number_of_stack_pages;
+    return (struct scheduler_task*)(top_page_address + GUEST_PAGE_SIZE) - 1;
+}
+
+static void initialize_task(struct scheduler_task* task, struct task_queue_entry* entry) {
+    task->function = entry->function;
+    task->argument = entry->argument;
+    task->id = entry->id;
+    task->is_finished = false;
+    // Resumed by switch_task_context with the task in the first callee saved register
+    uint64_t* stack = (uint64_t*)((uint64_t)task & ~15UL);
+#ifdef __x86_64__
+    stack -= 7;
+    for(uint64_t index = 0; index < 6; ++index)
+        stack[index] = 0;
+    stack[4] = (uint64_t)task;
+    stack[6] = (uint64_t)task_entry;
+#elif __aarch64__
+    stack -= 12;
+    for(uint64_t index = 0; index < 11; ++index)
+        stack[index] = 0;
+    stack[0] = (uint64_t)task;
+    stack[11] = (uint64_t)task_entry;
+#endif
+    task->stack_pointer = (uint64_t)stack;
+}
+
+static void destroy_task(struct scheduler_task* task) {
+    while(__atomic_test_and_set(&free_tasks_lock, __ATOMIC_ACQUIRE));
+    task->next_free = free_tasks;
+    free_tasks = task;
+    __atomic_clear(&free_tasks_lock, __ATOMIC_RELEASE);
+}
+
+// Submissions stay queued while there is no stack for them, until running tasks finish
+static struct scheduler_task* take_submitted_task() {
+    if(is_task_queue_empty(&task_submissions))
+        return NULL;
+    struct scheduler_task* task = create_task();
+    if(!task)
+        return NULL;
+    struct task_queue_entry entry;
+    if(!pop_from_task_queue(&task_submissions, &entry)) {
+        destroy_task(task);
+        return NULL;
+    }
+    initialize_task(task, &entry);
+    return task;
+}
+
+static struct scheduler_task* steal_task(struct processor* processor) {
+    uint64_t count = __atomic_load_n(&number_of_processors, __ATOMIC_RELAXED);
+    for(uint64_t offset = 1; offset < count; ++offset) {
+        struct processor* victim = &processors[((uint64_t)(processor - processors) + offset) % count];
+        struct scheduler_task* task = pop_from_run_queue(&victim->run_queue, true);
+        if(task)
+            return task;
+    }
+    return NULL;
+}
+
+static struct scheduler_task* pick_task(struct processor* processor) {
+    struct run_queue* run_queue = &processor->run_queue;
+    // Preempted tasks always fit back into the queue, as new ones are only taken while there is room for one more
+    bool has_room = run_queue->tail - __atomic_load_n(&run_queue->head, __ATOMIC_RELAXED) < RUN_QUEUE_LENGTH - 1;
+    struct scheduler_task* task = NULL;
+    if(has_room && ++processor->number_of_picks % SUBMISSION_INTERVAL == 0)
+        task = take_submitted_task();
+    if(!task)
+        task = pop_from_run_queue(run_queue, false);
+    if(!task && has_room)
+        task = take_submitted_task();
+    if(!task)
+        task = steal_task(processor);
+    return task;
+}
+
+// Called with interrupts disabled, returns once the task is resumed
+static void switch_to_scheduler(struct processor* processor, bool is_finished) {
+    struct scheduler_task* task = processor->current_task;
+    task->is_finished = is_finished;
+    switch_task_context(&task->stack_pointer, processor->scheduler_stack_pointer);
+}
+
+void start_task(struct scheduler_task* task) {
+    enable_interrupts();
+    task->argument = ((task_function)task->function)(task->argument);
+    disable_interrupts();
+    switch_to_scheduler(get_current_processor(), true);
+}
+
+void yield_task() {
+    disable_interrupts();
+    switch_to_scheduler(get_current_processor(), false);
+    enable_interrupts();
+}
+
+struct interrupt_frame* preempt_task(struct interrupt_frame* frame) {
+    switch_to_scheduler(get_current_processor(), false);
+    return frame;
+}
+
+static struct interrupt_frame* expire_time_slice(struct interrupt_frame* frame) {
+    acknowledge_local_timer();
+    struct processor* processor = get_current_processor();
+    // Catches up with the page table changes of other vCPUs at least once per time slice
+    synchronize_tlb(&processor->page_table_generation);
+    if(processor->current_task) {
+        // Return to preempt_entry instead, which saves the task on its own stack and not on this exception stack
+        processor->preempted_instruction_pointer = frame->instruction_pointer;
+        processor->preempted_flags = frame->flags;
+        frame->instruction_pointer = (uint64_t)preempt_entry;
+#ifdef __x86_64__
+        frame->flags &= ~RFLAGS_IF;
+#elif __aarch64__
+        frame->flags |= PSTATE_I;
+#endif
+    }
+    return frame;
+}
+
+// Returns the entry of the page, or NULL if its table of pages is missing
+static uint64_t* get_stack_page_entry(uint64_t address) {
+    for(size_t level = get_page_table_levels() - 1; level > 0; --level)
+        if((*get_page_table_entry(address, level) & PT_PRE) == 0)
+            return NULL;
+    return get_page_table_entry(address, 0);
+}
+
+// Takes no lock, neither of the heap nor of the page table, as the faulting task might hold either
+static struct interrupt_frame* commit_stack_page(struct interrupt_frame* frame) {
+    uint64_t address = frame->fault_address & ~(GUEST_PAGE_SIZE - 1);
+    // The lowest page of every stack stays unmapped as its guard
+    uint64_t stacks_address = TASK_STACK_ADDRESS(get_page_table_levels());
+    struct processor* processor = get_current_processor();
+    if(address >= stacks_address && address < GUEST_HEAP_ADDRESS(get_page_table_levels()) && (address - stacks_address) % TASK_STACK_SIZE != 0 &&
+       processor->number_of_stack_pages > 0) {
+        uint64_t* entry = get_stack_page_entry(address);
+        uint64_t physical_address;
+        if(entry && (*entry & PT_PRE) == 0 && translate_address((uint64_t)processor->stack_pages[processor->number_of_stack_pages - 1], &physical_address)) {
+            --processor->number_of_stack_pages;
+            // Other vCPUs never cached the entry while it was not present
+            *entry = get_leaf_entry_of_mapping(MAPPING_READABLE | MAPPING_WRITABLE) | physical_address;
+            invalidate_tlb_entry(address);
+            return frame;
+        }
+    }
+    if(chained_page_fault_handler)
+        return chained_page_fault_handler(frame);
+    hypercall(HYPERCALL_EXCEPTION, (uint64_t)frame, 0, 0);
+    return frame;
+}
+
+static void initialize_processor(struct processor* processor, uint64_t exception_stack_top) {
+    processor->self = processor;
+#ifdef __x86_64__
+    // Page faults of tasks growing their stack and the timer both get a stack of their own
+    write_msr(MSR_GS_BASE, (uint64_t)processor);
+    processor->task_state_segment.io_map_base = sizeof(struct task_state_segment);
+    processor->task_state_segment.interrupt_stack_table[0] = exception_stack_top & ~15UL;
+    processor->task_state_segment.interrupt_stack_table[1] = (exception_stack_top - EXCEPTION_STACK_SIZE / 2) & ~15UL;
+    load_task_state_segment((uint64_t)&processor->task_state_segment, sizeof(struct task_state_segment) - 1);
+    set_interrupt_stack_of_vector(INTERRUPT_VECTOR_TIMER, 1);
+    set_interrupt_stack_of_vector(INTERRUPT_VECTOR_PAGE_FAULT, 2);
+#elif __aarch64__
+    (void)exception_stack_top;
+    __asm__ volatile("msr TPIDR_EL1, %0\n" : : "r"(processor));
+#endif
+    // The handler table is shared by all vCPUs, only the first processor must remember what it replaces
+    if(!__atomic_exchange_n(&are_handlers_registered, true, __ATOMIC_ACQ_REL)) {
+#ifdef __x86_64__
+        register_interrupt_handler(INTERRUPT_VECTOR_PREEMPT, preempt_task);
+#endif
+        register_interrupt_handler(INTERRUPT_VECTOR_TIMER, expire_time_slice);
+        chained_page_fault_handler = register_interrupt_handler(INTERRUPT_VECTOR_PAGE_FAULT, commit_stack_page);
+    }
+    uint64_t count = __atomic_load_n(&number_of_processors, __ATOMIC_RELAXED);
+    uint64_t index = (uint64_t)(processor - processors);
+    while(count <= index && !__atomic_compare_exchange_n(&number_of_processors, &count, index + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    processor->is_initialized = true;
+}
+
+// Runs until there is nothing left to do and returns the number of completed tasks, a time slice of zero never preempts
+uint64_t schedule_tasks(uint64_t processor_index, uint64_t time_slice, uint64_t exception_stack_top) {
+    bool were_interrupts_enabled = are_interrupts_enabled();
+    disable_interrupts();
+    if(processor_index >= SCHEDULER_MAXIMUM_PROCESSORS) {
+        if(were_interrupts_enabled)
+            enable_interrupts();
+        return 0;
+    }
+    struct processor* processor = &processors[processor_index];
+    if(!processor->is_initialized)
+        initialize_processor(processor, exception_stack_top);
+    if(time_slice != 0 && !processor->has_local_timer)
+        processor->has_local_timer = initialize_local_timer();
+    if(!processor->has_local_timer)
+        time_slice = 0;
+    uint64_t number_of_completed_tasks = 0;
+    struct scheduler_task* task;
+    for(refill_stack_pages(processor); (task = pick_task(processor)); refill_stack_pages(processor)) {
+        synchronize_tlb(&processor->page_table_generation);
+        processor->current_task = task;
+        if(time_slice != 0)
+            arm_local_timer(time_slice);
+        switch_task_context(&processor->scheduler_stack_pointer, task->stack_pointer);
+        if(time_slice != 0)
+            arm_local_timer(0);
+        processor->current_task = NULL;
+        if(!task->is_finished) {
+            // Only now that its context is saved, other vCPUs may steal it
+            push_to_run_queue(&processor->run_queue, task);
+            continue;
+        }
+        struct task_queue_entry entry = { .function = task->function, .argument = task->argument, .id = task->id };
+        destroy_task(task);
+        // The host drains completions concurrently
+        while(!push_to_task_queue(&task_completions, &entry));
+        ++number_of_completed_tasks;
+    }
+    if(were_interrupts_enabled)
+        enable_interrupts();
+    return number_of_completed_tasks;
+}
@@ -1,25 +1,386 @@
 #include <guest.h>
 
-bool walk_page_table(bool write_access, uint64_t access_offset, uint64_t virtual_address, uint64_t* physical_address) {
-    size_t parent_level = GUEST_PAGE_TABLE_LEVELS;
-    while(1) {
-        uint64_t slot_index = (virtual_address >> (GUEST_ENTRIES_PER_PAGE_SHIFT * parent_level + GUEST_PAGE_TABLE_ENTRY_SHIFT)) & (GUEST_ENTRIES_PER_PAGE - 1);
-        uint64_t* entry = (uint64_t*)(*physical_address + access_offset + slot_index * sizeof(uint64_t));
+#define PAGE_TABLE_INDEX(virtual_address, level) (((virtual_address) >> GUEST_PAGE_TABLE_LEVEL_SHIFT(level)) & (GUEST_ENTRIES_PER_PAGE - 1))
 #ifdef __x86_64__
-        if((*entry & PT_PRE) == 0 || (write_access && (*entry & PT_RW) == 0))
+#define IS_LEAF_ENTRY(entry, level) ((level) == 0 || ((entry) & PT_LEAF) != 0)
 #elif __aarch64__
-        if((*entry & PT_PRE) == 0 || (write_access && (*entry & PT_RO) != 0))
+#define IS_LEAF_ENTRY(entry, level) ((level) == 0 || ((entry) & PT_NOT_LEAF) == 0)
 #endif
+
+// Instantiated once per depth, so the loop has constant bounds and the compiler unrolls it
+static inline __attribute__((always_inline)) bool walk_page_table_of_depth(struct page_table_access* access, bool write_access, uint64_t virtual_address, uint64_t* physical_address, const size_t levels) {
+    *physical_address = access->root;
+    size_t parent_level = levels;
+    while(1) {
+        uint64_t* entries = access->resolve_table(access->context, *physical_address, virtual_address, parent_level - 1);
+        if(!entries)
             return false;
-        *physical_address = *entry & GUEST_ENTRY_ADDRESS_MASK;
+        uint64_t entry = entries[PAGE_TABLE_INDEX(virtual_address, parent_level - 1)];
 #ifdef __x86_64__
-        if(parent_level == 1 || (*entry & PT_LEAF) != 0)
+        if((entry & PT_PRE) == 0 || (write_access && (entry & PT_RW) == 0))
 #elif __aarch64__
-        if(parent_level == 1 || (*entry & PT_NOT_LEAF) == 0)
+        if((entry & PT_PRE) == 0 || (write_access && (entry & PT_RO) != 0 && (entry & PT_DBM) == 0))
 #endif
+            return false;
+        *physical_address = entry & GUEST_ENTRY_ADDRESS_MASK;
+        if(IS_LEAF_ENTRY(entry, parent_level - 1))
             break;
         --parent_level;
     }
     *physical_address += virtual_address & (((uint64_t)1UL << (GUEST_ENTRIES_PER_PAGE_SHIFT * parent_level + GUEST_PAGE_TABLE_ENTRY_SHIFT)) - 1UL);
     return true;
 }
+
+bool walk_page_table(struct page_table_access* access, bool write_access, uint64_t virtual_address, uint64_t* physical_address) {
+    // Every depth which the page size supports
+    switch(access->levels) {
+#if GUEST_PAGE_TABLE_MINIMUM_LEVELS <= 2
+        case 2:
+            return walk_page_table_of_depth(access, write_access, virtual_address, physical_address, 2);
+#endif
+#if GUEST_PAGE_TABLE_MINIMUM_LEVELS <= 3 && GUEST_PAGE_TABLE_MAXIMUM_LEVELS >= 3
+        case 3:
+            return walk_page_table_of_depth(access, write_access, virtual_address, physical_address, 3);
+#endif
+#if GUEST_PAGE_TABLE_MAXIMUM_LEVELS >= 4
+        case 4:
+            return walk_page_table_of_depth(access, write_access, virtual_address, physical_address, 4);
+#endif
+#if GUEST_PAGE_TABLE_MAXIMUM_LEVELS >= 5
+        case 5:
+            return walk_page_table_of_depth(access, write_access, virtual_address, physical_address, 5);
+#endif
+        default:
+            return false;
+    }
+}
+
+uint64_t get_leaf_entry_of_mapping(uint8_t flags) {
+    uint64_t entry = 0;
+#ifdef __x86_64__
+    if((flags & MAPPING_READABLE) != 0)
+        entry |= PT_PRE;
+    if((flags & MAPPING_WRITABLE) != 0)
+        entry |= PT_RW;
+    if((flags & MAPPING_EXECUTABLE) == 0)
+        entry |= PT_NX;
+    if((flags & MAPPING_USER) != 0)
+        entry |= PT_USER;
+    // Indices into the page attribute table which the host programs
+    if((flags & MAPPING_MEMORY_TYPE) == MAPPING_WRITE_THROUGH)
+        entry |= PT_PWT;
+    else if((flags & MAPPING_MEMORY_TYPE) == MAPPING_WRITE_COMBINING)
+        entry |= PT_PCD;
+    else if((flags & MAPPING_MEMORY_TYPE) == MAPPING_UNCACHED)
+        entry |= PT_PCD | PT_PWT;
+#elif __aarch64__
+    // Non-global so that the host can flush the TLB by switching the address space identifier
+    if((flags & MAPPING_READABLE) != 0)
+        entry |= PT_ISH | PT_ACC | PT_NG | PT_NOT_LEAF | PT_PRE;
+    if((flags & MAPPING_WRITABLE) == 0)
+        entry |= PT_RO;
+    if((flags & MAPPING_EXECUTABLE) == 0)
+        entry |= PT_NX;
+    // The supervisor never executes user pages
+    if((flags & MAPPING_USER) != 0)
+        entry |= PT_USER | PT_PNX;
+    // Indices into MAIR_EL1 which the host programs
+    if((flags & MAPPING_MEMORY_TYPE) == MAPPING_WRITE_THROUGH)
+        entry |= PT_MEM_WT;
+    else if((flags & MAPPING_MEMORY_TYPE) == MAPPING_WRITE_COMBINING)
+        entry |= PT_MEM_NC;
+    else if((flags & MAPPING_MEMORY_TYPE) == MAPPING_UNCACHED)
+        entry |= PT_DEVICE;
+#endif
+    return entry;
+}
+
+uint64_t* find_leaf_entry_in_page_table(struct page_table_access* access, uint64_t virtual_address) {
+    uint64_t table_physical_address = access->root;
+    for(size_t parent_level = access->levels; parent_level > 0; --parent_level) {
+        uint64_t* entries = access->resolve_table(access->context, table_physical_address, virtual_address, parent_level - 1);
+        if(!entries)
+            return NULL;
+        uint64_t* entry = &entries[PAGE_TABLE_INDEX(virtual_address, parent_level - 1)];
+        if((*entry & PT_PRE) == 0)
+            return NULL;
+        if(IS_LEAF_ENTRY(*entry, parent_level - 1))
+            return entry;
+        table_physical_address = *entry & GUEST_ENTRY_ADDRESS_MASK;
+    }
+    return NULL;
+}
+
+// Returns the table of the given level which covers virtual_address, or NULL if it is missing or a huge page is in the way
+static uint64_t* get_table_of_level(struct page_table_access* access, uint64_t virtual_address, size_t level, bool allocate) {
+    uint64_t table_physical_address = access->root;
+    uint64_t* entries = access->resolve_table(access->context, table_physical_address, virtual_address, access->levels - 1);
+    for(size_t parent_level = access->levels - 1; entries && parent_level > level; --parent_level) {
+        uint64_t* entry = &entries[PAGE_TABLE_INDEX(virtual_address, parent_level)];
+        if((*entry & PT_PRE) != 0) {
+            if(IS_LEAF_ENTRY(*entry, parent_level))
+                return NULL;
+            table_physical_address = *entry & GUEST_ENTRY_ADDRESS_MASK;
+            entries = access->resolve_table(access->context, table_physical_address, virtual_address, parent_level - 1);
+        } else if(allocate) {
+            entries = access->allocate_table(access->context, &table_physical_address);
+            // Publish the table only after it was zeroed, other vCPUs might be walking concurrently
+            if(entries) {
+                __atomic_store_n(entry, PT_BRANCH | table_physical_address, __ATOMIC_RELEASE);
+#ifdef __aarch64__
+                __asm__ volatile("dsb ishst\nisb\n" : : : "memory");
+#endif
+            }
+        } else
+            return NULL;
+    }
+    return entries;
+}
+
+bool write_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t physical_address, uint64_t length, uint8_t flags) {
+    uint64_t leaf_entry = get_leaf_entry_of_mapping(flags);
+    for(uint64_t offset = 0; offset < length; ) {
+        uint64_t* entries = get_table_of_level(access, virtual_address + offset, 0, true);
+        if(!entries)
+            return false;
+        for(uint64_t index = PAGE_TABLE_INDEX(virtual_address + offset, 0); index < GUEST_ENTRIES_PER_PAGE && offset < length; ++index, offset += GUEST_PAGE_SIZE) {
+            if((entries[index] & PT_PRE) != 0)
+                access->tlb_is_stale = true;
+            entries[index] = leaf_entry | (physical_address + offset);
+        }
+    }
+    return true;
+}
+
+// Replaces the huge leaf entry of the given level by a table of the level below, which maps the same memory
+static uint64_t* split_huge_leaf_entry(struct page_table_access* access, uint64_t* entry, size_t level) {
+    uint64_t table_physical_address;
+    uint64_t* entries = access->allocate_table(access->context, &table_physical_address);
+    if(!entries)
+        return NULL;
+    uint64_t leaf_entry = *entry & ~GUEST_ENTRY_ADDRESS_MASK, physical_address = *entry & GUEST_ENTRY_ADDRESS_MASK;
+    if(level == 1) {
+#ifdef __x86_64__
+        leaf_entry &= ~PT_LEAF;
+#elif __aarch64__
+        leaf_entry |= PT_NOT_LEAF;
+#endif
+    }
+    for(uint64_t index = 0; index < GUEST_ENTRIES_PER_PAGE; ++index)
+        entries[index] = leaf_entry | (physical_address + (index << GUEST_PAGE_TABLE_LEVEL_SHIFT(level - 1)));
+    __atomic_store_n(entry, PT_BRANCH | table_physical_address, __ATOMIC_RELEASE);
+#ifdef __aarch64__
+    __asm__ volatile("dsb ishst\nisb\n" : : : "memory");
+#endif
+    access->tlb_is_stale = true;
+    return entries;
+}
+
+// Finds the entry which maps virtual_address, a huge leaf only if it lies within the range, otherwise it is split.
+// Sets entry to NULL at a gap in a table of the given level, fails only if no table was left for a split.
+static bool get_entry_in_range(struct page_table_access* access, uint64_t virtual_address, uint64_t end_address, uint64_t** entry, size_t* level) {
+    *level = access->levels - 1;
+    uint64_t* entries = access->resolve_table(access->context, access->root, virtual_address, *level);
+    while(entries) {
+        *entry = &entries[PAGE_TABLE_INDEX(virtual_address, *level)];
+        if(*level == 0)
+            return true;
+        if(**entry == 0)
+            break;
+        if((**entry & PT_PRE) != 0 && !IS_LEAF_ENTRY(**entry, *level))
+            entries = access->resolve_table(access->context, **entry & GUEST_ENTRY_ADDRESS_MASK, virtual_address, *level - 1);
+        else if(virtual_address % (1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(*level)) == 0 && end_address - virtual_address >= 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(*level))
+            return true;
+        else if(!(entries = split_huge_leaf_entry(access, *entry, *level)))
+            return false;
+        --*level;
+    }
+    *entry = NULL;
+    return true;
+}
+
+// Rewrites the leaves which are not empty to leaf_entry, which is zero to clear them
+static bool update_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length, uint64_t leaf_entry) {
+    for(uint64_t offset = 0; offset < length; ) {
+        uint64_t* entry;
+        size_t level;
+        if(!get_entry_in_range(access, virtual_address + offset, virtual_address + length, &entry, &level))
+            return false;
+        uint64_t entry_span = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(level);
+        if(!entry) {
+            offset += entry_span - (virtual_address + offset) % entry_span;
+            continue;
+        }
+        // Huge leaves keep their size
+        uint64_t entry_of_level = leaf_entry;
+        if(level > 0 && leaf_entry != 0) {
+#ifdef __x86_64__
+            entry_of_level |= PT_LEAF;
+#elif __aarch64__
+            entry_of_level &= ~PT_NOT_LEAF;
+#endif
+        }
+        uint64_t end_index = (level == 0) ? GUEST_ENTRIES_PER_PAGE : PAGE_TABLE_INDEX(virtual_address + offset, level) + 1;
+        for(uint64_t index = PAGE_TABLE_INDEX(virtual_address + offset, level); index < end_index && offset < length; ++index, ++entry, offset += entry_span) {
+            // Entries which were never mapped stay empty
+            if(*entry == 0)
+                continue;
+            if((*entry & PT_PRE) != 0)
+                access->tlb_is_stale = true;
+            *entry = (leaf_entry == 0) ? 0 : entry_of_level | (*entry & GUEST_ENTRY_ADDRESS_MASK);
+        }
+    }
+    return true;
+}
+
+bool clear_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length) {
+    return update_page_table_range(access, virtual_address, length, 0);
+}
+
+bool protect_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length, uint8_t flags) {
+    return update_page_table_range(access, virtual_address, length, get_leaf_entry_of_mapping(flags));
+}
+
+bool link_table_into_page_table(struct page_table_access* access, uint64_t virtual_address, size_t level, uint64_t table_physical_address) {
+    uint64_t* entries = get_table_of_level(access, virtual_address, level + 1, true);
+    if(!entries)
+        return false;
+    uint64_t* entry = &entries[PAGE_TABLE_INDEX(virtual_address, level + 1)];
+    if(*entry != 0)
+        return false;
+    __atomic_store_n(entry, PT_BRANCH | table_physical_address, __ATOMIC_RELEASE);
+#ifdef __aarch64__
+    __asm__ volatile("dsb ishst\nisb\n" : : : "memory");
+#endif
+    return true;
+}
+
+bool unlink_table_from_page_table(struct page_table_access* access, uint64_t virtual_address, size_t level) {
+    uint64_t* entries = get_table_of_level(access, virtual_address, level + 1, false);
+    if(!entries)
+        return false;
+    uint64_t* entry = &entries[PAGE_TABLE_INDEX(virtual_address, level + 1)];
+    if((*entry & PT_PRE) == 0 || IS_LEAF_ENTRY(*entry, level + 1))
+        return false;
+    *entry = 0;
+    access->tlb_is_stale = true;
+    return true;
+}
+
+#ifdef __x86_64__
+#define IS_DIRTY_ENTRY(entry) (((entry) & PT_DIRTY) != 0)
+#elif __aarch64__
+// Writable entries count as dirty until they are cleaned, which makes them read-only until the MMU records a write
+#define IS_DIRTY_ENTRY(entry) (((entry) & PT_RO) == 0)
+#endif
+
+static uint64_t clean_leaf_entry(uint64_t entry, uint8_t clear_flags) {
+    if((clear_flags & PAGE_ACCESSED) != 0)
+        entry &= ~PT_ACC;
+#ifdef __x86_64__
+    if((clear_flags & PAGE_DIRTY) != 0)
+        entry &= ~PT_DIRTY;
+#elif __aarch64__
+    if((clear_flags & PAGE_DIRTY) != 0 && ((entry & PT_RO) == 0 || (entry & PT_DBM) != 0))
+        entry |= PT_DBM | PT_RO;
+#endif
+    return entry;
+}
+
+void harvest_page_table_range(struct page_table_access* access, uint64_t virtual_address, uint64_t length, uint8_t clear_flags, uint8_t page_flags[]) {
+    for(uint64_t offset = 0; offset < length; ) {
+        // Descend to the table which holds the leaf or the gap covering the current address
+        size_t level = access->levels - 1;
+        uint64_t* entries = access->resolve_table(access->context, access->root, virtual_address + offset, level);
+        while(entries) {
+            uint64_t entry = __atomic_load_n(&entries[PAGE_TABLE_INDEX(virtual_address + offset, level)], __ATOMIC_RELAXED);
+            if((entry & PT_PRE) == 0 || IS_LEAF_ENTRY(entry, level))
+                break;
+            --level;
+            entries = access->resolve_table(access->context, entry & GUEST_ENTRY_ADDRESS_MASK, virtual_address + offset, level);
+        }
+        if(!entries) {
+            uint64_t table_span = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(level + 1);
+            for(uint64_t end = offset + table_span - (virtual_address + offset) % table_span; offset < end && offset < length; offset += GUEST_PAGE_SIZE)
+                page_flags[offset / GUEST_PAGE_SIZE] = 0;
+            continue;
+        }
+        for(uint64_t index = PAGE_TABLE_INDEX(virtual_address + offset, level); index < GUEST_ENTRIES_PER_PAGE && offset < length; ++index) {
+            uint64_t entry = __atomic_load_n(&entries[index], __ATOMIC_RELAXED);
+            if((entry & PT_PRE) != 0 && !IS_LEAF_ENTRY(entry, level))
+                break;
+            uint8_t flags = 0;
+            if((entry & PT_PRE) != 0) {
+                // Compare and swap, so that bits which the MMU sets meanwhile are not lost
+                uint64_t cleaned_entry = clean_leaf_entry(entry, clear_flags);
+                while(cleaned_entry != entry && !__atomic_compare_exchange_n(&entries[index], &entry, cleaned_entry, true, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+                    cleaned_entry = clean_leaf_entry(entry, clear_flags);
+                if(cleaned_entry != entry)
+                    access->tlb_is_stale = true;
+                flags = PAGE_MAPPED | ((entry & PT_ACC) != 0 ? PAGE_ACCESSED : 0) | (IS_DIRTY_ENTRY(entry) ? PAGE_DIRTY : 0);
+            }
+            uint64_t entry_span = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(level);
+            for(uint64_t end = offset + entry_span - (virtual_address + offset) % entry_span; offset < end && offset < length; offset += GUEST_PAGE_SIZE)
+                page_flags[offset / GUEST_PAGE_SIZE] = flags;
+        }
+    }
+}
+
+__extension__ typedef unsigned __int128 uint128_t;
+
+uint64_t convert_counter_using_clock(const volatile struct guest_clock* clock, uint64_t counter) {
+    uint128_t elapsed_ticks = counter - clock->counter_timestamp;
+    return clock->monotonic_timestamp + (uint64_t)((elapsed_ticks * clock->nanoseconds_per_tick) >> 32);
+}
+
+// Producers and consumers claim a position and only touch its entry when the turn of the entry matches, so they never block each other
+bool push_to_task_queue(struct task_queue* queue, const struct task_queue_entry* entry) {
+    uint64_t position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+    while(1) {
+        struct task_queue_entry* slot = &queue->entries[position % TASK_QUEUE_LENGTH];
+        uint64_t turn = position / TASK_QUEUE_LENGTH * 2;
+        uint64_t slot_turn = __atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE);
+        if(slot_turn == turn) {
+            if(__atomic_compare_exchange_n(&queue->push_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                slot->function = entry->function;
+                slot->argument = entry->argument;
+                slot->id = entry->id;
+                __atomic_store_n(&slot->turn, turn + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else {
+            // Still occupied from the previous lap means full, unless another producer moved on already
+            uint64_t current_position = __atomic_load_n(&queue->push_position, __ATOMIC_RELAXED);
+            if(slot_turn < turn && current_position == position)
+                return false;
+            position = current_position;
+        }
+    }
+}
+
+bool pop_from_task_queue(struct task_queue* queue, struct task_queue_entry* entry) {
+    uint64_t position = __atomic_load_n(&queue->pop_position, __ATOMIC_RELAXED);
+    while(1) {
+        struct task_queue_entry* slot = &queue->entries[position % TASK_QUEUE_LENGTH];
+        uint64_t turn = position / TASK_QUEUE_LENGTH * 2 + 1;
+        uint64_t slot_turn = __atomic_load_n(&slot->turn, __ATOMIC_ACQUIRE);
+        if(slot_turn == turn) {
+            if(__atomic_compare_exchange_n(&queue->pop_position, &position, position + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                entry->function = slot->function;
+                entry->argument = slot->argument;
+                entry->id = slot->id;
+                __atomic_store_n(&slot->turn, turn + 1, __ATOMIC_RELEASE);
+                return true;
+            }
+        } else {
+            uint64_t current_position = __atomic_load_n(&queue->pop_position, __ATOMIC_RELAXED);
+            if(slot_turn < turn && current_position == position)
+                return false;
+            position = current_position;
+        }
+    }
+}
+
+bool is_task_queue_empty(struct task_queue* queue) {
+    return __atomic_load_n(&queue->pop_position, __ATOMIC_ACQUIRE) == __atomic_load_n(&queue->push_position, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,247 @@
+#include <guest.h>
+
+// Stack pointer of the supervisor while user mode runs, everything above it is the saved supervisor context.
+// Like the user stack pointer it is a single global, so only one vCPU may be in user mode at a time.
+uint64_t supervisor_stack_pointer;
+static bool is_user_mode_entered;
+
+#ifdef __x86_64__
+// For vCPUs which did not load a task state segment of their own yet, rsp0 is kept at the supervisor stack pointer
+static struct task_state_segment task_state_segment = { .io_map_base = sizeof(struct task_state_segment) };
+uint64_t user_stack_pointer;
+
+// SYSRET uses STAR[63:48] + 8 for SS and + 16 for CS, SYSCALL uses STAR[47:32] for CS and + 8 for SS
+#define KERNEL_CODE_SEGMENT 0x20
+#define USER_DATA_SEGMENT   0x33
+#define USER_CODE_SEGMENT   0x3B
+
+__asm__(
+    ".global " SYMBOL_NAME_PREFIX "enter_user_mode\n"
+    SYMBOL_NAME_PREFIX "enter_user_mode:\n"
+    "push %rbx\n"
+    "push %rbp\n"
+    "push %r12\n"
+    "push %r13\n"
+    "push %r14\n"
+    "push %r15\n"
+    "movq %rsp, " SYMBOL_NAME_PREFIX "supervisor_stack_pointer(%rip)\n"
+    "movq %rsp, 4(%rcx)\n"
+    // Enter as if called, without leaking supervisor registers
+    "push $" EXPAND_AND_STRINGIFY(USER_DATA_SEGMENT) "\n"
+    "leaq -8(%rsi), %rax\n"
+    "push %rax\n"
+    "push $2\n"
+    "push $" EXPAND_AND_STRINGIFY(USER_CODE_SEGMENT) "\n"
+    "push %rdi\n"
+    "movq %rdx, %rdi\n"
+    "xorl %eax, %eax\n"
+    "xorl %ebx, %ebx\n"
+    "xorl %ecx, %ecx\n"
+    "xorl %edx, %edx\n"
+    "xorl %esi, %esi\n"
+    "xorl %ebp, %ebp\n"
+    "xorl %r8d, %r8d\n"
+    "xorl %r9d, %r9d\n"
+    "xorl %r10d, %r10d\n"
+    "xorl %r12d, %r12d\n"
+    "xorl %r13d, %r13d\n"
+    "xorl %r14d, %r14d\n"
+    "xorl %r15d, %r15d\n"
+    "iretq\n"
+
+    ".global " SYMBOL_NAME_PREFIX "leave_user_mode\n"
+    SYMBOL_NAME_PREFIX "leave_user_mode:\n"
+    "movq " SYMBOL_NAME_PREFIX "supervisor_stack_pointer(%rip), %rsp\n"
+    "movq %rdi, %rax\n"
+    "pop %r15\n"
+    "pop %r14\n"
+    "pop %r13\n"
+    "pop %r12\n"
+    "pop %rbp\n"
+    "pop %rbx\n"
+    "ret\n"
+
+    // Builds the same frame as an interrupt would, rcx and r11 hold the user instruction pointer and flags
+    "system_call_entry:\n"
+    "movq %rsp, " SYMBOL_NAME_PREFIX "user_stack_pointer(%rip)\n"
+    "movq " SYMBOL_NAME_PREFIX "supervisor_stack_pointer(%rip), %rsp\n"
+    "push $" EXPAND_AND_STRINGIFY(USER_DATA_SEGMENT) "\n"
+    "push " SYMBOL_NAME_PREFIX "user_stack_pointer(%rip)\n"
+    "push %r11\n"
+    "push $" EXPAND_AND_STRINGIFY(USER_CODE_SEGMENT) "\n"
+    "push %rcx\n"
+    "push $0\n"
+    "push $" EXPAND_AND_STRINGIFY(NUMBER_OF_INTERRUPT_VECTORS) "\n"
+    "push %r15\n"
+    "push %r14\n"
+    "push %r13\n"
+    "push %r12\n"
+    "push %r11\n"
+    "push %r10\n"
+    "push %r9\n"
+    "push %r8\n"
+    "push %rbp\n"
+    "push %rdi\n"
+    "push %rsi\n"
+    "push %rdx\n"
+    "push %rcx\n"
+    "push %rbx\n"
+    "push %rax\n"
+    "push $0\n"
+    "movq %rsp, %rdi\n"
+    "andq $-16, %rsp\n"
+    "call " SYMBOL_NAME_PREFIX "dispatch_system_call\n"
+    "movq %rax, %rsp\n"
+    "addq $8, %rsp\n"
+    "pop %rax\n"
+    "pop %rbx\n"
+    "pop %rcx\n"
+    "pop %rdx\n"
+    "pop %rsi\n"
+    "pop %rdi\n"
+    "pop %rbp\n"
+    "pop %r8\n"
+    "pop %r9\n"
+    "pop %r10\n"
+    "pop %r11\n"
+    "pop %r12\n"
+    "pop %r13\n"
+    "pop %r14\n"
+    "pop %r15\n"
+    "addq $16, %rsp\n"
+    "pop %rcx\n"
+    "addq $8, %rsp\n"
+    "pop %r11\n"
+    "pop %rsp\n"
+    "sysretq\n"
+);
+
+void system_call_entry();
+uint64_t enter_user_mode(uint64_t entry_point, uint64_t stack_pointer, uint64_t argument, struct task_state_segment* task_state_segment);
+#elif __aarch64__
+#ifdef __APPLE__
+#define PAGE_OF(symbol) SYMBOL_NAME_PREFIX symbol "@PAGE"
+#define PAGE_OFFSET_OF(symbol) SYMBOL_NAME_PREFIX symbol "@PAGEOFF"
+#else
+#define PAGE_OF(symbol) symbol
+#define PAGE_OFFSET_OF(symbol) ":lo12:" symbol
+#endif
+
+// Exceptions from EL0 are taken on SP_EL1, which is left at the supervisor stack pointer
+__asm__(
+    ".global " SYMBOL_NAME_PREFIX "enter_user_mode\n"
+    SYMBOL_NAME_PREFIX "enter_user_mode:\n"
+    "stp x29, x30, [sp, #-0x70]!\n"
+    "stp x27, x28, [sp, #0x10]\n"
+    "stp x25, x26, [sp, #0x20]\n"
+    "stp x23, x24, [sp, #0x30]\n"
+    "stp x21, x22, [sp, #0x40]\n"
+    "stp x19, x20, [sp, #0x50]\n"
+    "mrs x9, DAIF\n"
+    "str x9, [sp, #0x60]\n"
+    "mov x9, sp\n"
+    "adrp x10, " PAGE_OF("supervisor_stack_pointer") "\n"
+    "str x9, [x10, " PAGE_OFFSET_OF("supervisor_stack_pointer") "]\n"
+    // Enter as if called, without leaking supervisor registers
+    "msr ELR_EL1, x0\n"
+    "msr SP_EL0, x1\n"
+    "msr SPSR_EL1, xzr\n"
+    "mov x0, x2\n"
+    "mov x1, xzr\n"
+    "mov x2, xzr\n"
+    "mov x9, xzr\n"
+    "mov x10, xzr\n"
+    "mov x19, xzr\n"
+    "mov x20, xzr\n"
+    "mov x21, xzr\n"
+    "mov x22, xzr\n"
+    "mov x23, xzr\n"
+    "mov x24, xzr\n"
+    "mov x25, xzr\n"
+    "mov x26, xzr\n"
+    "mov x27, xzr\n"
+    "mov x28, xzr\n"
+    "mov x29, xzr\n"
+    "mov x30, xzr\n"
+    "eret\n"
+
+    ".global " SYMBOL_NAME_PREFIX "leave_user_mode\n"
+    SYMBOL_NAME_PREFIX "leave_user_mode:\n"
+    "adrp x9, " PAGE_OF("supervisor_stack_pointer") "\n"
+    "ldr x9, [x9, " PAGE_OFFSET_OF("supervisor_stack_pointer") "]\n"
+    "mov sp, x9\n"
+    "ldr x9, [sp, #0x60]\n"
+    "msr DAIF, x9\n"
+    "ldp x19, x20, [sp, #0x50]\n"
+    "ldp x21, x22, [sp, #0x40]\n"
+    "ldp x23, x24, [sp, #0x30]\n"
+    "ldp x25, x26, [sp, #0x20]\n"
+    "ldp x27, x28, [sp, #0x10]\n"
+    "ldp x29, x30, [sp], #0x70\n"
+    "ret\n"
+);
+
+uint64_t enter_user_mode(uint64_t entry_point, uint64_t stack_pointer, uint64_t argument);
+#endif
+
+uint64_t run_in_user_mode(uint64_t entry_point, uint64_t stack_pointer, uint64_t argument) {
+    if(__atomic_test_and_set(&is_user_mode_entered, __ATOMIC_ACQUIRE))
+        INVALID_INSTRUCTION
+#ifdef __x86_64__
+    // Interrupts from user mode switch to rsp0 of the task state segment of this vCPU
+    struct task_state_segment* task_state_segment = get_task_state_segment();
+    if(!task_state_segment)
+        INVALID_INSTRUCTION
+    uint64_t result = enter_user_mode(entry_point, stack_pointer, argument, task_state_segment);
+#elif __aarch64__
+    uint64_t result = enter_user_mode(entry_point, stack_pointer, argument);
+#endif
+    __atomic_clear(&is_user_mode_entered, __ATOMIC_RELEASE);
+    return result;
+}
+
+static uint64_t exit_system_call(uint64_t number, uint64_t arguments[6]) {
+    (void)number;
+    leave_user_mode(arguments[0]);
+    return 0;
+}
+
+static uint64_t forward_system_call(uint64_t number, uint64_t arguments[6]) {
+    return hypercall(HYPERCALL_SYSTEM_CALL, number, (uint64_t)arguments, 0);
+}
+
+static system_call_handler system_call_handlers[NUMBER_OF_SYSTEM_CALLS] = {
+    [SYSTEM_CALL_EXIT] = exit_system_call,
+};
+
+bool register_system_call_handler(uint64_t number, system_call_handler handler) {
+    if(number >= NUMBER_OF_SYSTEM_CALLS)
+        return false;
+    system_call_handlers[number] = handler;
+    return true;
+}
+
+bool forward_system_call_to_host(uint64_t number) {
+    return register_system_call_handler(number, forward_system_call);
+}
+
+struct interrupt_frame* dispatch_system_call(struct interrupt_frame* frame) {
+    uint64_t number = SYSTEM_CALL_NUMBER(frame);
+    uint64_t arguments[6] = SYSTEM_CALL_ARGUMENTS(frame);
+    system_call_handler handler = (number < NUMBER_OF_SYSTEM_CALLS) ? system_call_handlers[number] : NULL;
+    SYSTEM_CALL_RESULT(frame) = handler ? handler(number, arguments) : (uint64_t)-38; // ENOSYS
+    return frame;
+}
+
+void initialize_user_mode() {
+#ifdef __x86_64__
+    // Keeps the one of the scheduler, with the interrupt stacks of its page faults and timer
+    if(!get_task_state_segment())
+        load_task_state_segment((uint64_t)&task_state_segment, sizeof(struct task_state_segment) - 1);
+    write_msr(MSR_STAR, (uint64_t)(USER_DATA_SEGMENT - 8 - 3) << 48 | (uint64_t)KERNEL_CODE_SEGMENT << 32);
+    write_msr(MSR_LSTAR, (uint64_t)system_call_entry);
+    write_msr(MSR_SFMASK, 0x700); // TF, IF and DF
+#elif __aarch64__
+    register_interrupt_handler(INTERRUPT_VECTOR_SUPERVISOR_CALL, dispatch_system_call);
+#endif
+}
@@ -0,0 +1,10 @@
+#include <guest.h>
+
+int64_t start_vcpu(uint64_t target, uint64_t entry_point, uint64_t context) {
+#ifdef __x86_64__
+    return (int64_t)hypercall(HYPERCALL_START_VCPU, target, entry_point, context);
+#elif __aarch64__
+    // Unlike PSCI demands, the entry point is virtual and the MMU stays on
+    return (int64_t)smccc_call(PSCI_CPU_ON, target, entry_point, context);
+#endif
+}
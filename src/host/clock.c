@@ -0,0 +1,87 @@
+#include <time.h>
+#include "platform.h"
+#ifdef __APPLE__
+#include <sys/sysctl.h>
+#endif
+
+static uint64_t read_host_clock(clockid_t clock_id) {
+    struct timespec time;
+    assert(clock_gettime(clock_id, &time) == 0);
+    return (uint64_t)time.tv_sec * 1000000000UL + (uint64_t)time.tv_nsec;
+}
+
+static uint64_t get_counter_frequency_of_vcpu(struct vcpu* vcpu) {
+#ifdef __x86_64__
+#ifdef __linux__
+    int tsc_khz = ioctl(vcpu->fd, KVM_GET_TSC_KHZ, 0);
+    assert(tsc_khz > 0);
+    return (uint64_t)tsc_khz * 1000UL;
+#elif __APPLE__
+    (void)vcpu;
+    uint64_t frequency;
+    size_t length = sizeof(frequency);
+    assert(sysctlbyname("machdep.tsc.frequency", &frequency, &length, NULL, 0) == 0);
+    return frequency;
+#endif
+#elif __aarch64__
+    (void)vcpu;
+    uint64_t frequency;
+    __asm__ volatile("mrs %0, CNTFRQ_EL0\n" : "=r"(frequency));
+    return frequency;
+#endif
+}
+
+static uint64_t get_counter_offset_of_vcpu(struct vcpu* vcpu) {
+#ifdef __linux__
+#ifdef __x86_64__
+    struct kvm_msrs* msrs = malloc(sizeof(struct kvm_msrs) + sizeof(struct kvm_msr_entry));
+    msrs->nmsrs = 1;
+    msrs->entries[0].index = MSR_IA32_TSC;
+#endif
+    // Sample the guest counter between two host counter reads and assume it was taken half way
+    uint64_t host_counter_before = read_counter();
+#ifdef __x86_64__
+    assert(ioctl(vcpu->fd, KVM_GET_MSRS, msrs) == 1);
+#elif __aarch64__
+    uint64_t guest_counter = rreg(vcpu, KVM_REG_ARM_TIMER_CNT);
+#endif
+    uint64_t host_counter_after = read_counter();
+#ifdef __x86_64__
+    uint64_t guest_counter = msrs->entries[0].data;
+    free(msrs);
+#endif
+    return guest_counter - (host_counter_before + (host_counter_after - host_counter_before) / 2);
+#elif __APPLE__
+#ifdef __x86_64__
+    (void)vcpu;
+    return 0; // CPU_BASED_TSC_OFFSET is not enabled
+#elif __aarch64__
+    uint64_t vtimer_offset;
+    assert(hv_vcpu_get_vtimer_offset(vcpu->id, &vtimer_offset) == 0);
+    return -vtimer_offset;
+#endif
+#endif
+}
+
+void calibrate_clock_of_vm(struct vm* vm, struct vcpu* vcpu) {
+    uint64_t frequency = get_counter_frequency_of_vcpu(vcpu);
+    vm->clock_counter_offset = get_counter_offset_of_vcpu(vcpu);
+    ++vm->clock.version;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    uint64_t monotonic_time = read_host_clock(CLOCK_MONOTONIC);
+    vm->clock.counter_timestamp = read_counter() + vm->clock_counter_offset;
+    vm->clock.realtime_offset = read_host_clock(CLOCK_REALTIME) - monotonic_time;
+    vm->clock.monotonic_timestamp = monotonic_time;
+    vm->clock.nanoseconds_per_tick = (1000000000UL << 32) / frequency;
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    ++vm->clock.version;
+}
+
+uint64_t get_monotonic_time_of_vm(struct vm* vm) {
+    assert(vm->clock.nanoseconds_per_tick > 0);
+    return convert_counter_using_clock(&vm->clock, read_counter() + vm->clock_counter_offset);
+}
+
+uint64_t get_realtime_of_vm(struct vm* vm) {
+    return get_monotonic_time_of_vm(vm) + vm->clock.realtime_offset;
+}
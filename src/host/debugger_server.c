@@ -90,27 +90,38 @@ void handle_frame(struct debugger_server* debugger, size_t frame_length, char fr
         uint64_t length = 0;
         frame[frame_length] = 0;
         sscanf(frame + 1, "%16"PRIx64",%16"PRIx64, &virtual_address, &length);
-        uint64_t physical_address = 0;
-        void* host_address = NULL;
-        if(resolve_address_using_page_table(debugger->vcpus[debugger->active_vcpu]->page_table, is_write, virtual_address, &physical_address) &&
-           resolve_address_of_vm(debugger->vcpus[debugger->active_vcpu]->vm, physical_address, &host_address, length)) {
-            if(is_write) {
-                size_t offset = 1;
-                while(offset < frame_length && frame[offset++] != ':');
+        size_t offset = 1;
+        if(is_write)
+            while(offset < frame_length && frame[offset++] != ':');
+        char response[1024];
+        // sprintf terminates every pair of hex digits, so the last one needs room for its NUL as well
+        if(!is_write && length > (sizeof(response) - 1) / 2)
+            length = (sizeof(response) - 1) / 2;
+        // Neighboring guest pages need not be neighbors in host memory, so the range comes in pieces
+        struct iovec iovecs[16];
+        uint64_t resolved_length = 0, number_of_iovecs = 1;
+        while(resolved_length < length && number_of_iovecs > 0) {
+            number_of_iovecs = translate_range_of_page_table(debugger->vcpus[debugger->active_vcpu]->page_table, is_write, virtual_address + resolved_length, length - resolved_length, sizeof(iovecs) / sizeof(iovecs[0]), iovecs);
+            for(uint64_t iovec_index = 0; iovec_index < number_of_iovecs; ++iovec_index) {
+                uint8_t* host_address = iovecs[iovec_index].iov_base;
                 unsigned int byte;
-                for(size_t i = 0; i < length; ++i) {
-                    sscanf(frame + offset + i * 2, "%02x", &byte);
-                    ((uint8_t*)host_address)[i] = (uint8_t)byte;
+                for(size_t i = 0; i < iovecs[iovec_index].iov_len; ++i) {
+                    if(is_write) {
+                        sscanf(frame + offset + (resolved_length + i) * 2, "%02x", &byte);
+                        host_address[i] = (uint8_t)byte;
+                    } else
+                        sprintf(&response[(resolved_length + i) * 2], "%02x", host_address[i]);
                 }
-                send_frame(debugger, 2, "OK");
-            } else {
-                char response[1024];
-                for(size_t i = 0; i < length; ++i)
-                    sprintf(&response[i * 2], "%02x", ((uint8_t*)host_address)[i]);
-                send_frame(debugger, length * 2, response);
+                resolved_length += iovecs[iovec_index].iov_len;
             }
-        } else
+        }
+        // Reads may end early, writes may not
+        if(resolved_length == 0 || (is_write && resolved_length < length))
             send_frame(debugger, 3, "E00");
+        else if(is_write)
+            send_frame(debugger, 2, "OK");
+        else
+            send_frame(debugger, resolved_length * 2, response);
         return;
     } else if(strncmp(frame, "Hg", 2) == 0) {
         unsigned int vcpu_index = 0;
@@ -0,0 +1,141 @@
+#include "platform.h"
+#ifdef __linux__
+#include <linux/userfaultfd.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <errno.h>
+
+static bool find_lazy_memory_of_vm(struct vm* vm, uint64_t host_address, struct lazy_memory* lazy_memory) {
+    bool found = false;
+    assert(pthread_mutex_lock(&vm->lazy_memory_lock) == 0);
+    for(size_t index = 0; index < sizeof(vm->lazy_memories) / sizeof(vm->lazy_memories[0]); ++index)
+        if(host_address >= vm->lazy_memories[index].host_address && host_address - vm->lazy_memories[index].host_address < vm->lazy_memories[index].length) {
+            *lazy_memory = vm->lazy_memories[index];
+            found = true;
+            break;
+        }
+    assert(pthread_mutex_unlock(&vm->lazy_memory_lock) == 0);
+    return found;
+}
+
+static void* handle_lazy_memory_faults(void* argument) {
+    struct vm* vm = argument;
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    void* page = mmap(NULL, host_page_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(page != MAP_FAILED);
+    while(1) {
+        struct pollfd pollfds[2] = {
+            { .fd = vm->userfault_fd, .events = POLLIN },
+            { .fd = vm->userfault_stop_fd, .events = POLLIN },
+        };
+        int number_of_ready = poll(pollfds, sizeof(pollfds) / sizeof(pollfds[0]), -1);
+        if(number_of_ready == -1 && errno == EINTR)
+            continue;
+        assert(number_of_ready > 0 && !(pollfds[0].revents & POLLERR));
+        if(pollfds[1].revents & POLLIN)
+            break;
+        struct uffd_msg message;
+        ssize_t read_result = read(vm->userfault_fd, &message, sizeof(message));
+        if(read_result == -1) {
+            assert(errno == EAGAIN);
+            continue;
+        }
+        assert(read_result == sizeof(message) && message.event == UFFD_EVENT_PAGEFAULT);
+        uint64_t page_address = message.arg.pagefault.address / host_page_size * host_page_size;
+        struct lazy_memory lazy_memory;
+        if(!find_lazy_memory_of_vm(vm, page_address, &lazy_memory))
+            continue; // Unregistered in the meantime, which wakes the faulting thread already
+        // Several vCPUs can fault on the same page, all but the first resolution fail with EEXIST
+        if(lazy_memory.fill && lazy_memory.fill(lazy_memory.context, page_address - lazy_memory.host_address, page, host_page_size)) {
+            struct uffdio_copy copy = {
+                .dst = page_address,
+                .src = (uint64_t)page,
+                .len = host_page_size,
+                .mode = 0,
+            };
+            assert(ioctl(vm->userfault_fd, UFFDIO_COPY, &copy) >= 0 || errno == EEXIST);
+        } else {
+            struct uffdio_zeropage zeropage = {
+                .range = { .start = page_address, .len = host_page_size },
+                .mode = 0,
+            };
+            assert(ioctl(vm->userfault_fd, UFFDIO_ZEROPAGE, &zeropage) >= 0 || errno == EEXIST);
+        }
+    }
+    assert(munmap(page, host_page_size) == 0);
+    return NULL;
+}
+
+static void start_lazy_memory_of_vm(struct vm* vm) {
+    // Faults taken by KVM on behalf of a vCPU happen in kernel mode, so UFFD_USER_MODE_ONLY must not be set
+    vm->userfault_fd = (int)syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    assert(vm->userfault_fd >= 0);
+    struct uffdio_api api = {
+        .api = UFFD_API,
+        .features = 0,
+    };
+    assert(ioctl(vm->userfault_fd, UFFDIO_API, &api) >= 0);
+    vm->userfault_stop_fd = eventfd(0, EFD_CLOEXEC);
+    assert(vm->userfault_stop_fd >= 0);
+    assert(pthread_create(&vm->userfault_thread, NULL, handle_lazy_memory_faults, vm) == 0);
+}
+
+void stop_lazy_memory_of_vm(struct vm* vm) {
+    if(vm->userfault_fd < 0)
+        return;
+    uint64_t value = 1;
+    assert(write(vm->userfault_stop_fd, &value, sizeof(value)) == sizeof(value));
+    assert(pthread_join(vm->userfault_thread, NULL) == 0);
+    assert(close(vm->userfault_stop_fd) >= 0);
+    assert(close(vm->userfault_fd) >= 0);
+    vm->userfault_fd = -1;
+}
+
+void unregister_lazy_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
+    assert(pthread_mutex_lock(&vm->lazy_memory_lock) == 0);
+    for(size_t index = 0; index < sizeof(vm->lazy_memories) / sizeof(vm->lazy_memories[0]); ++index)
+        if(vm->lazy_memories[index].length > 0 && vm->lazy_memories[index].host_address == (uint64_t)mapping->host_address) {
+            // Pages which were filled already stay, missing ones become ordinary anonymous memory
+            struct uffdio_range range = { .start = vm->lazy_memories[index].host_address, .len = vm->lazy_memories[index].length };
+            assert(ioctl(vm->userfault_fd, UFFDIO_UNREGISTER, &range) >= 0);
+            vm->lazy_memories[index].length = 0;
+            break;
+        }
+    assert(pthread_mutex_unlock(&vm->lazy_memory_lock) == 0);
+}
+#endif
+
+void map_lazy_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping, fill_memory_callback fill, void* context) {
+    // The host memory has to be private anonymous memory which was not touched yet
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    assert((uint64_t)mapping->host_address % host_page_size == 0 && mapping->length % host_page_size == 0);
+#ifdef __linux__
+    if(vm->userfault_fd < 0)
+        start_lazy_memory_of_vm(vm);
+    assert(pthread_mutex_lock(&vm->lazy_memory_lock) == 0);
+    size_t index;
+    for(index = 0; index < sizeof(vm->lazy_memories) / sizeof(vm->lazy_memories[0]); ++index)
+        if(vm->lazy_memories[index].length == 0)
+            break;
+    assert(index < sizeof(vm->lazy_memories) / sizeof(vm->lazy_memories[0]));
+    struct uffdio_register registration = {
+        .range = { .start = (uint64_t)mapping->host_address, .len = mapping->length },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    assert(ioctl(vm->userfault_fd, UFFDIO_REGISTER, &registration) >= 0);
+    assert((registration.ioctls & ((1UL << _UFFDIO_COPY) | (1UL << _UFFDIO_ZEROPAGE))) == ((1UL << _UFFDIO_COPY) | (1UL << _UFFDIO_ZEROPAGE)));
+    vm->lazy_memories[index].host_address = (uint64_t)mapping->host_address;
+    vm->lazy_memories[index].length = mapping->length;
+    vm->lazy_memories[index].fill = fill;
+    vm->lazy_memories[index].context = context;
+    assert(pthread_mutex_unlock(&vm->lazy_memory_lock) == 0);
+#elif __APPLE__
+    // HVF has no way to intercept stage 2 faults on host memory, so fill everything up front
+    if(fill)
+        for(uint64_t offset = 0; offset < mapping->length; offset += host_page_size)
+            if(!fill(context, offset, (void*)((uint64_t)mapping->host_address + offset), host_page_size))
+                memset((void*)((uint64_t)mapping->host_address + offset), 0, host_page_size);
+#endif
+    map_memory_of_vm(vm, mapping);
+}
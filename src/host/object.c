@@ -1,9 +1,35 @@
+#ifdef __linux__
+#define _GNU_SOURCE // memfd_create and file seals
+#endif
 #include "platform.h"
 
 #define ELF_MAGIC      0x464C457F
+#define ET_DYN         0x3
 #define PT_LOAD        0x1
+#define PT_DYNAMIC     0x2
 #define SHT_SYMTAB     0x2
 #define SHT_STRTAB     0x3
+#define SHN_UNDEF      0x0
+#define STT_FUNC       0x2
+#define STB_WEAK       0x2
+#define DT_NULL        0
+#define DT_PLTRELSZ    2
+#define DT_STRTAB      5
+#define DT_SYMTAB      6
+#define DT_RELA        7
+#define DT_RELASZ      8
+#define DT_JMPREL      23
+#ifdef __x86_64__
+#define R_ABSOLUTE     1 // R_X86_64_64
+#define R_GLOB_DAT     6
+#define R_JUMP_SLOT    7
+#define R_RELATIVE     8
+#elif __aarch64__
+#define R_ABSOLUTE     257 // R_AARCH64_ABS64
+#define R_GLOB_DAT     1025
+#define R_JUMP_SLOT    1026
+#define R_RELATIVE     1027
+#endif
 
 #define MACH_MAGIC     0xFEEDFACF
 #define LC_SYMTAB      0x2
@@ -65,6 +91,17 @@ struct elf64_sym {
     uint64_t st_size;
 };
 
+struct elf64_dyn {
+    int64_t  d_tag;
+    uint64_t d_val;
+};
+
+struct elf64_rela {
+    uint64_t r_offset;
+    uint64_t r_info;
+    int64_t  r_addend;
+};
+
 struct mach_header {
     uint32_t magic;
     uint32_t cputype;
@@ -130,45 +167,224 @@ struct interrupt_gate_64 {
     uint32_t offset2;
     uint32_t padding;
 };
+
+// The guest initializes each gate with a plain pointer which is split up here
+static void expand_interrupt_table(void* interrupt_table) {
+    uint64_t* interrupt_table_src = (uint64_t*)interrupt_table;
+    struct interrupt_gate_64* interrupt_table_dst = (struct interrupt_gate_64*)interrupt_table;
+    for(size_t i = 0; i < 256; ++i) {
+        uint64_t entry = interrupt_table_src[i * 2 + 1];
+        interrupt_table_dst[i].offset0 = entry & 0xFFFFUL;
+        interrupt_table_dst[i].offset1 = (entry >> 16) & 0xFFFFUL;
+        interrupt_table_dst[i].offset2 = (uint32_t)(entry >> 32);
+        interrupt_table_dst[i].padding = 0;
+    }
+}
 #endif
 
 struct loaded_object {
     uint64_t number_of_symbols;
     uint64_t stack_pointer;
+    uint64_t base_address; // added to all virtual addresses of the object file
+    uint64_t writable_data_virtual_address; // before adding the base address
     uint64_t writable_data_preinit_length;
     struct host_to_guest_mapping file_data;
     struct host_to_guest_mapping writable_data;
-    struct host_to_guest_mapping page_table;
+    struct page_table* page_table;
     const char* symbol_names;
     void* symbol_table;
+    const uint32_t* symbol_index; // hash buckets followed by chains, only for objects from images
+    uint64_t number_of_symbol_buckets, symbol_index_length;
     struct vm* vm;
     int fd;
+    uint64_t expanded_interrupt_table; // virtual address, 0 until the gates are expanded
+    struct loaded_object* runtime; // whose page table a module shares, NULL for everything else
+    struct loaded_object* next_module; // loaded into the same runtime, in load order
 };
 
-void add_data_segment_to_loaded_object(struct loaded_object* loaded_object, uint64_t file_offset, uint64_t file_size, uint64_t vm_size) {
+static uint64_t round_up_to_host_page(uint64_t length) {
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    return (length + host_page_size - 1) / host_page_size * host_page_size;
+}
+
+// Parts which are placed behind each other in guest physical memory have to fill whole host pages and whole guest pages
+static uint64_t round_up_to_memory_slot_page(uint64_t length) {
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    if(page_size < GUEST_PAGE_SIZE)
+        page_size = GUEST_PAGE_SIZE;
+    return (length + page_size - 1) / page_size * page_size;
+}
+
+void add_data_segment_to_loaded_object(struct loaded_object* loaded_object, uint64_t virtual_address, uint64_t file_offset, uint64_t file_size, uint64_t vm_size) {
+    // The copy starts at a page boundary, even if the segment shares its first page with preceding file data
+    uint64_t misalignment = virtual_address % GUEST_PAGE_SIZE;
+    loaded_object->writable_data_virtual_address = virtual_address - misalignment;
+    file_offset -= misalignment;
+    file_size += misalignment;
+    vm_size += misalignment;
     loaded_object->writable_data.guest_address = loaded_object->file_data.guest_address + loaded_object->file_data.length + loaded_object->writable_data.length;
     loaded_object->writable_data_preinit_length += file_size;
-    loaded_object->writable_data.length += vm_size;
+    loaded_object->writable_data.length = round_up_to_memory_slot_page(loaded_object->writable_data.length + vm_size);
     void* writable_data_source = (void*)((uint64_t)loaded_object->file_data.host_address + file_offset);
-    loaded_object->writable_data.host_address = valloc(loaded_object->writable_data.length);
-    assert(loaded_object->writable_data.host_address);
+    loaded_object->writable_data.host_address = mmap(NULL, loaded_object->writable_data.length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(loaded_object->writable_data.host_address != MAP_FAILED);
     memcpy(loaded_object->writable_data.host_address, writable_data_source, loaded_object->writable_data_preinit_length);
 }
 
-struct loaded_object* create_loaded_object(struct vm* vm, const char* path) {
+static struct loaded_object* allocate_loaded_object(uint64_t file_length) {
     struct loaded_object* loaded_object = malloc(sizeof(struct loaded_object));
-    loaded_object->vm = vm;
-    loaded_object->fd = open(path, O_RDONLY);
-    struct stat stat;
-    fstat(loaded_object->fd, &stat);
-    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    loaded_object->vm = NULL;
+    loaded_object->page_table = NULL;
+    loaded_object->runtime = NULL;
+    loaded_object->next_module = NULL;
+    loaded_object->fd = -1;
     loaded_object->symbol_names = NULL;
+    loaded_object->symbol_index = NULL;
+    loaded_object->expanded_interrupt_table = 0;
+    loaded_object->base_address = 0;
+    loaded_object->writable_data_virtual_address = 0;
     loaded_object->writable_data.length = 0;
     loaded_object->writable_data_preinit_length = 0;
-    loaded_object->file_data.length = ((uint64_t)stat.st_size + host_page_size - 1) / host_page_size * host_page_size;
+    loaded_object->file_data.length = round_up_to_memory_slot_page(file_length);
     loaded_object->file_data.guest_address = 0;
+    return loaded_object;
+}
+
+static struct loaded_object* open_object_file(const char* path) {
+    int fd = open(path, O_RDONLY);
+    assert(fd >= 0);
+    struct stat stat;
+    fstat(fd, &stat);
+    struct loaded_object* loaded_object = allocate_loaded_object((uint64_t)stat.st_size);
+    loaded_object->fd = fd;
     loaded_object->file_data.host_address = mmap(0, loaded_object->file_data.length, PROT_READ, MAP_FILE | MAP_PRIVATE, loaded_object->fd, 0);
     assert(loaded_object->file_data.host_address != MAP_FAILED);
+    return loaded_object;
+}
+
+static struct loaded_object* copy_object_file(const void* data, uint64_t length) {
+    // Kept as a private copy, so the caller can reuse its buffer right away
+    struct loaded_object* loaded_object = allocate_loaded_object(length);
+    loaded_object->file_data.host_address = mmap(NULL, loaded_object->file_data.length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(loaded_object->file_data.host_address != MAP_FAILED);
+    memcpy(loaded_object->file_data.host_address, data, length);
+    assert(mprotect(loaded_object->file_data.host_address, loaded_object->file_data.length, PROT_READ) == 0);
+    return loaded_object;
+}
+
+static void close_object_file(struct loaded_object* loaded_object) {
+    assert(munmap(loaded_object->file_data.host_address, loaded_object->file_data.length) == 0);
+    if(loaded_object->writable_data.length > 0)
+        assert(munmap(loaded_object->writable_data.host_address, loaded_object->writable_data.length) == 0);
+    if(loaded_object->symbol_index)
+        assert(munmap((void*)loaded_object->symbol_index, loaded_object->symbol_index_length) == 0);
+    if(loaded_object->fd >= 0)
+        assert(close(loaded_object->fd) == 0);
+    free(loaded_object);
+}
+
+static void find_symbol_table_of_elf(struct loaded_object* loaded_object) {
+    struct elf64_hdr* elf_header = (struct elf64_hdr*)loaded_object->file_data.host_address;
+    struct elf64_shdr* shdrs = (struct elf64_shdr*)((uint64_t)elf_header + elf_header->e_shoff);
+    const char* shdr_names = (const char*)((uint64_t)elf_header + shdrs[elf_header->e_shstrndx].sh_offset);
+    for(size_t i = 0; i < elf_header->e_shnum; ++i) {
+        struct elf64_shdr* shdr = &shdrs[i];
+        switch(shdr->sh_type) {
+            case SHT_STRTAB: {
+                if(strcmp(shdr_names + shdr->sh_name, ".strtab") == 0)
+                    loaded_object->symbol_names = (const char*)((uint64_t)elf_header + shdr->sh_offset);
+            } break;
+            case SHT_SYMTAB: {
+                loaded_object->symbol_table = (void*)((uint64_t)elf_header + shdr->sh_offset);
+                loaded_object->number_of_symbols = shdr->sh_size / sizeof(struct elf64_sym);
+            } break;
+        }
+    }
+    assert(loaded_object->symbol_names);
+}
+
+// Translates an unrelocated virtual address to where it is in the file, which works for everything before the zero filled part of a segment
+static void* get_file_data_of_elf(struct loaded_object* loaded_object, uint64_t virtual_address) {
+    struct elf64_hdr* elf_header = (struct elf64_hdr*)loaded_object->file_data.host_address;
+    struct elf64_phdr* phdrs = (struct elf64_phdr*)((uint64_t)elf_header + elf_header->e_phoff);
+    for(size_t i = 0; i < elf_header->e_phnum; ++i)
+        if(phdrs[i].p_type == PT_LOAD && virtual_address >= phdrs[i].p_vaddr && virtual_address - phdrs[i].p_vaddr < phdrs[i].p_filesz)
+            return (void*)((uint64_t)elf_header + phdrs[i].p_offset + (virtual_address - phdrs[i].p_vaddr));
+    return NULL;
+}
+
+static bool resolve_symbol_for_relocation(struct loaded_object* loaded_object, const char* symbol_name, uint64_t* virtual_address) {
+    // The runtime comes first, then every module in load order
+    struct loaded_object* module = loaded_object->runtime;
+    for(; module; module = module->next_module)
+        if(resolve_symbol_virtual_address_in_loaded_object(module, symbol_name, virtual_address))
+            return true;
+    return false;
+}
+
+// Applies the dynamic relocations to the writable data, which is the only place they may point to. Without apply it only checks them.
+static bool relocate_loaded_object(struct loaded_object* loaded_object, bool apply) {
+    struct elf64_hdr* elf_header = (struct elf64_hdr*)loaded_object->file_data.host_address;
+    struct elf64_phdr* phdrs = (struct elf64_phdr*)((uint64_t)elf_header + elf_header->e_phoff);
+    struct elf64_dyn* dynamic = NULL;
+    for(size_t i = 0; i < elf_header->e_phnum; ++i)
+        if(phdrs[i].p_type == PT_DYNAMIC)
+            dynamic = (struct elf64_dyn*)((uint64_t)elf_header + phdrs[i].p_offset);
+    if(!dynamic)
+        return true;
+    uint64_t relocation_tables[2] = { 0, 0 }, relocation_table_sizes[2] = { 0, 0 }, symbols_address = 0, symbol_names_address = 0;
+    for(; dynamic->d_tag != DT_NULL; ++dynamic)
+        switch(dynamic->d_tag) {
+            case DT_RELA: relocation_tables[0] = dynamic->d_val; break;
+            case DT_RELASZ: relocation_table_sizes[0] = dynamic->d_val; break;
+            case DT_JMPREL: relocation_tables[1] = dynamic->d_val; break;
+            case DT_PLTRELSZ: relocation_table_sizes[1] = dynamic->d_val; break;
+            case DT_SYMTAB: symbols_address = dynamic->d_val; break;
+            case DT_STRTAB: symbol_names_address = dynamic->d_val; break;
+        }
+    struct elf64_sym* symbols = get_file_data_of_elf(loaded_object, symbols_address);
+    const char* symbol_names = get_file_data_of_elf(loaded_object, symbol_names_address);
+    for(size_t table = 0; table < 2; ++table) {
+        struct elf64_rela* relocations = get_file_data_of_elf(loaded_object, relocation_tables[table]);
+        for(size_t i = 0; relocations && i < relocation_table_sizes[table] / sizeof(struct elf64_rela); ++i) {
+            struct elf64_rela* relocation = &relocations[i];
+            uint64_t offset = relocation->r_offset - loaded_object->writable_data_virtual_address;
+            if(relocation->r_offset < loaded_object->writable_data_virtual_address || offset + sizeof(uint64_t) > loaded_object->writable_data.length) {
+                fprintf(stderr, "Relocation outside of writable data at %" PRIx64 "\n", relocation->r_offset);
+                return false;
+            }
+            uint64_t* target = (uint64_t*)((uint64_t)loaded_object->writable_data.host_address + offset);
+            uint64_t type = relocation->r_info & 0xFFFFFFFFUL;
+            switch(type) {
+                case R_RELATIVE:
+                    if(apply)
+                        *target = loaded_object->base_address + (uint64_t)relocation->r_addend;
+                    break;
+                case R_ABSOLUTE:
+                case R_GLOB_DAT:
+                case R_JUMP_SLOT: {
+                    struct elf64_sym* symbol = &symbols[relocation->r_info >> 32];
+                    uint64_t symbol_address = 0;
+                    if(symbol->st_shndx != SHN_UNDEF)
+                        symbol_address = loaded_object->base_address + symbol->st_value;
+                    else if(!resolve_symbol_for_relocation(loaded_object, symbol_names + symbol->st_name, &symbol_address) && (symbol->st_info >> 4) != STB_WEAK) {
+                        fprintf(stderr, "Unresolved symbol %s\n", symbol_names + symbol->st_name);
+                        return false;
+                    }
+                    if(apply)
+                        *target = symbol_address + (uint64_t)relocation->r_addend;
+                } break;
+                default:
+                    fprintf(stderr, "Unsupported relocation type %" PRIu64 "\n", type);
+                    return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Parses the object file and builds its page table, but leaves the VM alone
+static struct loaded_object* load_object_file(struct loaded_object* loaded_object, size_t page_table_levels, struct host_to_guest_mapping* page_table_memory, uint64_t* page_table_used_length) {
     uint32_t magic = *(uint32_t*)loaded_object->file_data.host_address;
     size_t number_of_segments = 0;
     struct elf64_hdr* elf_header = (struct elf64_hdr*)loaded_object->file_data.host_address;
@@ -201,20 +417,21 @@ struct loaded_object* create_loaded_object(struct vm* vm, const char* path) {
             switch(phdr->p_type) {
                 case PT_LOAD: {
                     assert(loaded_object->writable_data.length == 0);
-                    if(next_virtual_address < phdr->p_vaddr) {
+                    uint64_t virtual_address = phdr->p_vaddr / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+                    if(next_virtual_address < virtual_address) {
                         mappings[mapping_index].virtual_address = next_virtual_address;
                         mappings[mapping_index].physical_address = 0;
                         mappings[mapping_index].flags = MAPPING_GAP;
                         ++mapping_index;
                     }
-                    mappings[mapping_index].virtual_address = phdr->p_vaddr;
-                    mappings[mapping_index].physical_address = phdr->p_offset;
+                    mappings[mapping_index].virtual_address = virtual_address;
+                    mappings[mapping_index].physical_address = phdr->p_offset / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
                     switch(phdr->p_flags) {
                         case 5: // TEXT
                             mappings[mapping_index].flags = MAPPING_READABLE | MAPPING_EXECUTABLE;
                             break;
                         case 6: // DATA
-                            add_data_segment_to_loaded_object(loaded_object, phdr->p_offset, phdr->p_filesz, phdr->p_memsz);
+                            add_data_segment_to_loaded_object(loaded_object, phdr->p_vaddr, phdr->p_offset, phdr->p_filesz, phdr->p_memsz);
                             mappings[mapping_index].physical_address = loaded_object->writable_data.guest_address;
                             mappings[mapping_index].flags = MAPPING_READABLE | MAPPING_WRITABLE;
                             break;
@@ -226,31 +443,14 @@ struct loaded_object* create_loaded_object(struct vm* vm, const char* path) {
                             break;
                     }
                     ++mapping_index;
-                    next_virtual_address = phdr->p_vaddr + phdr->p_memsz;
-                } break;
-            }
-        }
-        struct elf64_shdr* shdrs = (struct elf64_shdr*)((uint64_t)elf_header + elf_header->e_shoff);
-        const char* shdr_names = (const char*)((uint64_t)elf_header + shdrs[elf_header->e_shstrndx].sh_offset);
-        for(size_t i = 0; i < elf_header->e_shnum; ++i) {
-            struct elf64_shdr* shdr = &shdrs[i];
-            switch(shdr->sh_type) {
-                case SHT_STRTAB: {
-                    if(strcmp(shdr_names + shdr->sh_name, ".strtab") == 0)
-                        loaded_object->symbol_names = (const char*)((uint64_t)elf_header + shdr->sh_offset);
-                } break;
-            }
-        }
-        assert(loaded_object->symbol_names);
-        for(size_t i = 0; i < elf_header->e_shnum; ++i) {
-            struct elf64_shdr* shdr = &shdrs[i];
-            switch(shdr->sh_type) {
-                case SHT_SYMTAB: {
-                    loaded_object->symbol_table = (void*)((uint64_t)elf_header + shdr->sh_offset);
-                    loaded_object->number_of_symbols = shdr->sh_size / sizeof(struct elf64_sym);
+                    next_virtual_address = (phdr->p_vaddr + phdr->p_memsz + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
                 } break;
             }
         }
+        find_symbol_table_of_elf(loaded_object);
+        // Position independent executables are loaded at their link address, which leaves only relative relocations
+        if(elf_header->e_type == ET_DYN)
+            assert(relocate_loaded_object(loaded_object, true));
     } else if(magic == MACH_MAGIC) {
         struct mach_command* mach_command = (struct mach_command*)(mach_header + 1);
         struct mach_command_segment_64* sorted_segments[number_of_segments];
@@ -291,7 +491,7 @@ struct loaded_object* create_loaded_object(struct vm* vm, const char* path) {
             } else if(strcmp(command->segname, "__RODATA") == 0) {
                 mappings[mapping_index].flags = MAPPING_READABLE;
             } else if(strcmp(command->segname, "__DATA") == 0) {
-                add_data_segment_to_loaded_object(loaded_object, command->fileoff, command->filesize, command->vmsize);
+                add_data_segment_to_loaded_object(loaded_object, command->vmaddr, command->fileoff, command->filesize, command->vmsize);
                 mappings[mapping_index].physical_address = loaded_object->writable_data.guest_address;
                 mappings[mapping_index].flags = MAPPING_READABLE | MAPPING_WRITABLE;
             }
@@ -303,55 +503,541 @@ struct loaded_object* create_loaded_object(struct vm* vm, const char* path) {
     mappings[mapping_index].physical_address = 0;
     mappings[mapping_index].flags = MAPPING_GAP;
     ++mapping_index;
-    loaded_object->page_table.guest_address = loaded_object->writable_data.guest_address + loaded_object->writable_data.length;
-    create_page_table(&loaded_object->page_table, mapping_index, mappings);
     loaded_object->stack_pointer = next_virtual_address;
+    build_page_table(page_table_levels, loaded_object->writable_data.guest_address + loaded_object->writable_data.length, mapping_index, mappings, page_table_memory, page_table_used_length);
+    return loaded_object;
+}
+
+static struct loaded_object* instantiate_object_file(struct vm* vm, struct loaded_object* loaded_object) {
+    struct host_to_guest_mapping page_table_memory;
+    uint64_t page_table_used_length;
+    load_object_file(loaded_object, vm->page_table_levels, &page_table_memory, &page_table_used_length);
+    loaded_object->vm = vm;
     map_memory_of_vm(loaded_object->vm, &loaded_object->file_data);
     map_memory_of_vm(loaded_object->vm, &loaded_object->writable_data);
-    map_memory_of_vm(loaded_object->vm, &loaded_object->page_table);
+    loaded_object->page_table = create_page_table_in_memory(loaded_object->vm, vm->page_table_levels, &page_table_memory, page_table_used_length);
+    return loaded_object;
+}
+
+struct loaded_object* create_loaded_object(struct vm* vm, const char* path) {
+    return instantiate_object_file(vm, open_object_file(path));
+}
+
+struct loaded_object* create_loaded_object_from_memory(struct vm* vm, const void* data, uint64_t length) {
+    return instantiate_object_file(vm, copy_object_file(data, length));
+}
+
+static bool map_segments_of_elf(struct loaded_object* loaded_object, bool map) {
+    struct elf64_hdr* elf_header = (struct elf64_hdr*)loaded_object->file_data.host_address;
+    struct elf64_phdr* phdrs = (struct elf64_phdr*)((uint64_t)elf_header + elf_header->e_phoff);
+    for(size_t i = 0; i < elf_header->e_phnum; ++i) {
+        struct elf64_phdr* phdr = &phdrs[i];
+        if(phdr->p_type != PT_LOAD)
+            continue;
+        uint64_t virtual_address = phdr->p_vaddr / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+        uint64_t length = (phdr->p_vaddr + phdr->p_memsz + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE - virtual_address;
+        uint64_t physical_address = loaded_object->file_data.guest_address + phdr->p_offset / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+        uint8_t flags;
+        switch(phdr->p_flags) {
+            case 5: // TEXT
+                flags = MAPPING_READABLE | MAPPING_EXECUTABLE;
+                break;
+            case 6: // DATA
+                physical_address = loaded_object->writable_data.guest_address;
+                flags = MAPPING_READABLE | MAPPING_WRITABLE;
+                break;
+            case 4: // RODATA
+                flags = MAPPING_READABLE;
+                break;
+            default:
+                return false;
+        }
+        if(!loaded_object->page_table)
+            continue;
+        if(map)
+            map_range_of_page_table(loaded_object->page_table, loaded_object->base_address + virtual_address, physical_address, length, flags);
+        else
+            unmap_range_of_page_table(loaded_object->page_table, loaded_object->base_address + virtual_address, length);
+    }
+    return true;
+}
+
+struct loaded_object* create_loaded_module(struct loaded_object* runtime, const char* path, uint64_t base_address) {
+    assert(!runtime->runtime && base_address % GUEST_PAGE_SIZE == 0);
+    struct loaded_object* loaded_object = open_object_file(path);
+    struct elf64_hdr* elf_header = (struct elf64_hdr*)loaded_object->file_data.host_address;
+    assert(elf_header->e_ident == ELF_MAGIC && elf_header->e_type == ET_DYN);
+    loaded_object->vm = runtime->vm;
+    loaded_object->stack_pointer = runtime->stack_pointer;
+    loaded_object->runtime = runtime;
+    loaded_object->base_address = base_address;
+    struct elf64_phdr* phdrs = (struct elf64_phdr*)((uint64_t)elf_header + elf_header->e_phoff);
+    for(size_t i = 0; i < elf_header->e_phnum; ++i)
+        if(phdrs[i].p_type == PT_LOAD && phdrs[i].p_flags == 6) {
+            assert(loaded_object->writable_data.length == 0);
+            add_data_segment_to_loaded_object(loaded_object, phdrs[i].p_vaddr, phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_memsz);
+        }
+    find_symbol_table_of_elf(loaded_object);
+    // Dry run without a page table to check the segment permissions
+    if(!map_segments_of_elf(loaded_object, true) || !relocate_loaded_object(loaded_object, true)) {
+        close_object_file(loaded_object);
+        return NULL;
+    }
+    // Guest physical memory is allocated per module, wherever it is free
+    loaded_object->file_data.guest_address = find_free_guest_address_of_vm(loaded_object->vm, loaded_object->file_data.length);
+    map_memory_of_vm(loaded_object->vm, &loaded_object->file_data);
+    if(loaded_object->writable_data.length > 0) {
+        loaded_object->writable_data.guest_address = find_free_guest_address_of_vm(loaded_object->vm, loaded_object->writable_data.length);
+        map_memory_of_vm(loaded_object->vm, &loaded_object->writable_data);
+    }
+    loaded_object->page_table = runtime->page_table;
+    map_segments_of_elf(loaded_object, true);
+    struct loaded_object** link = &runtime->next_module;
+    while(*link)
+        link = &(*link)->next_module;
+    *link = loaded_object;
     return loaded_object;
 }
 
 void destroy_loaded_object(struct loaded_object* loaded_object) {
+    if(loaded_object->runtime) {
+        map_segments_of_elf(loaded_object, false);
+        struct loaded_object** link = &loaded_object->runtime->next_module;
+        while(*link != loaded_object)
+            link = &(*link)->next_module;
+        *link = loaded_object->next_module;
+    } else {
+        assert(!loaded_object->next_module);
+        destroy_page_table(loaded_object->page_table);
+    }
     unmap_memory_of_vm(loaded_object->vm, &loaded_object->file_data);
-    unmap_memory_of_vm(loaded_object->vm, &loaded_object->writable_data);
-    unmap_memory_of_vm(loaded_object->vm, &loaded_object->page_table);
-    assert(munmap(loaded_object->file_data.host_address, loaded_object->file_data.length) == 0);
-    assert(close(loaded_object->fd) == 0);
-    free(loaded_object->writable_data.host_address);
-    free(loaded_object->page_table.host_address);
-    free(loaded_object);
+    if(loaded_object->writable_data.length > 0)
+        unmap_memory_of_vm(loaded_object->vm, &loaded_object->writable_data);
+    close_object_file(loaded_object);
 }
 
-bool resolve_symbol_virtual_address_in_loaded_object(struct loaded_object* loaded_object, const char* symbol_name, uint64_t* virtual_address) {
+// Everything which comes from the file, as opposed to the instance in the VM
+static void exchange_object_file(struct loaded_object* a, struct loaded_object* b) {
+    struct loaded_object swap = *a;
+    a->file_data = b->file_data;
+    a->fd = b->fd;
+    a->symbol_names = b->symbol_names;
+    a->symbol_table = b->symbol_table;
+    a->number_of_symbols = b->number_of_symbols;
+    a->symbol_index = b->symbol_index;
+    a->number_of_symbol_buckets = b->number_of_symbol_buckets;
+    a->symbol_index_length = b->symbol_index_length;
+    b->file_data = swap.file_data;
+    b->fd = swap.fd;
+    b->symbol_names = swap.symbol_names;
+    b->symbol_table = swap.symbol_table;
+    b->number_of_symbols = swap.number_of_symbols;
+    b->symbol_index = swap.symbol_index;
+    b->number_of_symbol_buckets = swap.number_of_symbol_buckets;
+    b->symbol_index_length = swap.symbol_index_length;
+}
+
+static bool is_replacement_of_loaded_object(struct loaded_object* loaded_object, struct loaded_object* replacement) {
+    struct loaded_object* objects[2] = { loaded_object, replacement };
+    uint64_t code_end[2] = { 0, 0 }, data_address[2] = { 0, 0 }, data_length[2] = { 0, 0 };
+    for(size_t index = 0; index < 2; ++index) {
+        struct elf64_hdr* elf_header = (struct elf64_hdr*)objects[index]->file_data.host_address;
+        if(elf_header->e_ident != ELF_MAGIC || elf_header->e_type != ((struct elf64_hdr*)loaded_object->file_data.host_address)->e_type)
+            return false;
+        struct elf64_phdr* phdrs = (struct elf64_phdr*)((uint64_t)elf_header + elf_header->e_phoff);
+        for(size_t i = 0; i < elf_header->e_phnum; ++i) {
+            struct elf64_phdr* phdr = &phdrs[i];
+            if(phdr->p_type != PT_LOAD)
+                continue;
+            if(phdr->p_flags == 6 && data_length[index] == 0) {
+                data_address[index] = phdr->p_vaddr / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+                data_length[index] = phdr->p_vaddr % GUEST_PAGE_SIZE + phdr->p_memsz;
+            } else if(phdr->p_flags == 4 || phdr->p_flags == 5) {
+                uint64_t end = (phdr->p_vaddr + phdr->p_memsz + GUEST_PAGE_SIZE - 1) / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+                if(code_end[index] < end)
+                    code_end[index] = end;
+            } else
+                return false;
+        }
+    }
+    // The writable data stays where it is, including everything the guest stored in it
+    if(data_address[1] != data_address[0] || data_length[1] > loaded_object->writable_data.length)
+        return false;
+    // and the code may only grow until it reaches the data or whatever else follows it
+    if(code_end[1] > ((data_length[0] > 0 && data_address[0] >= code_end[0]) ? data_address[0] : code_end[0]))
+        return false;
+    loaded_object->writable_data_virtual_address = data_address[0];
+    find_symbol_table_of_elf(replacement);
+    // Paused vCPUs return into exported functions and the guest may have stored pointers to them, so none of them may move
+    for(uint64_t index = 0; index < loaded_object->number_of_symbols; ++index) {
+        struct elf64_sym* symbol = &((struct elf64_sym*)loaded_object->symbol_table)[index];
+        if((symbol->st_info & 0x10) == 0 || (symbol->st_info & 0xF) != STT_FUNC || symbol->st_shndx == SHN_UNDEF)
+            continue;
+        uint64_t new_address = 0;
+        if(!resolve_symbol_virtual_address_in_loaded_object(replacement, loaded_object->symbol_names + symbol->st_name, &new_address) ||
+           new_address != loaded_object->base_address + symbol->st_value)
+            return false;
+    }
+    // vCPUs keep these addresses in their registers
+    static const char* const fixed_symbols[] = { SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "return_to_host" };
+    for(size_t i = 0; i < sizeof(fixed_symbols) / sizeof(fixed_symbols[0]); ++i) {
+        uint64_t old_address = 0, new_address = 0;
+        resolve_symbol_virtual_address_in_loaded_object(loaded_object, fixed_symbols[i], &old_address);
+        resolve_symbol_virtual_address_in_loaded_object(replacement, fixed_symbols[i], &new_address);
+        if(old_address != new_address)
+            return false;
+    }
+    return true;
+}
+
+bool replace_code_of_loaded_object(struct loaded_object* loaded_object, const char* path) {
+    struct loaded_object* replacement = open_object_file(path);
+    replacement->vm = loaded_object->vm;
+    replacement->page_table = loaded_object->page_table;
+    replacement->base_address = loaded_object->base_address;
+    if(*(uint32_t*)loaded_object->file_data.host_address != ELF_MAGIC || !is_replacement_of_loaded_object(loaded_object, replacement)) {
+        close_object_file(replacement);
+        return false;
+    }
+    // Check the relocations of the new file and those of the modules which resolve against it, before touching anything
+    exchange_object_file(loaded_object, replacement);
+    bool is_valid = relocate_loaded_object(loaded_object, false);
+    for(struct loaded_object* module = loaded_object->next_module; module && is_valid; module = module->next_module)
+        is_valid = relocate_loaded_object(module, false);
+    if(!is_valid) {
+        exchange_object_file(loaded_object, replacement);
+        close_object_file(replacement);
+        return false;
+    }
+    pause_vm(loaded_object->vm);
+    // Only the page table entries of the object change, the old memory slot is reused if the new file fits
+    replacement->writable_data = loaded_object->writable_data;
+    map_segments_of_elf(replacement, false);
+    unmap_memory_of_vm(loaded_object->vm, &replacement->file_data);
+    loaded_object->file_data.guest_address = (loaded_object->file_data.length <= replacement->file_data.length) ?
+        replacement->file_data.guest_address : find_free_guest_address_of_vm(loaded_object->vm, loaded_object->file_data.length);
+#ifdef __aarch64__
+    __builtin___clear_cache((char*)loaded_object->file_data.host_address, (char*)loaded_object->file_data.host_address + loaded_object->file_data.length);
+#endif
+    map_memory_of_vm(loaded_object->vm, &loaded_object->file_data);
+    map_segments_of_elf(loaded_object, true);
+#ifdef __x86_64__
+    // Gates point into the code, they are initialized from the new file again but keep their interrupt stacks
+    struct interrupt_gate_64* interrupt_table = NULL;
+    uint8_t interrupt_stack_table_indices[256];
+    if(loaded_object->expanded_interrupt_table) {
+        uint64_t interrupt_table_physical_address;
+        void* interrupt_table_host_address;
+        assert(resolve_address_using_page_table(loaded_object->page_table, false, loaded_object->expanded_interrupt_table, &interrupt_table_physical_address));
+        assert(resolve_address_of_vm(loaded_object->vm, interrupt_table_physical_address, &interrupt_table_host_address, 0x1000));
+        interrupt_table = interrupt_table_host_address;
+        for(size_t i = 0; i < 256; ++i)
+            interrupt_stack_table_indices[i] = interrupt_table[i].ist;
+        memcpy(interrupt_table, get_file_data_of_elf(loaded_object, loaded_object->expanded_interrupt_table - loaded_object->base_address), 0x1000);
+    }
+#endif
+    // Relocations might point into the code, so they are applied again, also those of the modules
+    assert(relocate_loaded_object(loaded_object, true));
+    for(struct loaded_object* module = loaded_object->next_module; module; module = module->next_module)
+        assert(relocate_loaded_object(module, true));
+#ifdef __x86_64__
+    if(interrupt_table) {
+        expand_interrupt_table(interrupt_table);
+        for(size_t i = 0; i < 256; ++i)
+            interrupt_table[i].ist = interrupt_stack_table_indices[i];
+    }
+#endif
+    resume_vm(loaded_object->vm);
+    replacement->writable_data.length = 0;
+    close_object_file(replacement);
+    return true;
+}
+
+static bool get_exported_symbol_of_loaded_object(struct loaded_object* loaded_object, uint64_t index, const char** symbol_name, uint64_t* virtual_address) {
     uint32_t magic = *(uint32_t*)loaded_object->file_data.host_address;
     switch(magic) {
         case ELF_MAGIC: {
-            struct elf64_sym* symbols = (struct elf64_sym*)loaded_object->symbol_table;
-            for(size_t i = 0; i < loaded_object->number_of_symbols; ++i)
-                if((symbols[i].st_info & 0x10) != 0 && strcmp(loaded_object->symbol_names + symbols[i].st_name, symbol_name) == 0) {
-                    *virtual_address = symbols[i].st_value;
-                    return true;
-                }
-        } break;
+            struct elf64_sym* symbol = &((struct elf64_sym*)loaded_object->symbol_table)[index];
+            if((symbol->st_info & 0x10) == 0 || symbol->st_shndx == SHN_UNDEF)
+                return false;
+            *symbol_name = loaded_object->symbol_names + symbol->st_name;
+            *virtual_address = loaded_object->base_address + symbol->st_value;
+            return true;
+        }
         case MACH_MAGIC: {
-            struct mach_symbol_table_entry_64* symbols = (struct mach_symbol_table_entry_64*)loaded_object->symbol_table;
-            for(size_t i = 0; i < loaded_object->number_of_symbols; ++i)
-                if(symbols[i].n_type == 0x0F && strcmp(loaded_object->symbol_names + symbols[i].n_strx, symbol_name) == 0) {
-                    *virtual_address = symbols[i].n_value;
-                    return true;
-                }
-        } break;
+            struct mach_symbol_table_entry_64* symbol = &((struct mach_symbol_table_entry_64*)loaded_object->symbol_table)[index];
+            if(symbol->n_type != 0x0F)
+                return false;
+            *symbol_name = loaded_object->symbol_names + symbol->n_strx;
+            *virtual_address = symbol->n_value;
+            return true;
+        }
     }
     return false;
 }
 
+// Layout of an image file, each part starts on a host page boundary:
+// header, object file, initial writable data, initial page tables, symbol index
+#define LOADED_IMAGE_MAGIC 0x4547414D49544652UL
+#define LOADED_IMAGE_VERSION 4
+struct loaded_image_header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t content_hash; // of the object file it was built from
+    uint64_t file_data_length;
+    uint64_t writable_data_length;
+    uint64_t page_table_levels;
+    uint64_t page_table_length;
+    uint64_t page_table_used_length;
+    uint64_t stack_pointer;
+    uint64_t writable_data_virtual_address;
+    uint64_t expanded_interrupt_table;
+    uint64_t number_of_symbols;
+    uint64_t symbol_names_offset;
+    uint64_t symbol_table_offset;
+    uint64_t number_of_symbol_buckets;
+};
+
+struct loaded_image {
+    struct loaded_image_header header;
+    int fd;
+};
+
+static uint64_t get_writable_data_offset_of_loaded_image(struct loaded_image* loaded_image) {
+    return round_up_to_host_page(sizeof(struct loaded_image_header)) + loaded_image->header.file_data_length;
+}
+
+static uint64_t get_page_table_offset_of_loaded_image(struct loaded_image* loaded_image) {
+    return get_writable_data_offset_of_loaded_image(loaded_image) + round_up_to_host_page(loaded_image->header.writable_data_length);
+}
+
+static uint64_t get_symbol_index_offset_of_loaded_image(struct loaded_image* loaded_image) {
+    return get_page_table_offset_of_loaded_image(loaded_image) + round_up_to_host_page(loaded_image->header.page_table_used_length);
+}
+
+static uint64_t get_symbol_index_length_of_loaded_image(struct loaded_image* loaded_image) {
+    return (loaded_image->header.number_of_symbol_buckets + loaded_image->header.number_of_symbols) * sizeof(uint32_t);
+}
+
+static void write_to_loaded_image(struct loaded_image* loaded_image, uint64_t offset, const void* data, uint64_t length) {
+    assert(pwrite(loaded_image->fd, data, length, (off_t)offset) == (ssize_t)length);
+}
+
+// Builds the image of an opened object file into an empty file
+static struct loaded_image* write_loaded_image(struct loaded_object* loaded_object, int fd, uint64_t content_hash) {
+    struct host_to_guest_mapping page_table_memory;
+    uint64_t page_table_used_length;
+    // Images do not belong to a VM, so they are built with the default depth
+    load_object_file(loaded_object, GUEST_PAGE_TABLE_DEFAULT_LEVELS, &page_table_memory, &page_table_used_length);
+    struct loaded_image* loaded_image = malloc(sizeof(struct loaded_image));
+    loaded_image->fd = fd;
+    loaded_image->header.magic = LOADED_IMAGE_MAGIC;
+    loaded_image->header.version = LOADED_IMAGE_VERSION;
+    loaded_image->header.content_hash = content_hash;
+    loaded_image->header.file_data_length = loaded_object->file_data.length;
+    loaded_image->header.writable_data_length = loaded_object->writable_data.length;
+    loaded_image->header.page_table_levels = GUEST_PAGE_TABLE_DEFAULT_LEVELS;
+    loaded_image->header.page_table_length = page_table_memory.length;
+    loaded_image->header.page_table_used_length = page_table_used_length;
+    loaded_image->header.stack_pointer = loaded_object->stack_pointer;
+    loaded_image->header.writable_data_virtual_address = loaded_object->writable_data_virtual_address;
+    loaded_image->header.expanded_interrupt_table = 0;
+    loaded_image->header.number_of_symbols = loaded_object->number_of_symbols;
+    loaded_image->header.symbol_names_offset = (uint64_t)loaded_object->symbol_names - (uint64_t)loaded_object->file_data.host_address;
+    loaded_image->header.symbol_table_offset = (uint64_t)loaded_object->symbol_table - (uint64_t)loaded_object->file_data.host_address;
+#ifdef __x86_64__
+    // Instances start with expanded gates, so the first vCPU does not have to rewrite them
+    uint64_t interrupt_table_virtual_address;
+    if(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "interrupt_table", &interrupt_table_virtual_address) &&
+       interrupt_table_virtual_address >= loaded_object->writable_data_virtual_address &&
+       interrupt_table_virtual_address - loaded_object->writable_data_virtual_address + 0x1000 <= loaded_object->writable_data_preinit_length) {
+        expand_interrupt_table((void*)((uint64_t)loaded_object->writable_data.host_address + (interrupt_table_virtual_address - loaded_object->writable_data_virtual_address)));
+        loaded_image->header.expanded_interrupt_table = interrupt_table_virtual_address;
+    }
+#endif
+    // Chained hash table over the exported symbols, inserted in reverse so that lookups find the first definition like a linear search does
+    uint64_t number_of_symbol_buckets = 1;
+    while(number_of_symbol_buckets < loaded_object->number_of_symbols)
+        number_of_symbol_buckets <<= 1;
+    loaded_image->header.number_of_symbol_buckets = number_of_symbol_buckets;
+    uint64_t symbol_index_length = get_symbol_index_length_of_loaded_image(loaded_image);
+    uint32_t* symbol_index = calloc(1, symbol_index_length);
+    for(uint64_t i = loaded_object->number_of_symbols; i > 0; --i) {
+        const char* symbol_name;
+        uint64_t virtual_address;
+        if(!get_exported_symbol_of_loaded_object(loaded_object, i - 1, &symbol_name, &virtual_address))
+            continue;
+        uint32_t* bucket = &symbol_index[hash_bytes(symbol_name, strlen(symbol_name)) & (number_of_symbol_buckets - 1)];
+        symbol_index[number_of_symbol_buckets + i - 1] = *bucket;
+        *bucket = (uint32_t)i;
+    }
+    // The zero filled rest of the writable data and the page table pool stay holes
+    uint64_t symbol_index_offset = get_symbol_index_offset_of_loaded_image(loaded_image);
+    assert(ftruncate(loaded_image->fd, (off_t)(symbol_index_offset + round_up_to_host_page(symbol_index_length))) == 0);
+    write_to_loaded_image(loaded_image, 0, loaded_image, sizeof(struct loaded_image_header)); // the header comes first
+    write_to_loaded_image(loaded_image, round_up_to_host_page(sizeof(struct loaded_image_header)), loaded_object->file_data.host_address, loaded_object->file_data.length);
+    write_to_loaded_image(loaded_image, get_writable_data_offset_of_loaded_image(loaded_image), loaded_object->writable_data.host_address, loaded_object->writable_data_preinit_length);
+    write_to_loaded_image(loaded_image, get_page_table_offset_of_loaded_image(loaded_image), page_table_memory.host_address, page_table_used_length);
+    write_to_loaded_image(loaded_image, symbol_index_offset, symbol_index, symbol_index_length);
+    free(symbol_index);
+    assert(munmap(page_table_memory.host_address, page_table_memory.length) == 0);
+    close_object_file(loaded_object);
+    return loaded_image;
+}
+
+struct loaded_image* create_loaded_image(const char* path) {
+    struct loaded_object* loaded_object = open_object_file(path);
+    uint64_t content_hash = hash_bytes(loaded_object->file_data.host_address, loaded_object->file_data.length);
+#ifdef __linux__
+    int fd = memfd_create("rift image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    assert(fd >= 0);
+#elif __APPLE__
+    char file_name[] = "/tmp/rift_image_XXXXXX";
+    int fd = mkstemp(file_name);
+    assert(fd >= 0);
+    assert(unlink(file_name) == 0);
+#endif
+    struct loaded_image* loaded_image = write_loaded_image(loaded_object, fd, content_hash);
+#ifdef __linux__
+    // Instances map everything privately, so nobody can modify the image anymore
+    assert(fcntl(loaded_image->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0);
+#endif
+    return loaded_image;
+}
+
+static bool read_loaded_image_header(int fd, struct loaded_image_header* header) {
+    struct stat stat;
+    if(pread(fd, header, sizeof(struct loaded_image_header), 0) != sizeof(struct loaded_image_header) ||
+       header->magic != LOADED_IMAGE_MAGIC || header->version != LOADED_IMAGE_VERSION || fstat(fd, &stat) != 0)
+        return false;
+    // Everything which gets mapped has to be in the file, touching a page past its end raises SIGBUS
+    struct loaded_image loaded_image = { .header = *header, .fd = fd };
+    return (uint64_t)stat.st_size >= get_symbol_index_offset_of_loaded_image(&loaded_image) + get_symbol_index_length_of_loaded_image(&loaded_image);
+}
+
+// The hash only names the cached file, the object file it was built from is stored in it and compared in full
+static bool is_loaded_image_of_object_file(struct loaded_image* loaded_image, struct loaded_object* loaded_object) {
+    if(loaded_image->header.file_data_length != loaded_object->file_data.length)
+        return false;
+    void* file_data = mmap(NULL, loaded_object->file_data.length, PROT_READ, MAP_PRIVATE, loaded_image->fd, (off_t)round_up_to_host_page(sizeof(struct loaded_image_header)));
+    if(file_data == MAP_FAILED)
+        return false;
+    bool is_equal = memcmp(file_data, loaded_object->file_data.host_address, loaded_object->file_data.length) == 0;
+    assert(munmap(file_data, loaded_object->file_data.length) == 0);
+    return is_equal;
+}
+
+struct loaded_image* create_loaded_image_using_cache(const char* path, const char* cache_directory) {
+    struct loaded_object* loaded_object = open_object_file(path);
+    uint64_t content_hash = hash_bytes(loaded_object->file_data.host_address, loaded_object->file_data.length);
+    char cache_path[4096];
+    assert(snprintf(cache_path, sizeof(cache_path), "%s/%016" PRIx64 ".image", cache_directory, content_hash) < (int)sizeof(cache_path));
+    struct loaded_image* loaded_image = malloc(sizeof(struct loaded_image));
+    loaded_image->fd = open(cache_path, O_RDONLY | O_CLOEXEC);
+    if(loaded_image->fd >= 0) {
+        if(read_loaded_image_header(loaded_image->fd, &loaded_image->header) && loaded_image->header.content_hash == content_hash &&
+           is_loaded_image_of_object_file(loaded_image, loaded_object)) {
+            close_object_file(loaded_object);
+            return loaded_image;
+        }
+        // Stale format, a damaged file or a collision of the file name, it is built again
+        assert(close(loaded_image->fd) == 0);
+    }
+    free(loaded_image);
+    // Built under a temporary name first, so that concurrent loaders never map a partial image
+    char temporary_path[sizeof(cache_path) + 8];
+    snprintf(temporary_path, sizeof(temporary_path), "%s.XXXXXX", cache_path);
+    int fd = mkstemp(temporary_path);
+    assert(fd >= 0);
+    loaded_image = write_loaded_image(loaded_object, fd, content_hash);
+    assert(rename(temporary_path, cache_path) == 0);
+    return loaded_image;
+}
+
+struct loaded_image* create_loaded_image_from_file_descriptor(int fd) {
+    struct loaded_image* loaded_image = malloc(sizeof(struct loaded_image));
+    loaded_image->fd = fd;
+    assert(read_loaded_image_header(fd, &loaded_image->header));
+    return loaded_image;
+}
+
+void destroy_loaded_image(struct loaded_image* loaded_image) {
+    assert(close(loaded_image->fd) == 0);
+    free(loaded_image);
+}
+
+int get_file_descriptor_of_loaded_image(struct loaded_image* loaded_image) {
+    return loaded_image->fd;
+}
+
+struct loaded_object* create_loaded_object_from_image(struct vm* vm, struct loaded_image* loaded_image) {
+    struct loaded_object* loaded_object = allocate_loaded_object(loaded_image->header.file_data_length);
+    loaded_object->vm = vm;
+    loaded_object->expanded_interrupt_table = loaded_image->header.expanded_interrupt_table;
+    loaded_object->writable_data_virtual_address = loaded_image->header.writable_data_virtual_address;
+    loaded_object->stack_pointer = loaded_image->header.stack_pointer;
+    loaded_object->number_of_symbols = loaded_image->header.number_of_symbols;
+    // Read only parts are shared through the page cache, writable ones are copied on write
+    loaded_object->file_data.host_address = mmap(NULL, loaded_object->file_data.length, PROT_READ, MAP_PRIVATE, loaded_image->fd, (off_t)round_up_to_host_page(sizeof(struct loaded_image_header)));
+    assert(loaded_object->file_data.host_address != MAP_FAILED);
+    loaded_object->symbol_names = (const char*)((uint64_t)loaded_object->file_data.host_address + loaded_image->header.symbol_names_offset);
+    loaded_object->symbol_table = (void*)((uint64_t)loaded_object->file_data.host_address + loaded_image->header.symbol_table_offset);
+    loaded_object->number_of_symbol_buckets = loaded_image->header.number_of_symbol_buckets;
+    loaded_object->symbol_index_length = get_symbol_index_length_of_loaded_image(loaded_image);
+    loaded_object->symbol_index = mmap(NULL, loaded_object->symbol_index_length, PROT_READ, MAP_PRIVATE, loaded_image->fd, (off_t)get_symbol_index_offset_of_loaded_image(loaded_image));
+    assert(loaded_object->symbol_index != MAP_FAILED);
+    loaded_object->writable_data.guest_address = loaded_object->file_data.length;
+    loaded_object->writable_data.length = loaded_image->header.writable_data_length;
+    loaded_object->writable_data.host_address = mmap(NULL, loaded_object->writable_data.length, PROT_READ | PROT_WRITE, MAP_PRIVATE, loaded_image->fd, (off_t)get_writable_data_offset_of_loaded_image(loaded_image));
+    assert(loaded_object->writable_data.host_address != MAP_FAILED);
+    // The prebuilt tables are followed by a private pool for tables created at runtime
+    struct host_to_guest_mapping page_table_memory;
+    page_table_memory.guest_address = loaded_object->writable_data.guest_address + loaded_object->writable_data.length;
+    page_table_memory.length = loaded_image->header.page_table_length;
+    page_table_memory.host_address = mmap(NULL, page_table_memory.length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    assert(page_table_memory.host_address != MAP_FAILED);
+    uint64_t page_table_used_length = loaded_image->header.page_table_used_length;
+    assert(mmap(page_table_memory.host_address, round_up_to_host_page(page_table_used_length), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, loaded_image->fd, (off_t)get_page_table_offset_of_loaded_image(loaded_image)) == page_table_memory.host_address);
+    map_memory_of_vm(loaded_object->vm, &loaded_object->file_data);
+    map_memory_of_vm(loaded_object->vm, &loaded_object->writable_data);
+    loaded_object->page_table = create_page_table_in_memory(loaded_object->vm, loaded_image->header.page_table_levels, &page_table_memory, page_table_used_length);
+    return loaded_object;
+}
+
+bool resolve_symbol_virtual_address_in_loaded_object(struct loaded_object* loaded_object, const char* symbol_name, uint64_t* virtual_address) {
+    const char* candidate_name;
+    uint64_t candidate_address;
+    if(loaded_object->symbol_index) {
+        uint64_t bucket = hash_bytes(symbol_name, strlen(symbol_name)) & (loaded_object->number_of_symbol_buckets - 1);
+        for(uint32_t entry = loaded_object->symbol_index[bucket]; entry; entry = loaded_object->symbol_index[loaded_object->number_of_symbol_buckets + entry - 1])
+            if(get_exported_symbol_of_loaded_object(loaded_object, entry - 1, &candidate_name, &candidate_address) && strcmp(candidate_name, symbol_name) == 0) {
+                *virtual_address = candidate_address;
+                return true;
+            }
+        return false;
+    }
+    for(uint64_t i = 0; i < loaded_object->number_of_symbols; ++i)
+        if(get_exported_symbol_of_loaded_object(loaded_object, i, &candidate_name, &candidate_address) && strcmp(candidate_name, symbol_name) == 0) {
+            *virtual_address = candidate_address;
+            return true;
+        }
+    return false;
+}
+
 bool resolve_symbol_host_address_in_loaded_object(struct loaded_object* loaded_object, bool write_access, const char* symbol_name, uint64_t length, void** host_address) {
     uint64_t virtual_address;
-    uint64_t physical_address;
-    return resolve_symbol_virtual_address_in_loaded_object(loaded_object, symbol_name, &virtual_address) &&
-        resolve_address_using_page_table(&loaded_object->page_table, write_access, virtual_address, &physical_address) &&
-        resolve_address_of_vm(loaded_object->vm, physical_address, host_address, length);
+    struct iovec iovec;
+    // The whole length has to be contiguous in host memory
+    if(!resolve_symbol_virtual_address_in_loaded_object(loaded_object, symbol_name, &virtual_address) ||
+       translate_range_of_page_table(loaded_object->page_table, write_access, virtual_address, length > 0 ? length : 1, 1, &iovec) != 1 ||
+       iovec.iov_len < length)
+        return false;
+    *host_address = iovec.iov_base;
+    return true;
+}
+
+struct page_table* get_page_table_of_loaded_object(struct loaded_object* loaded_object) {
+    return loaded_object->page_table;
 }
 
 struct vcpu* create_vcpu_for_loaded_object(struct loaded_object* loaded_object, const char* interrupt_table, const char* entry_point) {
@@ -361,22 +1047,27 @@ struct vcpu* create_vcpu_for_loaded_object(struct loaded_object* loaded_object,
     if(interrupt_table) {
         assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, interrupt_table, &interrupt_table_virtual_address));
 #ifdef __x86_64__
-        uint64_t interrupt_table_physical_address;
-        assert(resolve_address_using_page_table(&loaded_object->page_table, false, interrupt_table_virtual_address, &interrupt_table_physical_address));
-        void* interrupt_table_host_address;
-        assert(resolve_address_of_vm(loaded_object->vm, interrupt_table_physical_address, &interrupt_table_host_address, 0x1000));
-        uint64_t* interrupt_table_src = (uint64_t*)interrupt_table_host_address;
-        struct interrupt_gate_64* interrupt_table_dst = (struct interrupt_gate_64*)interrupt_table_host_address;
-        for(size_t i = 0; i < 256; ++i) {
-            uint64_t entry = interrupt_table_src[i * 2 + 1];
-            interrupt_table_dst[i].offset0 = entry & 0xFFFFUL;
-            interrupt_table_dst[i].offset1 = (entry >> 16) & 0xFFFFUL;
-            interrupt_table_dst[i].offset2 = (entry >> 32) & 0xFFFFFFFFUL;
-            interrupt_table_dst[i].padding = 0;
+        // Only once, all vCPUs share the table
+        if(!loaded_object->expanded_interrupt_table) {
+            void* interrupt_table_host_address;
+            assert(resolve_symbol_host_address_in_loaded_object(loaded_object, false, interrupt_table, 0x1000, &interrupt_table_host_address));
+            expand_interrupt_table(interrupt_table_host_address);
+            loaded_object->expanded_interrupt_table = interrupt_table_virtual_address;
         }
 #endif
     }
-    struct vcpu* vcpu = create_vcpu(loaded_object->vm, &loaded_object->page_table, interrupt_table_virtual_address);
+    struct vcpu* vcpu = create_vcpu(loaded_object->vm, loaded_object->page_table, interrupt_table_virtual_address);
+    resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "return_to_host", &vcpu->return_address);
+    void* clock_host_address;
+    if(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "guest_clock", sizeof(struct guest_clock), &clock_host_address)) {
+        if(loaded_object->vm->clock.nanoseconds_per_tick == 0)
+            calibrate_clock_of_vm(loaded_object->vm, vcpu);
+        memcpy(clock_host_address, &loaded_object->vm->clock, sizeof(struct guest_clock));
+    }
+    // The guest finds its page table through the self map, which depends on the depth
+    void* page_table_access_host_address;
+    if(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "page_table_access", sizeof(struct page_table_access), &page_table_access_host_address))
+        ((struct page_table_access*)page_table_access_host_address)->levels = loaded_object->page_table->access.levels;
 #ifdef __x86_64__
     set_register_of_vcpu(vcpu, 6, loaded_object->stack_pointer);
     set_register_of_vcpu(vcpu, 16, instruction_pointer);
@@ -0,0 +1,727 @@
+#include "platform.h"
+
+// Reserved behind the initial tables for tables created at runtime, only touched pages consume host memory
+#define PAGE_TABLE_POOL_SIZE (64UL << 20)
+
+uint64_t* resolve_table_of_page_table(void* context, uint64_t physical_address, uint64_t virtual_address, size_t level) {
+    (void)virtual_address;
+    (void)level;
+    struct page_table* page_table = (struct page_table*)context;
+    uint64_t offset = physical_address - page_table->memory.guest_address;
+    if(physical_address >= page_table->memory.guest_address && offset < page_table->memory.length)
+        return (uint64_t*)((uint64_t)page_table->memory.host_address + offset);
+    // The guest may have linked in tables from its own memory
+    void* host_address;
+    if(!resolve_address_of_vm(page_table->vm, physical_address, &host_address, GUEST_PAGE_SIZE))
+        return NULL;
+    return (uint64_t*)host_address;
+}
+
+uint64_t* allocate_table_of_page_table(void* context, uint64_t* physical_address) {
+    struct page_table* page_table = (struct page_table*)context;
+    if(page_table->used_length + GUEST_PAGE_SIZE > page_table->memory.length)
+        return NULL;
+    *physical_address = page_table->memory.guest_address + page_table->used_length;
+    uint64_t* entries = (uint64_t*)((uint64_t)page_table->memory.host_address + page_table->used_length);
+    page_table->used_length += GUEST_PAGE_SIZE;
+    return entries;
+}
+
+#define MAPPING_LEVELS_LOOP \
+    uint64_t end_virtual_address; \
+    if(mapping_index + 1 < number_of_mappings) \
+        end_virtual_address = mappings[mapping_index + 1].virtual_address; \
+    else \
+        end_virtual_address = 1UL << GUEST_VIRTUAL_ADDRESS_BITS(levels); \
+    if(mapping->flags == MAPPING_GAP) \
+        continue; \
+    uint64_t gap_start_entry_index = 0, gap_end_entry_index = 0; \
+    for(size_t parent_level = levels; parent_level > 0; --parent_level) { \
+        size_t level = parent_level - 1; \
+        uint64_t start_entry_index = mapping->virtual_address / level_page_size[level]; \
+        uint64_t end_entry_index = (end_virtual_address + level_page_size[level] - 1) / level_page_size[level]; \
+        uint64_t real_start_entry_index = start_entry_index; \
+        if(start_entry_index < level_entry_index[level]) \
+            start_entry_index = level_entry_index[level]; \
+        if(gap_end_entry_index < start_entry_index) \
+            gap_start_entry_index = gap_end_entry_index = start_entry_index; \
+        else if(gap_start_entry_index > end_entry_index) \
+            gap_start_entry_index = gap_end_entry_index = end_entry_index; \
+        if(gap_end_entry_index < gap_start_entry_index) \
+            gap_end_entry_index = gap_start_entry_index; \
+        uint64_t leaves_start_entry_index = (mapping->virtual_address + level_page_size[level] - 1) / level_page_size[level]; \
+        uint64_t leaves_end_entry_index = end_virtual_address / level_page_size[level]; \
+        if(level > (((mapping->flags & MAPPING_HUGE) != 0) ? GUEST_HUGE_PAGE_TABLE_LEVELS : 0)) \
+            leaves_end_entry_index = leaves_start_entry_index; \
+        uint64_t number_of_leaves = (leaves_end_entry_index > leaves_start_entry_index) ? leaves_end_entry_index - leaves_start_entry_index : 0;
+
+// Only branches get a table of the level below, leaves and the entries of a shared first table take none
+#define MAPPING_LEVELS_LOOP_END \
+        level_number_of_entries[level] += end_entry_index - start_entry_index - number_of_leaves; \
+        level_entry_index[level] = end_entry_index; \
+        gap_start_entry_index = leaves_start_entry_index * GUEST_ENTRIES_PER_PAGE; \
+        gap_end_entry_index = leaves_end_entry_index * GUEST_ENTRIES_PER_PAGE; \
+    }
+
+#define PARENT_RELATIVE_ENTRY_INDEX(entry_index) (((entry_index) < parent_leaves_start_entry_index) \
+    ? (entry_index) - parent_start_entry_index \
+    : (entry_index) - parent_start_entry_index - parent_number_of_leaves * GUEST_ENTRIES_PER_PAGE)
+
+#define LEAF_ENTRY(entry_index) (leaf_proto_entry | (((entry_index) - real_start_entry_index) * level_page_size[level] + mapping->physical_address))
+
+#define WRITE_ENTRY { \
+    bool is_leaf = leaves_start_entry_index <= entry_index && entry_index < leaves_end_entry_index; \
+    assert(level > 0 || is_leaf); \
+    uint64_t table_index = entry_index - start_entry_index - ((entry_index < leaves_start_entry_index) ? 0 : number_of_leaves); \
+    entries[PARENT_RELATIVE_ENTRY_INDEX(entry_index)] = is_leaf \
+        ? LEAF_ENTRY(entry_index) \
+        : branch_proto_entry | ((table_index + level_number_of_entries[level]) * GUEST_PAGE_SIZE + level_physical_address[level - 1]); \
+}
+
+// Branches are written one at a time, the leaves between them are one run of consecutive entries
+#define WRITE_ENTRIES(first_entry_index, end_entry_index_of_run) { \
+    uint64_t leaves_run_start_entry_index = (first_entry_index < leaves_start_entry_index) ? leaves_start_entry_index : first_entry_index; \
+    uint64_t leaves_run_end_entry_index = (end_entry_index_of_run < leaves_end_entry_index) ? end_entry_index_of_run : leaves_end_entry_index; \
+    if(leaves_run_end_entry_index <= leaves_run_start_entry_index) \
+        leaves_run_start_entry_index = leaves_run_end_entry_index = end_entry_index_of_run; \
+    for(uint64_t entry_index = first_entry_index; entry_index < leaves_run_start_entry_index; ++entry_index) \
+        WRITE_ENTRY \
+    if(leaves_run_start_entry_index < leaves_run_end_entry_index) \
+        fill_entries_of_page_table(&entries[PARENT_RELATIVE_ENTRY_INDEX(leaves_run_start_entry_index)], leaves_run_end_entry_index - leaves_run_start_entry_index, \
+                                   leaves_run_start_entry_index % GUEST_ENTRIES_PER_PAGE, LEAF_ENTRY(leaves_run_start_entry_index), level_page_size[level]); \
+    for(uint64_t entry_index = leaves_run_end_entry_index; entry_index < end_entry_index_of_run; ++entry_index) \
+        WRITE_ENTRY \
+}
+
+// Runs at least this long are split between threads
+#define PAGE_TABLE_FILL_ENTRIES_PER_THREAD (1UL << 20)
+#define PAGE_TABLE_FILL_MAXIMUM_THREADS 64
+
+typedef uint64_t page_table_entry_vector __attribute__((vector_size(32)));
+#define PAGE_TABLE_ENTRY_VECTOR_LANES (sizeof(page_table_entry_vector) / sizeof(uint64_t))
+
+struct page_table_fill {
+    uint64_t* entries;
+    uint64_t number_of_entries;
+    uint64_t first_entry;
+    uint64_t increment;
+};
+
+// Stores the arithmetic sequence first_entry, first_entry + increment, ... one vector at a time
+static void* fill_entries_of_page_table_in_thread(void* argument) {
+    struct page_table_fill* fill = argument;
+    page_table_entry_vector entry_vector, step_vector;
+    for(size_t lane = 0; lane < PAGE_TABLE_ENTRY_VECTOR_LANES; ++lane) {
+        entry_vector[lane] = fill->first_entry + lane * fill->increment;
+        step_vector[lane] = PAGE_TABLE_ENTRY_VECTOR_LANES * fill->increment;
+    }
+    uint64_t index = 0;
+    for(; index + PAGE_TABLE_ENTRY_VECTOR_LANES <= fill->number_of_entries; index += PAGE_TABLE_ENTRY_VECTOR_LANES) {
+        memcpy(&fill->entries[index], &entry_vector, sizeof(entry_vector));
+        entry_vector += step_vector;
+    }
+    for(; index < fill->number_of_entries; ++index)
+        fill->entries[index] = fill->first_entry + index * fill->increment;
+    return NULL;
+}
+
+// The run starts at first_table_index within its table
+static void fill_entries_of_page_table(uint64_t* entries, uint64_t number_of_entries, uint64_t first_table_index, uint64_t first_entry, uint64_t increment) {
+    uint64_t number_of_threads = number_of_entries / PAGE_TABLE_FILL_ENTRIES_PER_THREAD;
+    uint64_t number_of_processors = (uint64_t)sysconf(_SC_NPROCESSORS_ONLN);
+    if(number_of_threads > number_of_processors)
+        number_of_threads = number_of_processors;
+    if(number_of_threads > PAGE_TABLE_FILL_MAXIMUM_THREADS)
+        number_of_threads = PAGE_TABLE_FILL_MAXIMUM_THREADS;
+    if(number_of_threads < 1)
+        number_of_threads = 1;
+    // Chunks end on table boundaries, so that no two threads write to the same page, the calling thread takes the first one
+    uint64_t entries_per_thread = (number_of_entries / number_of_threads + GUEST_ENTRIES_PER_PAGE - 1) / GUEST_ENTRIES_PER_PAGE * GUEST_ENTRIES_PER_PAGE;
+    struct page_table_fill fills[PAGE_TABLE_FILL_MAXIMUM_THREADS];
+    pthread_t threads[PAGE_TABLE_FILL_MAXIMUM_THREADS];
+    uint64_t offset = 0;
+    for(uint64_t thread_index = 0; thread_index < number_of_threads; ++thread_index) {
+        uint64_t end_offset = (thread_index + 1) * entries_per_thread - first_table_index;
+        if(thread_index + 1 == number_of_threads || end_offset > number_of_entries)
+            end_offset = number_of_entries;
+        fills[thread_index].entries = &entries[offset];
+        fills[thread_index].number_of_entries = end_offset - offset;
+        fills[thread_index].first_entry = first_entry + offset * increment;
+        fills[thread_index].increment = increment;
+        if(thread_index > 0)
+            assert(pthread_create(&threads[thread_index], NULL, fill_entries_of_page_table_in_thread, &fills[thread_index]) == 0);
+        offset = end_offset;
+    }
+    fill_entries_of_page_table_in_thread(&fills[0]);
+    for(uint64_t thread_index = 1; thread_index < number_of_threads; ++thread_index)
+        assert(pthread_join(threads[thread_index], NULL) == 0);
+}
+
+void build_page_table(size_t levels, uint64_t guest_address, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings], struct host_to_guest_mapping* memory, uint64_t* used_length) {
+    assert(number_of_mappings > 0 && levels >= GUEST_PAGE_TABLE_MINIMUM_LEVELS && levels <= GUEST_PAGE_TABLE_MAXIMUM_LEVELS);
+    memory->guest_address = guest_address;
+    uint64_t level_physical_address[GUEST_PAGE_TABLE_MAXIMUM_LEVELS];
+    uint64_t level_page_size[GUEST_PAGE_TABLE_MAXIMUM_LEVELS];
+    uint64_t level_number_of_entries[GUEST_PAGE_TABLE_MAXIMUM_LEVELS];
+    uint64_t level_entry_index[GUEST_PAGE_TABLE_MAXIMUM_LEVELS];
+    for(size_t level = 0; level < levels; ++level) {
+        level_page_size[level] = 1UL << (GUEST_ENTRIES_PER_PAGE_SHIFT * (level + 1) + GUEST_PAGE_TABLE_ENTRY_SHIFT);
+        level_number_of_entries[level] = 0;
+        level_entry_index[level] = 0;
+    }
+    for(size_t mapping_index = 0; mapping_index < number_of_mappings; ++mapping_index) {
+        struct guest_internal_mapping* mapping = &mappings[mapping_index];
+        if(mapping_index == 0)
+            assert(mapping->virtual_address == 0);
+        else {
+            assert(mapping->virtual_address == mapping->virtual_address / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE);
+            struct guest_internal_mapping* prev_mapping = &mappings[mapping_index - 1];
+            assert(prev_mapping->flags != MAPPING_GAP || mapping->flags != MAPPING_GAP);
+            assert(prev_mapping->virtual_address != mapping->virtual_address);
+            if(prev_mapping->flags != MAPPING_GAP && mapping->flags != MAPPING_GAP) {
+                uint64_t prev_end_physical_address = prev_mapping->physical_address + (mapping->virtual_address - prev_mapping->virtual_address);
+                assert(prev_end_physical_address != mapping->physical_address || prev_mapping->flags != mapping->flags);
+            }
+        }
+        // Otherwise the leaves would not line up with the huge pages
+        assert((mapping->flags & MAPPING_HUGE) == 0 || (mapping->virtual_address % GUEST_HUGE_PAGE_SIZE == 0 && mapping->physical_address % GUEST_HUGE_PAGE_SIZE == 0));
+        MAPPING_LEVELS_LOOP
+            (void)real_start_entry_index;
+            assert(end_virtual_address <= GUEST_HEAP_ADDRESS(levels));
+        MAPPING_LEVELS_LOOP_END
+    }
+    memory->length = 0;
+    for(size_t parent_level = levels; parent_level > 0; --parent_level) {
+        size_t level = parent_level - 1;
+        level_physical_address[level] = memory->guest_address + memory->length;
+        memory->length += ((parent_level == levels) ? 1 : level_number_of_entries[parent_level]) * GUEST_PAGE_SIZE;
+    }
+    for(size_t level = 0; level < levels; ++level) {
+        level_number_of_entries[level] = 0;
+        level_entry_index[level] = 0;
+    }
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    *used_length = memory->length;
+    memory->length = (memory->length + PAGE_TABLE_POOL_SIZE + host_page_size - 1) / host_page_size * host_page_size;
+    memory->host_address = mmap(NULL, memory->length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    assert(memory->host_address != MAP_FAILED);
+#ifdef MADV_POPULATE_WRITE
+    // Faulting in the initial tables at once is cheaper than one at a time while they are written, older kernels just do the latter
+    madvise(memory->host_address, (*used_length + host_page_size - 1) / host_page_size * host_page_size, MADV_POPULATE_WRITE);
+#endif
+    uint64_t branch_proto_entry = PT_BRANCH;
+    for(size_t mapping_index = 0; mapping_index < number_of_mappings; ++mapping_index) {
+        struct guest_internal_mapping* mapping = &mappings[mapping_index];
+        uint64_t mapping_proto_entry = get_leaf_entry_of_mapping(mapping->flags);
+        uint64_t parent_start_entry_index = 0, parent_leaves_start_entry_index = 0, parent_number_of_leaves = 0;
+        uint64_t* entries = (uint64_t*)(level_physical_address[levels - 1] - memory->guest_address + (uint64_t)memory->host_address);
+        MAPPING_LEVELS_LOOP
+            uint64_t leaf_proto_entry = mapping_proto_entry;
+            if(level > 0)
+#ifdef __x86_64__
+                leaf_proto_entry |= PT_LEAF;
+#elif __aarch64__
+                leaf_proto_entry &= ~PT_NOT_LEAF;
+#endif
+            WRITE_ENTRIES(start_entry_index, gap_start_entry_index)
+            WRITE_ENTRIES(gap_end_entry_index, end_entry_index)
+            parent_start_entry_index = real_start_entry_index * GUEST_ENTRIES_PER_PAGE;
+            parent_leaves_start_entry_index = leaves_start_entry_index * GUEST_ENTRIES_PER_PAGE;
+            parent_number_of_leaves = number_of_leaves;
+            uint64_t page_offset = (level_number_of_entries[level] + real_start_entry_index - start_entry_index) * GUEST_PAGE_SIZE;
+            if(level > 0)
+                entries = (uint64_t*)(page_offset + level_physical_address[level - 1] - memory->guest_address + (uint64_t)memory->host_address);
+        MAPPING_LEVELS_LOOP_END
+    }
+    // Map the page table into itself so that the guest can modify it
+    uint64_t* root_entries = (uint64_t*)memory->host_address;
+    root_entries[GUEST_PAGE_TABLE_SELF_MAP_INDEX] = PT_SELF_MAP | memory->guest_address;
+}
+
+struct page_table_subtree_builder {
+    uint64_t number_of_mappings;
+    struct guest_internal_mapping* mappings;
+    uint64_t end_virtual_address;
+    // Table pages in the order they were completed, child tables are referenced by their offset until the subtree is placed
+    uint64_t* tables;
+    uint64_t* table_hashes;
+    uint8_t* table_levels;
+    uint64_t number_of_tables, tables_capacity;
+    // Open addressing over the tables, holding their index + 1 or 0 for a free slot
+    uint64_t* interned_tables;
+    uint64_t interned_tables_capacity;
+};
+
+static void insert_interned_table_of_subtree(struct page_table_subtree_builder* builder, uint64_t table_index) {
+    uint64_t slot = builder->table_hashes[table_index] & (builder->interned_tables_capacity - 1);
+    while(builder->interned_tables[slot] != 0)
+        slot = (slot + 1) & (builder->interned_tables_capacity - 1);
+    builder->interned_tables[slot] = table_index + 1;
+}
+
+// Returns the offset of an equal table which was completed before, or appends this one
+static uint64_t intern_table_of_subtree(struct page_table_subtree_builder* builder, const uint64_t* entries, size_t level) {
+    uint64_t hash = hash_bytes(entries, GUEST_PAGE_SIZE);
+    for(uint64_t slot = hash & (builder->interned_tables_capacity - 1); builder->interned_tables[slot] != 0; slot = (slot + 1) & (builder->interned_tables_capacity - 1)) {
+        uint64_t table_index = builder->interned_tables[slot] - 1;
+        if(builder->table_hashes[table_index] == hash && builder->table_levels[table_index] == level &&
+           memcmp(&builder->tables[table_index * GUEST_ENTRIES_PER_PAGE], entries, GUEST_PAGE_SIZE) == 0)
+            return table_index * GUEST_PAGE_SIZE;
+    }
+    if(builder->number_of_tables == builder->tables_capacity) {
+        builder->tables_capacity *= 2;
+        builder->tables = realloc(builder->tables, builder->tables_capacity * GUEST_PAGE_SIZE);
+        builder->table_hashes = realloc(builder->table_hashes, builder->tables_capacity * sizeof(uint64_t));
+        builder->table_levels = realloc(builder->table_levels, builder->tables_capacity * sizeof(uint8_t));
+        assert(builder->tables && builder->table_hashes && builder->table_levels);
+    }
+    uint64_t table_index = builder->number_of_tables++;
+    memcpy(&builder->tables[table_index * GUEST_ENTRIES_PER_PAGE], entries, GUEST_PAGE_SIZE);
+    builder->table_hashes[table_index] = hash;
+    builder->table_levels[table_index] = (uint8_t)level;
+    // Keep the load factor at or below one half
+    if(builder->number_of_tables * 2 > builder->interned_tables_capacity) {
+        free(builder->interned_tables);
+        builder->interned_tables_capacity *= 2;
+        builder->interned_tables = calloc(builder->interned_tables_capacity, sizeof(uint64_t));
+        assert(builder->interned_tables);
+        for(uint64_t index = 0; index < builder->number_of_tables; ++index)
+            insert_interned_table_of_subtree(builder, index);
+    } else
+        insert_interned_table_of_subtree(builder, table_index);
+    return table_index * GUEST_PAGE_SIZE;
+}
+
+static uint64_t build_table_of_subtree(struct page_table_subtree_builder* builder, uint64_t virtual_address, size_t level);
+
+// Returns the entry of the given level which covers virtual_address
+static uint64_t build_entry_of_subtree(struct page_table_subtree_builder* builder, uint64_t virtual_address, size_t level) {
+    uint64_t entry_size = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(level);
+    // The last mapping which starts at or before virtual_address
+    uint64_t low = 0, high = builder->number_of_mappings;
+    while(high - low > 1) {
+        uint64_t middle = (low + high) / 2;
+        if(builder->mappings[middle].virtual_address <= virtual_address)
+            low = middle;
+        else
+            high = middle;
+    }
+    struct guest_internal_mapping* mapping = &builder->mappings[low];
+    uint64_t end_virtual_address = (low + 1 < builder->number_of_mappings) ? builder->mappings[low + 1].virtual_address : builder->end_virtual_address;
+    if(virtual_address + entry_size <= end_virtual_address) {
+        if(mapping->flags == MAPPING_GAP)
+            return 0;
+        uint64_t physical_address = mapping->physical_address + (virtual_address - mapping->virtual_address);
+        uint64_t leaf_entry = get_leaf_entry_of_mapping(mapping->flags);
+#ifdef __x86_64__
+        // Subtrees are read only for the MMU as well, so their bits are set from the start
+        leaf_entry |= PT_ACC | (((mapping->flags & MAPPING_WRITABLE) != 0) ? PT_DIRTY : 0);
+#endif
+        if(level == 0)
+            return leaf_entry | physical_address;
+        if((mapping->flags & MAPPING_HUGE) != 0 && level <= GUEST_HUGE_PAGE_TABLE_LEVELS && physical_address % entry_size == 0)
+#ifdef __x86_64__
+            return (leaf_entry | PT_LEAF) | physical_address;
+#elif __aarch64__
+            return (leaf_entry & ~PT_NOT_LEAF) | physical_address;
+#endif
+    }
+    // Split between several mappings, so it needs a table of the level below
+#ifdef __x86_64__
+    return PT_BRANCH | PT_ACC | build_table_of_subtree(builder, virtual_address, level - 1);
+#elif __aarch64__
+    return PT_BRANCH | build_table_of_subtree(builder, virtual_address, level - 1);
+#endif
+}
+
+static uint64_t build_table_of_subtree(struct page_table_subtree_builder* builder, uint64_t virtual_address, size_t level) {
+    uint64_t entries[GUEST_ENTRIES_PER_PAGE];
+    for(uint64_t index = 0; index < GUEST_ENTRIES_PER_PAGE; ++index)
+        entries[index] = build_entry_of_subtree(builder, virtual_address + (index << GUEST_PAGE_TABLE_LEVEL_SHIFT(level)), level);
+    return intern_table_of_subtree(builder, entries, level);
+}
+
+static uint64_t hash_mappings_of_subtree(size_t level, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]) {
+    // Only up to the flags, the padding behind them is undefined
+    uint64_t hash = level;
+    for(uint64_t mapping_index = 0; mapping_index < number_of_mappings; ++mapping_index)
+        hash = hash * 31 + hash_bytes(&mappings[mapping_index], offsetof(struct guest_internal_mapping, flags) + 1);
+    return hash;
+}
+
+struct page_table_subtree* create_page_table_subtree(struct vm* vm, size_t level, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]) {
+    uint64_t end_virtual_address = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(level + 1);
+    assert(number_of_mappings > 0 && mappings[0].virtual_address == 0 && level + 1 < GUEST_PAGE_TABLE_MAXIMUM_LEVELS);
+    for(uint64_t mapping_index = 0; mapping_index < number_of_mappings; ++mapping_index) {
+        struct guest_internal_mapping* mapping = &mappings[mapping_index];
+        assert(mapping->virtual_address % GUEST_PAGE_SIZE == 0 && mapping->physical_address % GUEST_PAGE_SIZE == 0 && mapping->virtual_address < end_virtual_address);
+        assert(mapping_index == 0 || mappings[mapping_index - 1].virtual_address < mapping->virtual_address);
+    }
+    // Equal subtrees are only built once per VM
+    uint64_t mappings_hash = hash_mappings_of_subtree(level, number_of_mappings, mappings);
+    for(struct page_table_subtree* subtree = vm->page_table_subtrees; subtree; subtree = subtree->next) {
+        if(subtree->mappings_hash != mappings_hash || subtree->level != level || subtree->number_of_mappings != number_of_mappings)
+            continue;
+        uint64_t mapping_index = 0;
+        for(; mapping_index < number_of_mappings; ++mapping_index)
+            if(subtree->mappings[mapping_index].virtual_address != mappings[mapping_index].virtual_address ||
+               subtree->mappings[mapping_index].physical_address != mappings[mapping_index].physical_address ||
+               subtree->mappings[mapping_index].flags != mappings[mapping_index].flags)
+                break;
+        if(mapping_index < number_of_mappings)
+            continue;
+        ++subtree->number_of_references;
+        return subtree;
+    }
+    struct page_table_subtree_builder builder;
+    builder.number_of_mappings = number_of_mappings;
+    builder.mappings = mappings;
+    builder.end_virtual_address = end_virtual_address;
+    builder.number_of_tables = 0;
+    builder.tables_capacity = 16;
+    builder.tables = malloc(builder.tables_capacity * GUEST_PAGE_SIZE);
+    builder.table_hashes = malloc(builder.tables_capacity * sizeof(uint64_t));
+    builder.table_levels = malloc(builder.tables_capacity * sizeof(uint8_t));
+    builder.interned_tables_capacity = 32;
+    builder.interned_tables = calloc(builder.interned_tables_capacity, sizeof(uint64_t));
+    assert(builder.tables && builder.table_hashes && builder.table_levels && builder.interned_tables);
+    uint64_t root_offset = build_table_of_subtree(&builder, 0, level);
+    struct page_table_subtree* subtree = malloc(sizeof(struct page_table_subtree));
+    subtree->vm = vm;
+    subtree->number_of_references = 1;
+    subtree->level = level;
+    subtree->mappings_hash = mappings_hash;
+    subtree->number_of_mappings = number_of_mappings;
+    subtree->mappings = malloc(number_of_mappings * sizeof(struct guest_internal_mapping));
+    memcpy(subtree->mappings, mappings, number_of_mappings * sizeof(struct guest_internal_mapping));
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    subtree->memory.length = (builder.number_of_tables * GUEST_PAGE_SIZE + host_page_size - 1) / host_page_size * host_page_size;
+    subtree->memory.host_address = mmap(NULL, subtree->memory.length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+    assert(subtree->memory.host_address != MAP_FAILED);
+    subtree->memory.guest_address = find_free_guest_address_of_vm(vm, subtree->memory.length);
+    subtree->root = subtree->memory.guest_address + root_offset;
+    // Now that the tables have their place, turn the offsets of child tables into physical addresses
+    uint64_t* entries = subtree->memory.host_address;
+    memcpy(entries, builder.tables, builder.number_of_tables * GUEST_PAGE_SIZE);
+    for(uint64_t table_index = 0; table_index < builder.number_of_tables; ++table_index) {
+        if(builder.table_levels[table_index] == 0)
+            continue;
+        for(uint64_t entry_index = table_index * GUEST_ENTRIES_PER_PAGE; entry_index < (table_index + 1) * GUEST_ENTRIES_PER_PAGE; ++entry_index)
+#ifdef __x86_64__
+            if((entries[entry_index] & PT_PRE) != 0 && (entries[entry_index] & PT_LEAF) == 0)
+#elif __aarch64__
+            if((entries[entry_index] & PT_PRE) != 0 && (entries[entry_index] & PT_NOT_LEAF) != 0)
+#endif
+                entries[entry_index] += subtree->memory.guest_address;
+    }
+    // Shared by page tables which must not see each others modifications, so nobody gets to write the tables anymore
+    assert(mprotect(subtree->memory.host_address, subtree->memory.length, PROT_READ) == 0);
+    free(builder.tables);
+    free(builder.table_hashes);
+    free(builder.table_levels);
+    free(builder.interned_tables);
+    map_read_only_memory_of_vm(vm, &subtree->memory);
+    subtree->next = vm->page_table_subtrees;
+    vm->page_table_subtrees = subtree;
+    return subtree;
+}
+
+void destroy_page_table_subtree(struct page_table_subtree* subtree) {
+    if(--subtree->number_of_references > 0)
+        return;
+    struct page_table_subtree** link = &subtree->vm->page_table_subtrees;
+    while(*link != subtree)
+        link = &(*link)->next;
+    *link = subtree->next;
+    unmap_memory_of_vm(subtree->vm, &subtree->memory);
+    assert(munmap(subtree->memory.host_address, subtree->memory.length) == 0);
+    free(subtree->mappings);
+    free(subtree);
+}
+
+struct page_table* create_page_table_in_memory(struct vm* vm, size_t levels, struct host_to_guest_mapping* memory, uint64_t used_length) {
+    struct page_table* page_table = malloc(sizeof(struct page_table));
+    page_table->vm = vm;
+    page_table->memory = *memory;
+    page_table->used_length = used_length;
+    page_table->generation = 0;
+    page_table->translation_epoch = 0;
+    page_table->translation_cache_epoch = 0;
+    page_table->translation_cache_memory_generation = vm->memory_generation;
+    for(size_t index = 0; index < PAGE_TABLE_TRANSLATION_CACHE_SIZE; ++index)
+        page_table->translation_cache[index].is_valid = false;
+    assert(pthread_mutex_init(&page_table->translation_cache_lock, NULL) == 0);
+    page_table->next_shared_buffer_address = GUEST_SHARED_BUFFER_ADDRESS(levels);
+    page_table->next_heap_address = GUEST_HEAP_ADDRESS(levels);
+    page_table->number_of_heap_chunks = 0;
+    page_table->number_of_grafts = 0;
+    page_table->access.root = memory->guest_address;
+    page_table->access.levels = levels;
+    page_table->access.context = page_table;
+    page_table->access.resolve_table = resolve_table_of_page_table;
+    page_table->access.allocate_table = allocate_table_of_page_table;
+    page_table->access.tlb_is_stale = false;
+    map_memory_of_vm(vm, &page_table->memory);
+    return page_table;
+}
+
+struct page_table* create_page_table(struct vm* vm, uint64_t guest_address, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]) {
+    struct host_to_guest_mapping memory;
+    uint64_t used_length;
+    build_page_table(vm->page_table_levels, guest_address, number_of_mappings, mappings, &memory, &used_length);
+    return create_page_table_in_memory(vm, vm->page_table_levels, &memory, used_length);
+}
+
+void destroy_page_table(struct page_table* page_table) {
+    for(uint64_t graft_index = 0; graft_index < page_table->number_of_grafts; ++graft_index)
+        destroy_page_table_subtree(page_table->grafts[graft_index].subtree);
+    for(uint64_t chunk_index = 0; chunk_index < page_table->number_of_heap_chunks; ++chunk_index) {
+        struct host_to_guest_mapping* chunk = &page_table->heap_chunks[chunk_index];
+        unmap_memory_of_vm(page_table->vm, chunk);
+        assert(munmap(chunk->host_address, chunk->length) == 0);
+    }
+    unmap_memory_of_vm(page_table->vm, &page_table->memory);
+    assert(munmap(page_table->memory.host_address, page_table->memory.length) == 0);
+    assert(pthread_mutex_destroy(&page_table->translation_cache_lock) == 0);
+    free(page_table);
+}
+
+// Direct mapped by the virtual page number, only successful walks are cached. Copies the translation out, as other
+// threads may replace the cached one as soon as the lock is released.
+static bool translate_page_of_page_table(struct page_table* page_table, bool write_access, uint64_t virtual_address, struct page_table_translation* result) {
+    assert(pthread_mutex_lock(&page_table->translation_cache_lock) == 0);
+    uint64_t translation_epoch = __atomic_load_n(&page_table->translation_epoch, __ATOMIC_ACQUIRE);
+    uint64_t memory_generation = __atomic_load_n(&page_table->vm->memory_generation, __ATOMIC_ACQUIRE);
+    if(page_table->translation_cache_epoch != translation_epoch || page_table->translation_cache_memory_generation != memory_generation) {
+        page_table->translation_cache_epoch = translation_epoch;
+        page_table->translation_cache_memory_generation = memory_generation;
+        for(size_t index = 0; index < PAGE_TABLE_TRANSLATION_CACHE_SIZE; ++index)
+            page_table->translation_cache[index].is_valid = false;
+    }
+    uint64_t virtual_page = virtual_address / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE;
+    struct page_table_translation* translation = &page_table->translation_cache[(virtual_address / GUEST_PAGE_SIZE) % PAGE_TABLE_TRANSLATION_CACHE_SIZE];
+    if(!translation->is_valid || translation->virtual_page != virtual_page) {
+        // Walks for write access first, so that a read-only page costs a second walk only when it is actually read
+        uint64_t physical_page;
+        bool is_writable = walk_page_table(&page_table->access, true, virtual_page, &physical_page);
+        if(!is_writable && (write_access || !walk_page_table(&page_table->access, false, virtual_page, &physical_page))) {
+            assert(pthread_mutex_unlock(&page_table->translation_cache_lock) == 0);
+            return false;
+        }
+        translation->virtual_page = virtual_page;
+        translation->physical_page = physical_page;
+        translation->is_writable = is_writable;
+        if(!resolve_address_of_vm(page_table->vm, physical_page, &translation->host_page, GUEST_PAGE_SIZE))
+            translation->host_page = NULL;
+        translation->is_valid = true;
+    }
+    *result = *translation;
+    assert(pthread_mutex_unlock(&page_table->translation_cache_lock) == 0);
+    return !write_access || result->is_writable;
+}
+
+bool resolve_address_using_page_table(struct page_table* page_table, bool write_access, uint64_t virtual_address, uint64_t* physical_address) {
+    struct page_table_translation translation;
+    if(!translate_page_of_page_table(page_table, write_access, virtual_address, &translation))
+        return false;
+    *physical_address = translation.physical_page + virtual_address % GUEST_PAGE_SIZE;
+    return true;
+}
+
+uint64_t translate_range_of_page_table(struct page_table* page_table, bool write_access, uint64_t virtual_address, uint64_t length, uint64_t number_of_iovecs, struct iovec iovecs[number_of_iovecs]) {
+    uint64_t iovec_index = 0;
+    for(uint64_t offset = 0; offset < length; ) {
+        struct page_table_translation translation;
+        if(!translate_page_of_page_table(page_table, write_access, virtual_address + offset, &translation) || !translation.host_page)
+            break;
+        uint64_t page_offset = (virtual_address + offset) % GUEST_PAGE_SIZE, chunk_length = GUEST_PAGE_SIZE - page_offset;
+        if(chunk_length > length - offset)
+            chunk_length = length - offset;
+        uint8_t* host_address = (uint8_t*)translation.host_page + page_offset;
+        // Pages which are neighbors in host memory too extend the previous iovec
+        if(iovec_index > 0 && (uint8_t*)iovecs[iovec_index - 1].iov_base + iovecs[iovec_index - 1].iov_len == host_address) {
+            iovecs[iovec_index - 1].iov_len += chunk_length;
+        } else if(iovec_index < number_of_iovecs) {
+            iovecs[iovec_index].iov_base = host_address;
+            iovecs[iovec_index].iov_len = chunk_length;
+            ++iovec_index;
+        } else
+            break;
+        offset += chunk_length;
+    }
+    return iovec_index;
+}
+
+// vCPUs pick up the new generation and flush their TLB before they enter the guest again, running ones are kicked out first
+static void publish_page_table_changes(struct page_table* page_table) {
+    if(!page_table->access.tlb_is_stale)
+        return;
+    page_table->access.tlb_is_stale = false;
+    __atomic_add_fetch(&page_table->generation, 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&page_table->translation_epoch, 1, __ATOMIC_RELEASE);
+    shoot_down_tlbs_of_page_table(page_table);
+}
+
+// Grafted subtrees are shared with other page tables, so they are not modified through this one
+static bool overlaps_graft_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length) {
+    for(uint64_t graft_index = 0; graft_index < page_table->number_of_grafts; ++graft_index) {
+        struct page_table_graft* graft = &page_table->grafts[graft_index];
+        uint64_t graft_length = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(graft->subtree->level + 1);
+        if(virtual_address < graft->virtual_address + graft_length && graft->virtual_address < virtual_address + length)
+            return true;
+    }
+    return false;
+}
+
+void map_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t physical_address, uint64_t length, uint8_t flags) {
+    assert(virtual_address % GUEST_PAGE_SIZE == 0 && physical_address % GUEST_PAGE_SIZE == 0 && length % GUEST_PAGE_SIZE == 0);
+    assert(!overlaps_graft_of_page_table(page_table, virtual_address, length));
+    assert(virtual_address + length <= GUEST_PAGE_TABLE_SELF_MAP_ADDRESS(page_table->access.levels));
+    assert(write_page_table_range(&page_table->access, virtual_address, physical_address, length, flags));
+    publish_page_table_changes(page_table);
+}
+
+void unmap_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length) {
+    assert(virtual_address % GUEST_PAGE_SIZE == 0 && length % GUEST_PAGE_SIZE == 0);
+    assert(!overlaps_graft_of_page_table(page_table, virtual_address, length));
+    assert(clear_page_table_range(&page_table->access, virtual_address, length));
+    publish_page_table_changes(page_table);
+}
+
+void protect_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length, uint8_t flags) {
+    assert(virtual_address % GUEST_PAGE_SIZE == 0 && length % GUEST_PAGE_SIZE == 0);
+    assert(!overlaps_graft_of_page_table(page_table, virtual_address, length));
+    assert(protect_page_table_range(&page_table->access, virtual_address, length, flags));
+    publish_page_table_changes(page_table);
+}
+
+bool graft_subtree_into_page_table(struct page_table* page_table, struct page_table_subtree* subtree, uint64_t virtual_address) {
+    uint64_t length = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(subtree->level + 1);
+    assert(subtree->vm == page_table->vm && virtual_address % length == 0);
+    // Below the heap, so that neither grow_heap_of_page_table nor shared buffers run into it
+    if(subtree->level + 1 >= page_table->access.levels ||
+       virtual_address + length > GUEST_HEAP_ADDRESS(page_table->access.levels) ||
+       page_table->number_of_grafts == sizeof(page_table->grafts) / sizeof(page_table->grafts[0]) ||
+       !link_table_into_page_table(&page_table->access, virtual_address, subtree->level, subtree->root))
+        return false;
+    struct page_table_graft* graft = &page_table->grafts[page_table->number_of_grafts++];
+    graft->virtual_address = virtual_address;
+    graft->subtree = subtree;
+    ++subtree->number_of_references;
+    return true;
+}
+
+bool prune_subtree_from_page_table(struct page_table* page_table, uint64_t virtual_address) {
+    for(uint64_t graft_index = 0; graft_index < page_table->number_of_grafts; ++graft_index) {
+        struct page_table_graft* graft = &page_table->grafts[graft_index];
+        if(graft->virtual_address != virtual_address)
+            continue;
+        assert(unlink_table_from_page_table(&page_table->access, virtual_address, graft->subtree->level));
+        publish_page_table_changes(page_table);
+        destroy_page_table_subtree(graft->subtree);
+        *graft = page_table->grafts[--page_table->number_of_grafts];
+        return true;
+    }
+    return false;
+}
+
+uint64_t get_leaf_entry_of_page_table(struct page_table* page_table, uint64_t virtual_address) {
+    uint64_t* entry = find_leaf_entry_in_page_table(&page_table->access, virtual_address);
+    return entry ? *entry : 0;
+}
+
+bool publish_code_of_page_table(struct page_table* page_table, uint64_t virtual_address, const void* code, uint64_t length) {
+    // Written through the host mapping, so the guest mapping can stay executable without ever being writable
+    struct iovec iovecs[16];
+    for(uint64_t offset = 0; offset < length; ) {
+        uint64_t number_of_iovecs = translate_range_of_page_table(page_table, false, virtual_address + offset, length - offset, sizeof(iovecs) / sizeof(iovecs[0]), iovecs);
+        if(number_of_iovecs == 0)
+            return false;
+        for(uint64_t iovec_index = 0; iovec_index < number_of_iovecs; ++iovec_index) {
+            char* host_address = iovecs[iovec_index].iov_base;
+            memcpy(host_address, (const uint8_t*)code + offset, iovecs[iovec_index].iov_len);
+#ifdef __aarch64__
+            // Cleans the data cache and invalidates the instruction cache to the point of unification, entering the guest synchronizes the context
+            __builtin___clear_cache(host_address, host_address + iovecs[iovec_index].iov_len);
+#endif
+            offset += iovecs[iovec_index].iov_len;
+        }
+    }
+    return true;
+}
+
+uint64_t grow_heap_of_page_table(struct page_table* page_table, uint64_t length) {
+    length = (length + GUEST_HUGE_PAGE_SIZE - 1) / GUEST_HUGE_PAGE_SIZE * GUEST_HUGE_PAGE_SIZE;
+    if(length == 0 ||
+       page_table->number_of_heap_chunks == sizeof(page_table->heap_chunks) / sizeof(page_table->heap_chunks[0]) ||
+       length > GUEST_SHARED_BUFFER_ADDRESS(page_table->access.levels) - page_table->next_heap_address)
+        return 0;
+    // Backed lazily, so the footprint follows what the guest actually touches
+    struct host_to_guest_mapping* chunk = &page_table->heap_chunks[page_table->number_of_heap_chunks];
+    chunk->length = length;
+    chunk->host_address = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+    if(chunk->host_address == MAP_FAILED)
+        return 0;
+    chunk->guest_address = find_free_guest_address_of_vm(page_table->vm, length);
+    map_memory_of_vm(page_table->vm, chunk);
+    ++page_table->number_of_heap_chunks;
+    uint64_t virtual_address = page_table->next_heap_address;
+    page_table->next_heap_address += length;
+    map_range_of_page_table(page_table, virtual_address, chunk->guest_address, length, MAPPING_READABLE | MAPPING_WRITABLE);
+    return virtual_address;
+}
+
+void discard_range_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length) {
+    // Coalesce pages which are physically contiguous within the same memory slot
+    uint64_t run_start = 0, run_length = 0;
+    for(uint64_t offset = 0; offset < length; offset += GUEST_PAGE_SIZE) {
+        uint64_t physical_address;
+        if(!resolve_address_using_page_table(page_table, true, virtual_address + offset, &physical_address))
+            continue;
+        struct host_to_guest_mapping* mapping = get_memory_of_vm(page_table->vm, physical_address);
+        if(!mapping)
+            continue;
+        if(run_length > 0 && run_start + run_length == physical_address && physical_address != mapping->guest_address) {
+            run_length += GUEST_PAGE_SIZE;
+            continue;
+        }
+        if(run_length > 0)
+            discard_memory_of_vm(page_table->vm, run_start, run_length);
+        run_start = physical_address;
+        run_length = GUEST_PAGE_SIZE;
+    }
+    if(run_length > 0)
+        discard_memory_of_vm(page_table->vm, run_start, run_length);
+}
+
+void scan_access_of_page_table(struct page_table* page_table, uint64_t virtual_address, uint64_t length, bool clear, uint8_t page_flags[], uint8_t ages[], struct page_access_statistics* statistics) {
+    assert(virtual_address % GUEST_PAGE_SIZE == 0 && length % GUEST_PAGE_SIZE == 0);
+    statistics->number_of_mapped_pages = 0;
+    statistics->number_of_accessed_pages = 0;
+    statistics->number_of_dirty_pages = 0;
+    uint8_t clear_flags = clear ? page_table->vm->hardware_page_flags : 0;
+    // One table of pages at a time, grafts cover whole tables so they can keep the bits which other page tables share
+    uint8_t table_flags[GUEST_ENTRIES_PER_PAGE];
+    uint64_t table_span = 1UL << GUEST_PAGE_TABLE_LEVEL_SHIFT(1);
+    for(uint64_t offset = 0; offset < length; ) {
+        uint64_t chunk_length = table_span - (virtual_address + offset) % table_span;
+        if(chunk_length > length - offset)
+            chunk_length = length - offset;
+        bool is_grafted = overlaps_graft_of_page_table(page_table, virtual_address + offset, chunk_length);
+        harvest_page_table_range(&page_table->access, virtual_address + offset, chunk_length, is_grafted ? 0 : clear_flags, table_flags);
+        for(uint64_t index = 0; index < chunk_length / GUEST_PAGE_SIZE; ++index) {
+            uint8_t flags = table_flags[index];
+            uint64_t page_index = offset / GUEST_PAGE_SIZE + index;
+            statistics->number_of_mapped_pages += (flags & PAGE_MAPPED) != 0;
+            statistics->number_of_accessed_pages += (flags & PAGE_ACCESSED) != 0;
+            statistics->number_of_dirty_pages += (flags & PAGE_DIRTY) != 0;
+            if(page_flags)
+                page_flags[page_index] = flags;
+            if(ages)
+                ages[page_index] = (flags & PAGE_ACCESSED) != 0 ? 0 : (ages[page_index] < UINT8_MAX ? ages[page_index] + 1 : UINT8_MAX);
+        }
+        offset += chunk_length;
+    }
+    // vCPUs flush their TLB before they enter again, so the MMU sets the cleared bits anew
+    publish_page_table_changes(page_table);
+}
@@ -1,11 +1,15 @@
 #include <assert.h>
+#include <inttypes.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <signal.h>
 
 #ifdef __linux__
 #include <stddef.h>
@@ -27,20 +31,135 @@
 #include <rift.h>
 #include <guest.h>
 
+struct lazy_memory {
+    uint64_t host_address;
+    uint64_t length;
+    fill_memory_callback fill;
+    void* context;
+};
+
 struct vm {
     struct host_to_guest_mapping mappings[32];
+    uint32_t read_only_slots; // bit mask over mappings
+    struct guest_clock clock;
+    uint64_t clock_counter_offset;
+    struct vm_snapshot* snapshot; // at most one as they share the dirty log
+    uint64_t number_of_vcpus;
+    bool has_interrupt_controller;
+    size_t page_table_levels; // of page tables created from now on
+    struct page_table_subtree* page_table_subtrees; // interned by their level and mappings
+    uint8_t hardware_page_flags; // PAGE_ACCESSED and PAGE_DIRTY if the MMU sets them in the leaves
+    uint64_t memory_generation; // incremented whenever memory slots or their content change behind the back of page tables
+    // vCPUs started by the guest, each one keeps a host thread once it ran first
+    pthread_mutex_t secondary_vcpus_lock;
+    struct secondary_vcpu* secondary_vcpus[NUMBER_OF_STARTABLE_VCPUS];
+    // vCPUs wait before entering the guest while it is paused, the ones inside are kicked out
+    pthread_mutex_t pause_lock;
+    pthread_cond_t pause_changed;
+    uint64_t number_of_pauses;
+    uint64_t number_of_tlb_shootdowns; // waiting for kicked vCPUs to flush their TLB
+    struct vcpu* running_vcpus;
 #ifdef __linux__
     int kvm_fd, fd;
+    // Lazily backed slots are resolved by a handler thread, started on first use
+    int userfault_fd, userfault_stop_fd;
+    pthread_t userfault_thread;
+    pthread_mutex_t lazy_memory_lock;
+    struct lazy_memory lazy_memories[32];
 #endif
 };
 
 #ifdef __linux__
 void vm_ctl(struct vm* vm, uint32_t request, uint64_t param);
+#ifdef __x86_64__
+// Has to be freed by the caller
+struct kvm_cpuid2* get_supported_cpuid_of_vm(struct vm* vm);
 #endif
+#endif
+struct host_to_guest_mapping* get_memory_of_vm(struct vm* vm, uint64_t guest_address);
+// Guest writes to it exit to the host, the MMU must not have to set accessed or dirty bits in it either
+void map_read_only_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping);
+uint64_t find_free_guest_address_of_vm(struct vm* vm, uint64_t length);
+
+// FNV-1a, for the names of cached images, symbol names and page table subtrees, equality is always checked separately
+static inline uint64_t hash_bytes(const void* data, uint64_t length) {
+    uint64_t hash = 0xCBF29CE484222325UL;
+    for(uint64_t i = 0; i < length; ++i)
+        hash = (hash ^ ((const uint8_t*)data)[i]) * 0x100000001B3UL;
+    return hash;
+}
+
+#ifdef __linux__
+void unregister_lazy_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping);
+void stop_lazy_memory_of_vm(struct vm* vm);
+#endif
+void stop_secondary_vcpus_of_vm(struct vm* vm);
+#if defined(__linux__) && !defined(VCPU_KICK_SIGNAL)
+#define VCPU_KICK_SIGNAL SIGUSR2
+#endif
+
+#define PAGE_TABLE_TRANSLATION_CACHE_SIZE 64
+
+struct page_table_translation {
+    uint64_t virtual_page;
+    uint64_t physical_page;
+    void* host_page; // NULL if no memory slot backs the page
+    bool is_valid, is_writable;
+};
+
+struct page_table {
+    struct vm* vm;
+    struct host_to_guest_mapping memory; // root, initial tables and the pool for runtime tables
+    uint64_t used_length;
+    uint64_t next_shared_buffer_address;
+    uint64_t next_heap_address;
+    uint64_t number_of_heap_chunks;
+    struct host_to_guest_mapping heap_chunks[16];
+    uint64_t number_of_grafts;
+    struct page_table_graft {
+        uint64_t virtual_address;
+        struct page_table_subtree* subtree;
+    } grafts[16];
+    uint64_t generation; // incremented whenever translations which might be cached in a TLB change
+    // Also incremented on every exit of a vCPU, as the guest might have changed the tables meanwhile
+    uint64_t translation_epoch;
+    // Software TLB of the host, flushed once the epoch or the memory generation of the VM moved on
+    pthread_mutex_t translation_cache_lock;
+    uint64_t translation_cache_epoch, translation_cache_memory_generation;
+    struct page_table_translation translation_cache[PAGE_TABLE_TRANSLATION_CACHE_SIZE];
+    struct page_table_access access;
+};
+
+struct page_table_subtree {
+    struct vm* vm;
+    struct page_table_subtree* next;
+    uint64_t number_of_references; // creations and grafts
+    size_t level;
+    uint64_t mappings_hash;
+    uint64_t number_of_mappings;
+    struct guest_internal_mapping* mappings;
+    struct host_to_guest_mapping memory; // table pages, each distinct one only once
+    uint64_t root;
+};
+
+void build_page_table(size_t levels, uint64_t guest_address, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings], struct host_to_guest_mapping* memory, uint64_t* used_length);
+struct page_table* create_page_table_in_memory(struct vm* vm, size_t levels, struct host_to_guest_mapping* memory, uint64_t used_length);
 
 struct vcpu {
     struct vm* vm;
-    struct host_to_guest_mapping* page_table;
+    uint64_t index;
+    struct page_table* page_table;
+    uint64_t page_table_generation;
+    uint64_t interrupt_table_pointer;
+#ifdef __aarch64__
+    uint64_t address_space_id, address_space_id_mask;
+    bool timer_interrupt_level; // of the virtual timer, forwarded to the IRQ line by the host
+#endif
+    uint64_t exception_frame_address;
+    uint64_t return_address, return_value; // of functions called by the host
+    uint64_t system_call_number, system_call_arguments_address; // forwarded by user mode
+    pthread_t thread; // which runs it while it is in vm->running_vcpus
+    struct vcpu* next_running_vcpu;
 #ifdef __linux__
     int fd;
     struct kvm_run* kvm_run;
@@ -53,3 +172,53 @@ struct vcpu {
 #endif
 #endif
 };
+
+// Architectural state which a snapshot restores, memory is captured separately
+struct vcpu_state {
+    uint64_t exception_frame_address;
+#ifdef __linux__
+#ifdef __x86_64__
+    struct kvm_regs regs;
+    struct kvm_sregs sregs;
+    // Region of struct kvm_xsave, which covers the legacy FPU and SSE state as well
+    uint32_t xsave[1024];
+    struct kvm_msr_entry msrs[5];
+#elif __aarch64__
+    struct kvm_reg_list* register_list;
+    uint8_t* register_values;
+#endif
+#elif __APPLE__
+#ifdef __x86_64__
+    uint64_t registers[NUMBER_OF_REGISTERS];
+    uint64_t vmcs_fields[16];
+    uint8_t fpstate[4096] __attribute__((aligned(64)));
+#elif __aarch64__
+    uint64_t registers[35];
+    hv_simd_fp_uchar16_t simd_fp_registers[32];
+    uint64_t system_registers[16];
+#endif
+#endif
+};
+
+void save_state_of_vcpu(struct vcpu* vcpu, struct vcpu_state* state);
+void load_state_of_vcpu(struct vcpu* vcpu, struct vcpu_state* state);
+void release_state_of_vcpu(struct vcpu_state* state);
+
+#ifdef __linux__
+void vcpu_ctl(struct vcpu* vcpu, uint32_t request, uint64_t param);
+#ifdef __aarch64__
+uint64_t rreg(struct vcpu* vcpu, uint64_t id);
+#endif
+#elif __APPLE__
+#ifdef __x86_64__
+uint64_t rvmcs(struct vcpu* vcpu, uint32_t id);
+#endif
+#endif
+// Makes a vCPU in vm->running_vcpus leave the guest soon, called with vm->pause_lock held
+void kick_vcpu(struct vcpu* vcpu);
+// Returns once no vCPU other than the calling one runs on a stale generation of the page table
+void shoot_down_tlbs_of_page_table(struct page_table* page_table);
+// Handles a start request of the guest, the new vCPU shares the page table and interrupt table of the requesting one
+int64_t start_secondary_vcpu(struct vcpu* vcpu, uint64_t target, uint64_t entry_point, uint64_t context);
+
+void calibrate_clock_of_vm(struct vm* vm, struct vcpu* vcpu);
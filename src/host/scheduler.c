@@ -0,0 +1,121 @@
+#include <pthread.h>
+#include "platform.h"
+
+struct scheduler_vcpu {
+    struct scheduler* scheduler;
+    uint64_t index;
+    pthread_t thread;
+};
+
+struct scheduler {
+    struct loaded_object* loaded_object;
+    struct task_queue* submissions;
+    struct task_queue* completions;
+    uint64_t run_scheduler_address;
+    uint64_t stacks_address;
+    uint64_t time_slice;
+    uint64_t number_of_vcpus, number_of_created_vcpus;
+    struct scheduler_vcpu* vcpus;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted;
+    bool is_stopping;
+};
+
+static void* run_scheduler_on_vcpu(void* argument) {
+    struct scheduler_vcpu* scheduler_vcpu = argument;
+    struct scheduler* scheduler = scheduler_vcpu->scheduler;
+    // HVF binds a vCPU to the thread which created it, creating them one at a time also keeps their ids apart
+    assert(pthread_mutex_lock(&scheduler->lock) == 0);
+    struct vcpu* vcpu = create_vcpu_for_loaded_object(scheduler->loaded_object, SYMBOL_NAME_PREFIX "interrupt_table", SYMBOL_NAME_PREFIX "run_scheduler");
+    ++scheduler->number_of_created_vcpus;
+    assert(pthread_cond_broadcast(&scheduler->submitted) == 0);
+    assert(pthread_mutex_unlock(&scheduler->lock) == 0);
+    uint64_t stack_pointer = scheduler->stacks_address + (scheduler_vcpu->index + 1) * SCHEDULER_STACK_SIZE;
+#ifdef __x86_64__
+    set_register_of_vcpu(vcpu, 6, stack_pointer);
+#elif __aarch64__
+    set_register_of_vcpu(vcpu, 31, stack_pointer);
+#endif
+    while(1) {
+        uint64_t arguments[2] = { scheduler_vcpu->index, scheduler->time_slice }, number_of_completed_tasks;
+        assert(call_guest_function(vcpu, scheduler->run_scheduler_address, 2, arguments, &number_of_completed_tasks) == VCPU_EXIT_RETURN);
+        // The guest only returns when it found nothing to do, so sleep until there is something new
+        assert(pthread_mutex_lock(&scheduler->lock) == 0);
+        while(!scheduler->is_stopping && is_task_queue_empty(scheduler->submissions))
+            assert(pthread_cond_wait(&scheduler->submitted, &scheduler->lock) == 0);
+        bool is_stopping = scheduler->is_stopping && is_task_queue_empty(scheduler->submissions);
+        assert(pthread_mutex_unlock(&scheduler->lock) == 0);
+        if(is_stopping)
+            break;
+    }
+    destroy_vcpu(vcpu);
+    return NULL;
+}
+
+struct scheduler* create_scheduler_for_loaded_object(struct loaded_object* loaded_object, uint64_t number_of_vcpus) {
+    assert(number_of_vcpus > 0 && number_of_vcpus <= SCHEDULER_MAXIMUM_PROCESSORS);
+    struct scheduler* scheduler = malloc(sizeof(struct scheduler));
+    scheduler->loaded_object = loaded_object;
+    void* ptr;
+    assert(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "task_submissions", sizeof(struct task_queue), &ptr));
+    scheduler->submissions = ptr;
+    assert(resolve_symbol_host_address_in_loaded_object(loaded_object, true, SYMBOL_NAME_PREFIX "task_completions", sizeof(struct task_queue), &ptr));
+    scheduler->completions = ptr;
+    assert(resolve_symbol_virtual_address_in_loaded_object(loaded_object, SYMBOL_NAME_PREFIX "run_scheduler", &scheduler->run_scheduler_address));
+    // Each vCPU enters the guest on its own stack, they all come from one heap chunk
+    struct page_table* page_table = get_page_table_of_loaded_object(loaded_object);
+    scheduler->stacks_address = grow_heap_of_page_table(page_table, number_of_vcpus * SCHEDULER_STACK_SIZE);
+    assert(scheduler->stacks_address != 0);
+    // Without a local timer tasks only switch when they yield
+    scheduler->time_slice = page_table->vm->has_interrupt_controller ? SCHEDULER_TIME_SLICE : 0;
+    scheduler->number_of_vcpus = number_of_vcpus;
+    scheduler->number_of_created_vcpus = 0;
+    scheduler->vcpus = malloc(number_of_vcpus * sizeof(struct scheduler_vcpu));
+    assert(pthread_mutex_init(&scheduler->lock, NULL) == 0);
+    assert(pthread_cond_init(&scheduler->submitted, NULL) == 0);
+    scheduler->is_stopping = false;
+    for(uint64_t index = 0; index < number_of_vcpus; ++index) {
+        scheduler->vcpus[index].scheduler = scheduler;
+        scheduler->vcpus[index].index = index;
+        assert(pthread_create(&scheduler->vcpus[index].thread, NULL, run_scheduler_on_vcpu, &scheduler->vcpus[index]) == 0);
+    }
+    // Afterwards the loaded object is only used by the guest, so the host may modify it
+    assert(pthread_mutex_lock(&scheduler->lock) == 0);
+    while(scheduler->number_of_created_vcpus < number_of_vcpus)
+        assert(pthread_cond_wait(&scheduler->submitted, &scheduler->lock) == 0);
+    assert(pthread_mutex_unlock(&scheduler->lock) == 0);
+    return scheduler;
+}
+
+void destroy_scheduler(struct scheduler* scheduler) {
+    assert(pthread_mutex_lock(&scheduler->lock) == 0);
+    scheduler->is_stopping = true;
+    assert(pthread_cond_broadcast(&scheduler->submitted) == 0);
+    assert(pthread_mutex_unlock(&scheduler->lock) == 0);
+    for(uint64_t index = 0; index < scheduler->number_of_vcpus; ++index)
+        assert(pthread_join(scheduler->vcpus[index].thread, NULL) == 0);
+    assert(pthread_cond_destroy(&scheduler->submitted) == 0);
+    assert(pthread_mutex_destroy(&scheduler->lock) == 0);
+    free(scheduler->vcpus);
+    free(scheduler);
+}
+
+bool submit_task_to_scheduler(struct scheduler* scheduler, uint64_t function_address, uint64_t argument, uint64_t id) {
+    struct task_queue_entry entry = { .function = function_address, .argument = argument, .id = id };
+    if(!push_to_task_queue(scheduler->submissions, &entry))
+        return false;
+    // Taking the lock orders the push before the check of a vCPU which is about to sleep
+    assert(pthread_mutex_lock(&scheduler->lock) == 0);
+    assert(pthread_cond_broadcast(&scheduler->submitted) == 0);
+    assert(pthread_mutex_unlock(&scheduler->lock) == 0);
+    return true;
+}
+
+bool collect_completed_task_of_scheduler(struct scheduler* scheduler, uint64_t* id, uint64_t* result) {
+    struct task_queue_entry entry;
+    if(!pop_from_task_queue(scheduler->completions, &entry))
+        return false;
+    *id = entry.id;
+    *result = entry.argument;
+    return true;
+}
@@ -0,0 +1,103 @@
+#include "platform.h"
+
+struct secondary_vcpu {
+    struct vm* vm;
+    uint64_t target;
+    struct page_table* page_table;
+    uint64_t interrupt_table_pointer, return_address, stack_pointer;
+    uint64_t entry_point, context;
+    bool is_running, is_stopping;
+    pthread_cond_t started;
+    pthread_t thread;
+};
+
+static void* run_secondary_vcpu(void* argument) {
+    struct secondary_vcpu* secondary_vcpu = argument;
+    struct vm* vm = secondary_vcpu->vm;
+    // HVF binds a vCPU to the thread which created it, so it lives as long as this thread
+    struct vcpu* vcpu = create_vcpu(vm, secondary_vcpu->page_table, secondary_vcpu->interrupt_table_pointer);
+    vcpu->return_address = secondary_vcpu->return_address;
+    assert(pthread_mutex_lock(&vm->secondary_vcpus_lock) == 0);
+    while(1) {
+        while(!secondary_vcpu->is_running && !secondary_vcpu->is_stopping)
+            assert(pthread_cond_wait(&secondary_vcpu->started, &vm->secondary_vcpus_lock) == 0);
+        if(!secondary_vcpu->is_running)
+            break;
+        uint64_t entry_point = secondary_vcpu->entry_point, context = secondary_vcpu->context, result;
+        assert(pthread_mutex_unlock(&vm->secondary_vcpus_lock) == 0);
+#ifdef __x86_64__
+        set_register_of_vcpu(vcpu, 6, secondary_vcpu->stack_pointer);
+#elif __aarch64__
+        set_register_of_vcpu(vcpu, 31, secondary_vcpu->stack_pointer);
+#endif
+        uint64_t vcpu_exit = call_guest_function(vcpu, entry_point, 1, &context, &result);
+        if(vcpu_exit != VCPU_EXIT_RETURN)
+            fprintf(stderr, "Secondary vCPU %" PRIu64 " stopped with exit %" PRIu64 "\n", secondary_vcpu->target, vcpu_exit);
+        assert(pthread_mutex_lock(&vm->secondary_vcpus_lock) == 0);
+        secondary_vcpu->is_running = false;
+    }
+    assert(pthread_mutex_unlock(&vm->secondary_vcpus_lock) == 0);
+    destroy_vcpu(vcpu);
+    return NULL;
+}
+
+int64_t start_secondary_vcpu(struct vcpu* vcpu, uint64_t target, uint64_t entry_point, uint64_t context) {
+    struct vm* vm = vcpu->vm;
+    if(target >= NUMBER_OF_STARTABLE_VCPUS)
+        return PSCI_INVALID_PARAMETERS;
+    // Returning from the entry point needs return_to_host
+    if(vcpu->return_address == 0)
+        return PSCI_INTERNAL_FAILURE;
+    int64_t result = PSCI_SUCCESS;
+    assert(pthread_mutex_lock(&vm->secondary_vcpus_lock) == 0);
+    struct secondary_vcpu* secondary_vcpu = vm->secondary_vcpus[target];
+    if(!secondary_vcpu) {
+        // Created on first use, the stack is kept for later starts of the same target
+        uint64_t stack_address = grow_heap_of_page_table(vcpu->page_table, STARTED_VCPU_STACK_SIZE);
+        if(stack_address == 0) {
+            result = PSCI_INTERNAL_FAILURE;
+        } else {
+            secondary_vcpu = malloc(sizeof(struct secondary_vcpu));
+            secondary_vcpu->vm = vm;
+            secondary_vcpu->target = target;
+            secondary_vcpu->page_table = vcpu->page_table;
+            secondary_vcpu->interrupt_table_pointer = vcpu->interrupt_table_pointer;
+            secondary_vcpu->return_address = vcpu->return_address;
+            secondary_vcpu->stack_pointer = stack_address + STARTED_VCPU_STACK_SIZE;
+            secondary_vcpu->is_running = false;
+            secondary_vcpu->is_stopping = false;
+            assert(pthread_cond_init(&secondary_vcpu->started, NULL) == 0);
+            assert(pthread_create(&secondary_vcpu->thread, NULL, run_secondary_vcpu, secondary_vcpu) == 0);
+            vm->secondary_vcpus[target] = secondary_vcpu;
+        }
+    } else if(secondary_vcpu->is_running) {
+        result = PSCI_ALREADY_ON;
+    } else if(secondary_vcpu->page_table != vcpu->page_table) {
+        result = PSCI_INVALID_PARAMETERS;
+    }
+    if(result == PSCI_SUCCESS) {
+        secondary_vcpu->entry_point = entry_point;
+        secondary_vcpu->context = context;
+        secondary_vcpu->is_running = true;
+        assert(pthread_cond_signal(&secondary_vcpu->started) == 0);
+    }
+    assert(pthread_mutex_unlock(&vm->secondary_vcpus_lock) == 0);
+    return result;
+}
+
+void stop_secondary_vcpus_of_vm(struct vm* vm) {
+    // Running ones finish their entry point first
+    for(size_t target = 0; target < NUMBER_OF_STARTABLE_VCPUS; ++target) {
+        struct secondary_vcpu* secondary_vcpu = vm->secondary_vcpus[target];
+        if(!secondary_vcpu)
+            continue;
+        assert(pthread_mutex_lock(&vm->secondary_vcpus_lock) == 0);
+        secondary_vcpu->is_stopping = true;
+        assert(pthread_cond_signal(&secondary_vcpu->started) == 0);
+        assert(pthread_mutex_unlock(&vm->secondary_vcpus_lock) == 0);
+        assert(pthread_join(secondary_vcpu->thread, NULL) == 0);
+        assert(pthread_cond_destroy(&secondary_vcpu->started) == 0);
+        free(secondary_vcpu);
+        vm->secondary_vcpus[target] = NULL;
+    }
+}
@@ -0,0 +1,138 @@
+#include "platform.h"
+
+struct memory_snapshot {
+    struct host_to_guest_mapping mapping;
+    uint32_t slot;
+    uint8_t* copy; // only pages which were resident are populated
+    unsigned char* residency;
+#ifdef __linux__
+    uint64_t* dirty_bitmap;
+#endif
+};
+
+struct vm_snapshot {
+    struct vm* vm;
+    uint64_t number_of_vcpus;
+    struct vcpu** vcpus;
+    struct vcpu_state* vcpu_states;
+    uint64_t number_of_memories;
+    struct memory_snapshot memories[32];
+};
+
+#ifdef __linux__
+static void set_dirty_logging_of_memory(struct vm* vm, struct memory_snapshot* memory, bool enable) {
+    struct kvm_userspace_memory_region memreg;
+    memreg.slot = memory->slot;
+    memreg.flags = enable ? KVM_MEM_LOG_DIRTY_PAGES : 0;
+    memreg.guest_phys_addr = memory->mapping.guest_address;
+    memreg.memory_size = memory->mapping.length;
+    memreg.userspace_addr = (uint64_t)memory->mapping.host_address;
+    vm_ctl(vm, KVM_SET_USER_MEMORY_REGION, (uint64_t)&memreg);
+}
+
+static void get_dirty_log_of_memory(struct vm* vm, struct memory_snapshot* memory) {
+    struct kvm_dirty_log dirty_log = { .slot = memory->slot, .dirty_bitmap = memory->dirty_bitmap };
+    vm_ctl(vm, KVM_GET_DIRTY_LOG, (uint64_t)&dirty_log);
+}
+#endif
+
+static void restore_page_of_memory(struct vm* vm, struct memory_snapshot* memory, uint64_t offset, uint64_t host_page_size) {
+    void* host_address = (void*)((uint64_t)memory->mapping.host_address + offset);
+    if(memory->residency[offset / host_page_size] & 1)
+        memcpy(host_address, &memory->copy[offset], host_page_size);
+    else
+        // Untouched at snapshot time: zero, file content or lazily filled again
+#ifdef __linux__
+        assert(madvise(host_address, host_page_size, MADV_DONTNEED) == 0);
+#elif __APPLE__
+        discard_memory_of_vm(vm, memory->mapping.guest_address + offset, host_page_size);
+#endif
+    (void)vm;
+}
+
+struct vm_snapshot* snapshot_vm(struct vm* vm, uint64_t number_of_vcpus, struct vcpu* vcpus[number_of_vcpus]) {
+    assert(!vm->snapshot);
+    struct vm_snapshot* snapshot = malloc(sizeof(struct vm_snapshot));
+    snapshot->vm = vm;
+    snapshot->number_of_vcpus = number_of_vcpus;
+    snapshot->vcpus = malloc(number_of_vcpus * sizeof(struct vcpu*));
+    snapshot->vcpu_states = malloc(number_of_vcpus * sizeof(struct vcpu_state));
+    for(uint64_t index = 0; index < number_of_vcpus; ++index) {
+        snapshot->vcpus[index] = vcpus[index];
+        save_state_of_vcpu(vcpus[index], &snapshot->vcpu_states[index]);
+    }
+    // Copy what is resident, everything else still has its initial content
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    snapshot->number_of_memories = 0;
+    for(uint32_t slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot) {
+        // Read only slots can not change, and KVM would drop their protection along with the dirty logging flag
+        if(vm->mappings[slot].length == 0 || (vm->read_only_slots & (1U << slot)) != 0)
+            continue;
+        struct memory_snapshot* memory = &snapshot->memories[snapshot->number_of_memories++];
+        memory->mapping = vm->mappings[slot];
+        memory->slot = slot;
+        uint64_t number_of_pages = memory->mapping.length / host_page_size;
+        memory->residency = malloc(number_of_pages);
+        assert(mincore(memory->mapping.host_address, memory->mapping.length, (void*)memory->residency) == 0);
+        memory->copy = mmap(NULL, memory->mapping.length, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+        assert(memory->copy != MAP_FAILED);
+#ifdef __linux__
+        memory->dirty_bitmap = calloc((number_of_pages + 63) / 64, sizeof(uint64_t));
+        set_dirty_logging_of_memory(vm, memory, true);
+        get_dirty_log_of_memory(vm, memory);
+#endif
+        for(uint64_t page = 0; page < number_of_pages; ++page)
+            if(memory->residency[page] & 1)
+                memcpy(&memory->copy[page * host_page_size], (void*)((uint64_t)memory->mapping.host_address + page * host_page_size), host_page_size);
+    }
+    vm->snapshot = snapshot;
+    return snapshot;
+}
+
+void restore_vm(struct vm_snapshot* snapshot) {
+    struct vm* vm = snapshot->vm;
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    for(uint64_t index = 0; index < snapshot->number_of_memories; ++index) {
+        struct memory_snapshot* memory = &snapshot->memories[index];
+        assert(vm->mappings[memory->slot].length == memory->mapping.length && vm->mappings[memory->slot].host_address == memory->mapping.host_address);
+        uint64_t number_of_pages = memory->mapping.length / host_page_size;
+#ifdef __linux__
+        // Only pages the guest wrote to since the snapshot or the last restore are touched
+        get_dirty_log_of_memory(vm, memory);
+        for(uint64_t word = 0; word < (number_of_pages + 63) / 64; ++word)
+            for(uint64_t bits = memory->dirty_bitmap[word]; bits; bits &= bits - 1)
+                restore_page_of_memory(vm, memory, (word * 64 + (uint64_t)__builtin_ctzll(bits)) * host_page_size, host_page_size);
+#elif __APPLE__
+        // HVF has no dirty logging, so every saved page is copied back and pages modified since are discarded
+        unsigned char residency[number_of_pages];
+        assert(mincore(memory->mapping.host_address, memory->mapping.length, (void*)residency) == 0);
+        for(uint64_t page = 0; page < number_of_pages; ++page)
+            if((memory->residency[page] & 1) || (residency[page] & MINCORE_MODIFIED))
+                restore_page_of_memory(vm, memory, page * host_page_size, host_page_size);
+#endif
+    }
+    // Restored tables might translate differently
+    __atomic_add_fetch(&vm->memory_generation, 1, __ATOMIC_RELEASE);
+    for(uint64_t index = 0; index < snapshot->number_of_vcpus; ++index)
+        load_state_of_vcpu(snapshot->vcpus[index], &snapshot->vcpu_states[index]);
+}
+
+void destroy_vm_snapshot(struct vm_snapshot* snapshot) {
+    struct vm* vm = snapshot->vm;
+    for(uint64_t index = 0; index < snapshot->number_of_memories; ++index) {
+        struct memory_snapshot* memory = &snapshot->memories[index];
+#ifdef __linux__
+        if(vm->mappings[memory->slot].length == memory->mapping.length && vm->mappings[memory->slot].host_address == memory->mapping.host_address)
+            set_dirty_logging_of_memory(vm, memory, false);
+        free(memory->dirty_bitmap);
+#endif
+        assert(munmap(memory->copy, memory->mapping.length) == 0);
+        free(memory->residency);
+    }
+    for(uint64_t index = 0; index < snapshot->number_of_vcpus; ++index)
+        release_state_of_vcpu(&snapshot->vcpu_states[index]);
+    free(snapshot->vcpu_states);
+    free(snapshot->vcpus);
+    vm->snapshot = NULL;
+    free(snapshot);
+}
@@ -39,12 +39,22 @@ void wvmcs(struct vcpu* vcpu, uint32_t id, uint64_t v) {
 #endif
 #endif
 
-struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table, uint64_t interrupt_table_pointer) {
+struct vcpu* create_vcpu(struct vm* vm, struct page_table* page_table, uint64_t interrupt_table_pointer) {
     struct vcpu* vcpu = malloc(sizeof(struct vcpu));
     vcpu->vm = vm;
     vcpu->page_table = page_table;
+    vcpu->page_table_generation = page_table->generation;
+    vcpu->exception_frame_address = 0;
+    vcpu->return_address = 0;
+    vcpu->interrupt_table_pointer = interrupt_table_pointer;
+    vcpu->next_running_vcpu = NULL;
+    // Guest started vCPUs are created by threads of their own
+    vcpu->index = __atomic_fetch_add(&vm->number_of_vcpus, 1, __ATOMIC_RELAXED);
+#ifdef __aarch64__
+    vcpu->timer_interrupt_level = false;
+#endif
 #ifdef __linux__
-    vcpu->fd = ioctl(vm->fd, KVM_CREATE_VCPU, 0);
+    vcpu->fd = ioctl(vm->fd, KVM_CREATE_VCPU, vcpu->index);
     assert(vcpu->fd >= 0);
     size_t vcpu_mmap_size = (size_t)ioctl(vm->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
     assert(vcpu_mmap_size > 0);
@@ -56,6 +66,7 @@ struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table
     vcpu_init.features[0] |= 1 << KVM_ARM_VCPU_PSCI_0_2;
     vcpu_ctl(vcpu, KVM_ARM_VCPU_INIT, (uint64_t)&vcpu_init);
     uint64_t mmfr = rreg(vcpu, MSR_ID(ID_AA64MMFR0_EL1));
+    uint64_t mmfr1 = rreg(vcpu, MSR_ID(ID_AA64MMFR1_EL1));
 #endif
 #elif __APPLE__
 #ifdef __x86_64__
@@ -64,13 +75,18 @@ struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table
     wvmcs(vcpu, VMCS_CTRL_CPU_BASED, CPU_BASED_HLT | CPU_BASED_CR8_LOAD | CPU_BASED_CR8_STORE | CPU_BASED_SECONDARY_CTLS);
     wvmcs(vcpu, VMCS_CTRL_CPU_BASED2, 0);
     wvmcs(vcpu, VMCS_CTRL_VMEXIT_CONTROLS, 0);
-    wvmcs(vcpu, VMCS_CTRL_VMENTRY_CONTROLS, VMENTRY_GUEST_IA32E);
+    wvmcs(vcpu, VMCS_CTRL_VMENTRY_CONTROLS, VMENTRY_GUEST_IA32E | VMENTRY_LOAD_IA32_PAT);
     // Enable MSR access
     assert(hv_vcpu_enable_native_msr(vcpu->id, 0xc0000102, 1) == 0); // MSR_KERNELGSBASE
+    assert(hv_vcpu_enable_native_msr(vcpu->id, MSR_STAR, 1) == 0);
+    assert(hv_vcpu_enable_native_msr(vcpu->id, MSR_LSTAR, 1) == 0);
+    assert(hv_vcpu_enable_native_msr(vcpu->id, MSR_SFMASK, 1) == 0);
 #elif __aarch64__
     assert(hv_vcpu_create(&vcpu->id, &vcpu->exit, NULL) == 0);
     uint64_t mmfr;
     assert(hv_vcpu_get_sys_reg(vcpu->id, HV_SYS_REG_ID_AA64MMFR0_EL1, &mmfr) == 0);
+    uint64_t mmfr1;
+    assert(hv_vcpu_get_sys_reg(vcpu->id, HV_SYS_REG_ID_AA64MMFR1_EL1, &mmfr1) == 0);
 #endif
 #endif
 #ifdef __x86_64__
@@ -125,11 +141,21 @@ struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table
     // Configure system registers
     uint64_t cr0 = CR0_PG | CR0_WP | CR0_NE | CR0_PE;
     uint64_t cr4 = CR4_PAE;
-    uint64_t efer = EFER_NXE | EFER_LMA | EFER_LME;
+    uint64_t efer = EFER_NXE | EFER_LMA | EFER_LME | EFER_SCE;
     uint64_t rflags = 1L<<1;
+    if(vcpu->page_table->access.levels == 5)
+        cr4 |= CR4_LA57;
+    else
+        assert(vcpu->page_table->access.levels == 4);
 #ifdef __linux__
+    if(vcpu->page_table->access.levels == 5) {
+        // KVM only accepts CR4.LA57 if the CPUID of the vCPU reports it
+        struct kvm_cpuid2* cpuid = get_supported_cpuid_of_vm(vm);
+        vcpu_ctl(vcpu, KVM_SET_CPUID2, (uint64_t)cpuid);
+        free(cpuid);
+    }
     sregs.cr0 = cr0;
-    sregs.cr3 = vcpu->page_table->guest_address;
+    sregs.cr3 = vcpu->page_table->memory.guest_address;
     sregs.cr4 = cr4;
     sregs.efer = efer;
     vcpu_ctl(vcpu, KVM_SET_SREGS, (uint64_t)&sregs);
@@ -137,27 +163,61 @@ struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table
     vcpu_ctl(vcpu, KVM_GET_REGS, (uint64_t)&regs);
     regs.rflags = rflags;
     vcpu_ctl(vcpu, KVM_SET_REGS, (uint64_t)&regs);
+    struct kvm_msrs* msrs = malloc(sizeof(struct kvm_msrs) + sizeof(struct kvm_msr_entry));
+    msrs->nmsrs = 1;
+    msrs->entries[0].index = MSR_IA32_PAT;
+    msrs->entries[0].data = PAT_MEMORY_TYPES;
+    assert(ioctl(vcpu->fd, KVM_SET_MSRS, msrs) == 1);
+    free(msrs);
+    if(vm->has_interrupt_controller && vcpu->index > 0) {
+        // Application processors would wait for a startup IPI otherwise
+        struct kvm_mp_state mp_state = { .mp_state = KVM_MP_STATE_RUNNABLE };
+        vcpu_ctl(vcpu, KVM_SET_MP_STATE, (uint64_t)&mp_state);
+    }
 #elif __APPLE__
     wvmcs(vcpu, VMCS_GUEST_CR0, cr0);
-    wvmcs(vcpu, VMCS_GUEST_CR3, vcpu->page_table->guest_address);
+    wvmcs(vcpu, VMCS_GUEST_CR3, vcpu->page_table->memory.guest_address);
     wvmcs(vcpu, VMCS_GUEST_CR4, CR4_VMXE | cr4);
     wvmcs(vcpu, VMCS_GUEST_IA32_EFER, efer);
+    wvmcs(vcpu, VMCS_GUEST_IA32_PAT, PAT_MEMORY_TYPES);
     wvmcs(vcpu, VMCS_GUEST_RFLAGS, rflags);
 #endif
 #elif __aarch64__
     assert((mmfr & 0xF) >= 1); // At least 36 bits physical address range
+#if GUEST_PAGE_SHIFT == 12
     assert(((mmfr >> 28) & 0xF) != 0xF); // 4KB granule supported
+    uint64_t translation_granule = 0;
+#elif GUEST_PAGE_SHIFT == 14
+    assert(((mmfr >> 20) & 0xF) != 0); // 16KB granule supported
+    uint64_t translation_granule = 2;
+#elif GUEST_PAGE_SHIFT == 16
+    assert(((mmfr >> 24) & 0xF) != 0xF); // 64KB granule supported
+    uint64_t translation_granule = 1;
+#endif
     uint64_t mair_el1 =
-        (0xFFUL << 0); // PT_MEM: Normal Memory, Inner Write-back non-transient (RW), Outer Write-back non-transient (RW).
+        (0xFFUL << 0) |  // PT_MEM: Normal Memory, Inner Write-back non-transient (RW), Outer Write-back non-transient (RW).
+        (0xBBUL << 8) |  // PT_MEM_WT: Normal Memory, Inner Write-through non-transient (RW), Outer Write-through non-transient (RW).
+        (0x44UL << 16) | // PT_MEM_NC: Normal Memory, Inner Non-cacheable, Outer Non-cacheable.
+        (0x04UL << 24);  // PT_DEVICE: Device-nGnRE memory.
+    // Prefer 16 bit address space identifiers, they are used to flush the TLB
+    vcpu->address_space_id = 0;
+    vcpu->address_space_id_mask = (((mmfr >> 4) & 0xF) == 2) ? 0xFFFF : 0xFF;
+    assert(GUEST_VIRTUAL_ADDRESS_BITS(vcpu->page_table->access.levels) <= 48);
+    // Let the MMU maintain the access flag and, through the dirty bit modifier, the dirty state
+    uint64_t hardware_updates = mmfr1 & 0xF;
+    vm->hardware_page_flags = (hardware_updates >= 1 ? PAGE_ACCESSED : 0) | (hardware_updates >= 2 ? PAGE_DIRTY : 0);
     uint64_t tcr_el1 =
+        ((hardware_updates >= 2) ? (1UL << 40) : 0UL) | // HD=1 dirty state updates
+        ((hardware_updates >= 1) ? (1UL << 39) : 0UL) | // HA=1 access flag updates
+        ((vcpu->address_space_id_mask == 0xFFFF) ? (1UL << 36) : 0UL) | // AS=16 bit ASID
         (9UL << 32) |  // IPS=48 bits (256TB)
         (1UL << 23) |  // EPD1 disable higher half
-        (0UL << 14) |  // TG0=4k
+        (translation_granule << 14) | // TG0=4k, 16k or 64k
         (3UL << 12) |  // SH0=3 inner
         (1UL << 10) |  // ORGN0=1 write back
         (1UL << 8) |   // IRGN0=1 write back
         (0UL << 7) |   // EPD0 enable lower half
-        (16UL << 0);   // T0SZ=16, 4 levels
+        ((64UL - GUEST_VIRTUAL_ADDRESS_BITS(vcpu->page_table->access.levels)) << 0); // T0SZ=16 for 4 levels of 4k pages
     uint64_t sctlr_el1 =
         0xC00800UL |   // set mandatory reserved bits
         (1UL << 0);    // enable MMU
@@ -166,16 +226,16 @@ struct vcpu* create_vcpu(struct vm* vm, struct host_to_guest_mapping* page_table
 #ifdef __linux__
     wreg(vcpu, MSR_ID(MAIR_EL1), mair_el1);
     wreg(vcpu, MSR_ID(TCR_EL1), tcr_el1);
-    wreg(vcpu, MSR_ID(TTBR0_EL1), vcpu->page_table->guest_address);
-    wreg(vcpu, MSR_ID(TTBR1_EL1), vcpu->page_table->guest_address);
+    wreg(vcpu, MSR_ID(TTBR0_EL1), vcpu->page_table->memory.guest_address);
+    wreg(vcpu, MSR_ID(TTBR1_EL1), vcpu->page_table->memory.guest_address);
     wreg(vcpu, MSR_ID(VBAR_EL1), interrupt_table_pointer);
     wreg(vcpu, MSR_ID(SCTLR_EL1), sctlr_el1);
     wreg(vcpu, REG_ID(regs.pstate), pstate);
 #elif __APPLE__
     assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_MAIR_EL1, mair_el1) == 0);
     assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_TCR_EL1, tcr_el1) == 0);
-    assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_TTBR0_EL1, vcpu->page_table->guest_address) == 0);
-    assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_TTBR1_EL1, vcpu->page_table->guest_address) == 0);
+    assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_TTBR0_EL1, vcpu->page_table->memory.guest_address) == 0);
+    assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_TTBR1_EL1, vcpu->page_table->memory.guest_address) == 0);
     assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_VBAR_EL1, interrupt_table_pointer) == 0);
     assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_SCTLR_EL1, sctlr_el1) == 0);
     assert(hv_vcpu_set_reg(vcpu->id, HV_REG_CPSR, pstate) == 0);
@@ -195,10 +255,47 @@ void destroy_vcpu(struct vcpu* vcpu) {
 #endif
 }
 
-struct host_to_guest_mapping* get_page_table_of_vcpu(struct vcpu* vcpu) {
+struct page_table* get_page_table_of_vcpu(struct vcpu* vcpu) {
     return vcpu->page_table;
 }
 
+// Walks the tables directly, the cached translations of the page table might predate changes the guest just made
+static bool resolve_address_of_vcpu(struct vcpu* vcpu, bool write_access, uint64_t virtual_address, uint64_t* physical_address) {
+    return walk_page_table(&vcpu->page_table->access, write_access, virtual_address, physical_address);
+}
+
+void share_host_buffer_with_vcpu(struct vcpu* vcpu, void* host_address, uint64_t length, uint8_t flags, uint64_t* guest_virtual_address) {
+    // Memory slots have to start and end on host page boundaries, the page table maps whole guest pages.
+    // Rounding out instead would expose whatever the host keeps next to the buffer.
+    uint64_t page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    if(page_size < GUEST_PAGE_SIZE)
+        page_size = GUEST_PAGE_SIZE;
+    assert((uint64_t)host_address % page_size == 0 && length > 0 && length % page_size == 0);
+    struct host_to_guest_mapping mapping;
+    mapping.host_address = host_address;
+    mapping.length = length;
+    mapping.guest_address = find_free_guest_address_of_vm(vcpu->vm, mapping.length);
+    map_memory_of_vm(vcpu->vm, &mapping);
+    // Virtual addresses are handed out linearly and never reused, the window spans 64 TiB with 4 levels
+    struct page_table* page_table = vcpu->page_table;
+    uint64_t virtual_address = page_table->next_shared_buffer_address;
+    page_table->next_shared_buffer_address += (mapping.length + GUEST_HUGE_PAGE_SIZE - 1) / GUEST_HUGE_PAGE_SIZE * GUEST_HUGE_PAGE_SIZE;
+    assert(page_table->next_shared_buffer_address <= GUEST_CODE_ALIAS_ADDRESS(page_table->access.levels));
+    map_range_of_page_table(page_table, virtual_address, mapping.guest_address, mapping.length, flags);
+    *guest_virtual_address = virtual_address;
+}
+
+void unshare_host_buffer_with_vcpu(struct vcpu* vcpu, uint64_t guest_virtual_address) {
+    uint64_t physical_address;
+    assert(resolve_address_of_vcpu(vcpu, false, guest_virtual_address, &physical_address));
+    struct host_to_guest_mapping* slot = get_memory_of_vm(vcpu->vm, physical_address);
+    assert(slot);
+    struct host_to_guest_mapping mapping = *slot;
+    // Remove the translations first, vCPUs flush their TLB before they enter the guest again
+    unmap_range_of_page_table(vcpu->page_table, guest_virtual_address - (physical_address - mapping.guest_address), mapping.length);
+    unmap_memory_of_vm(vcpu->vm, &mapping);
+}
+
 #ifdef __x86_64__
 #ifdef __linux__
 static const uint64_t register_mapping[NUMBER_OF_REGISTERS] = {
@@ -311,13 +408,296 @@ void set_register_of_vcpu(struct vcpu* vcpu, uint64_t register_index, uint64_t v
 #endif
 }
 
-void run_vcpu(struct vcpu* vcpu) {
+void flush_tlb_of_vcpu(struct vcpu* vcpu) {
+#ifdef __x86_64__
+#ifdef __linux__
+    // KVM only flushes the guest TLB when CR3 changes, so toggle the write-through bit of the root table
+    struct kvm_sregs sregs;
+    vcpu_ctl(vcpu, KVM_GET_SREGS, (uint64_t)&sregs);
+    sregs.cr3 ^= CR3_PWT;
+    vcpu_ctl(vcpu, KVM_SET_SREGS, (uint64_t)&sregs);
+#elif __APPLE__
+    assert(hv_vcpu_invalidate_tlb(vcpu->id) == 0);
+#endif
+#elif __aarch64__
+    // All leaf entries are non-global, so switching to the next address space identifier hides the stale ones.
+    // After a wrap around stale entries could become visible again, which 16 bit identifiers make unlikely.
+    vcpu->address_space_id = (vcpu->address_space_id + 1) & vcpu->address_space_id_mask;
+    uint64_t ttbr0_el1 = vcpu->page_table->memory.guest_address | (vcpu->address_space_id << 48);
+#ifdef __linux__
+    wreg(vcpu, MSR_ID(TTBR0_EL1), ttbr0_el1);
+#elif __APPLE__
+    assert(hv_vcpu_set_sys_reg(vcpu->id, HV_SYS_REG_TTBR0_EL1, ttbr0_el1) == 0);
+#endif
+#endif
+}
+
+#if defined(__linux__) && defined(__x86_64__)
+// System call entry, swapgs and memory types are not part of the special registers
+static const uint32_t saved_msrs[] = {
+    MSR_STAR, MSR_LSTAR, MSR_SFMASK, MSR_KERNEL_GS_BASE, MSR_IA32_PAT,
+};
+
+static void transfer_msrs_of_vcpu(struct vcpu* vcpu, struct vcpu_state* state, bool load) {
+    const uint32_t number_of_msrs = sizeof(saved_msrs) / sizeof(saved_msrs[0]);
+    struct kvm_msrs* msrs = malloc(sizeof(struct kvm_msrs) + sizeof(state->msrs));
+    msrs->nmsrs = number_of_msrs;
+    for(uint32_t index = 0; index < number_of_msrs; ++index) {
+        msrs->entries[index].index = saved_msrs[index];
+        msrs->entries[index].data = state->msrs[index].data;
+    }
+    assert(ioctl(vcpu->fd, load ? KVM_SET_MSRS : KVM_GET_MSRS, msrs) == (int)number_of_msrs);
+    if(!load)
+        memcpy(state->msrs, msrs->entries, sizeof(state->msrs));
+    free(msrs);
+}
+#endif
+
+#ifdef __APPLE__
+#ifdef __x86_64__
+static const uint32_t saved_vmcs_fields[] = {
+    VMCS_GUEST_RIP, VMCS_GUEST_RSP, VMCS_GUEST_RFLAGS, VMCS_GUEST_CR0, VMCS_GUEST_CR3, VMCS_GUEST_CR4, VMCS_GUEST_IA32_EFER,
+    VMCS_GUEST_GDTR_BASE, VMCS_GUEST_GDTR_LIMIT, VMCS_GUEST_IDTR_BASE, VMCS_GUEST_IDTR_LIMIT, VMCS_GUEST_FS_BASE, VMCS_GUEST_GS_BASE,
+};
+#elif __aarch64__
+static const hv_sys_reg_t saved_system_registers[] = {
+    HV_SYS_REG_SP_EL0, HV_SYS_REG_SP_EL1, HV_SYS_REG_ELR_EL1, HV_SYS_REG_SPSR_EL1, HV_SYS_REG_ESR_EL1, HV_SYS_REG_FAR_EL1,
+    HV_SYS_REG_MAIR_EL1, HV_SYS_REG_TCR_EL1, HV_SYS_REG_TTBR0_EL1, HV_SYS_REG_TTBR1_EL1, HV_SYS_REG_VBAR_EL1, HV_SYS_REG_SCTLR_EL1,
+    HV_SYS_REG_CPACR_EL1, HV_SYS_REG_TPIDR_EL0, HV_SYS_REG_TPIDR_EL1, HV_SYS_REG_TPIDRRO_EL0,
+};
+#endif
+#endif
+
+void save_state_of_vcpu(struct vcpu* vcpu, struct vcpu_state* state) {
+    state->exception_frame_address = vcpu->exception_frame_address;
+#ifdef __linux__
+#ifdef __x86_64__
+    vcpu_ctl(vcpu, KVM_GET_REGS, (uint64_t)&state->regs);
+    vcpu_ctl(vcpu, KVM_GET_SREGS, (uint64_t)&state->sregs);
+    vcpu_ctl(vcpu, KVM_GET_XSAVE, (uint64_t)state->xsave);
+    transfer_msrs_of_vcpu(vcpu, state, false);
+#elif __aarch64__
+    // Core, FP/SIMD and system registers are all enumerated by KVM, each with its own size
+    struct kvm_reg_list register_list_length = { .n = 0 };
+    assert(ioctl(vcpu->fd, KVM_GET_REG_LIST, &register_list_length) < 0);
+    state->register_list = malloc(sizeof(struct kvm_reg_list) + register_list_length.n * sizeof(uint64_t));
+    state->register_list->n = register_list_length.n;
+    vcpu_ctl(vcpu, KVM_GET_REG_LIST, (uint64_t)state->register_list);
+    uint64_t total_size = 0;
+    for(uint64_t index = 0; index < state->register_list->n; ++index)
+        total_size += 1UL << ((state->register_list->reg[index] & KVM_REG_SIZE_MASK) >> KVM_REG_SIZE_SHIFT);
+    state->register_values = malloc(total_size);
+    uint64_t offset = 0;
+    for(uint64_t index = 0; index < state->register_list->n; ++index) {
+        struct kvm_one_reg reg = { .id = state->register_list->reg[index], .addr = (uint64_t)&state->register_values[offset] };
+        vcpu_ctl(vcpu, KVM_GET_ONE_REG, (uint64_t)&reg);
+        offset += 1UL << ((reg.id & KVM_REG_SIZE_MASK) >> KVM_REG_SIZE_SHIFT);
+    }
+#endif
+#elif __APPLE__
+#ifdef __x86_64__
+    for(size_t index = 0; index < 16; ++index)
+        if(index != 6)
+            assert(hv_vcpu_read_register(vcpu->id, register_mapping[index], &state->registers[index]) == 0);
+    for(size_t index = 0; index < sizeof(saved_vmcs_fields) / sizeof(saved_vmcs_fields[0]); ++index)
+        state->vmcs_fields[index] = rvmcs(vcpu, saved_vmcs_fields[index]);
+    assert(hv_vcpu_read_fpstate(vcpu->id, state->fpstate, sizeof(state->fpstate)) == 0);
+#elif __aarch64__
+    for(size_t index = 0; index < sizeof(state->registers) / sizeof(state->registers[0]); ++index)
+        assert(hv_vcpu_get_reg(vcpu->id, (hv_reg_t)index, &state->registers[index]) == 0);
+    for(size_t index = 0; index < sizeof(state->simd_fp_registers) / sizeof(state->simd_fp_registers[0]); ++index)
+        assert(hv_vcpu_get_simd_fp_reg(vcpu->id, (hv_simd_fp_reg_t)(HV_SIMD_FP_REG_Q0 + index), &state->simd_fp_registers[index]) == 0);
+    for(size_t index = 0; index < sizeof(saved_system_registers) / sizeof(saved_system_registers[0]); ++index)
+        assert(hv_vcpu_get_sys_reg(vcpu->id, saved_system_registers[index], &state->system_registers[index]) == 0);
+#endif
+#endif
+}
+
+void load_state_of_vcpu(struct vcpu* vcpu, struct vcpu_state* state) {
+    vcpu->exception_frame_address = state->exception_frame_address;
+#ifdef __linux__
+#ifdef __x86_64__
+    vcpu_ctl(vcpu, KVM_SET_SREGS, (uint64_t)&state->sregs);
+    vcpu_ctl(vcpu, KVM_SET_REGS, (uint64_t)&state->regs);
+    vcpu_ctl(vcpu, KVM_SET_XSAVE, (uint64_t)state->xsave);
+    transfer_msrs_of_vcpu(vcpu, state, true);
+#elif __aarch64__
+    uint64_t offset = 0;
+    for(uint64_t index = 0; index < state->register_list->n; ++index) {
+        struct kvm_one_reg reg = { .id = state->register_list->reg[index], .addr = (uint64_t)&state->register_values[offset] };
+        offset += 1UL << ((reg.id & KVM_REG_SIZE_MASK) >> KVM_REG_SIZE_SHIFT);
+        // Writing the counter would move the guest clock away from its calibration
+        if(reg.id != KVM_REG_ARM_TIMER_CNT)
+            vcpu_ctl(vcpu, KVM_SET_ONE_REG, (uint64_t)&reg);
+    }
+#endif
+#elif __APPLE__
+#ifdef __x86_64__
+    for(size_t index = 0; index < 16; ++index)
+        if(index != 6)
+            assert(hv_vcpu_write_register(vcpu->id, register_mapping[index], state->registers[index]) == 0);
+    for(size_t index = 0; index < sizeof(saved_vmcs_fields) / sizeof(saved_vmcs_fields[0]); ++index)
+        wvmcs(vcpu, saved_vmcs_fields[index], state->vmcs_fields[index]);
+    assert(hv_vcpu_write_fpstate(vcpu->id, state->fpstate, sizeof(state->fpstate)) == 0);
+#elif __aarch64__
+    for(size_t index = 0; index < sizeof(state->registers) / sizeof(state->registers[0]); ++index)
+        assert(hv_vcpu_set_reg(vcpu->id, (hv_reg_t)index, state->registers[index]) == 0);
+    for(size_t index = 0; index < sizeof(state->simd_fp_registers) / sizeof(state->simd_fp_registers[0]); ++index)
+        assert(hv_vcpu_set_simd_fp_reg(vcpu->id, (hv_simd_fp_reg_t)(HV_SIMD_FP_REG_Q0 + index), state->simd_fp_registers[index]) == 0);
+    for(size_t index = 0; index < sizeof(saved_system_registers) / sizeof(saved_system_registers[0]); ++index)
+        assert(hv_vcpu_set_sys_reg(vcpu->id, saved_system_registers[index], state->system_registers[index]) == 0);
+#endif
+#endif
+    // The page tables in guest memory may have been reverted as well
+    vcpu->page_table_generation = __atomic_load_n(&vcpu->page_table->generation, __ATOMIC_ACQUIRE);
+    flush_tlb_of_vcpu(vcpu);
+}
+
+void release_state_of_vcpu(struct vcpu_state* state) {
+#if defined(__linux__) && defined(__aarch64__)
+    free(state->register_list);
+    free(state->register_values);
+#else
+    (void)state;
+#endif
+}
+
+bool handle_hypercall(struct vcpu* vcpu, uint64_t* vcpu_exit) {
+    static const uint64_t registers[] = HYPERCALL_REGISTERS;
+    uint64_t number = get_register_of_vcpu(vcpu, registers[0]);
+#ifdef __aarch64__
+    number = (number == PSCI_CPU_ON) ? HYPERCALL_START_VCPU : number & (NUMBER_OF_HYPERCALLS - 1);
+#else
+    number &= NUMBER_OF_HYPERCALLS - 1;
+#endif
+    uint64_t arguments[3];
+    for(size_t i = 0; i < sizeof(arguments) / sizeof(arguments[0]); ++i)
+        arguments[i] = get_register_of_vcpu(vcpu, registers[i + 1]);
+    switch(number) {
+        case HYPERCALL_EXCEPTION:
+            printf("EXCEPTION\n");
+            vcpu->exception_frame_address = arguments[0];
+            *vcpu_exit = VCPU_EXIT_EXCEPTION;
+            return true;
+        case HYPERCALL_GROW_HEAP:
+            set_register_of_vcpu(vcpu, registers[0], grow_heap_of_page_table(vcpu->page_table, arguments[0]));
+            return false;
+        case HYPERCALL_RETURN:
+            vcpu->return_value = arguments[0];
+            *vcpu_exit = VCPU_EXIT_RETURN;
+            return true;
+        case HYPERCALL_SYSTEM_CALL:
+            vcpu->system_call_number = arguments[0];
+            vcpu->system_call_arguments_address = arguments[1];
+            *vcpu_exit = VCPU_EXIT_SYSTEM_CALL;
+            return true;
+        case HYPERCALL_DISCARD:
+            discard_range_of_page_table(vcpu->page_table, arguments[0], arguments[1]);
+            set_register_of_vcpu(vcpu, registers[0], 0);
+            return false;
+        case HYPERCALL_START_VCPU:
+            set_register_of_vcpu(vcpu, registers[0], (uint64_t)start_secondary_vcpu(vcpu, arguments[0], arguments[1], arguments[2]));
+            return false;
+        default:
+            fprintf(stderr, "Unexpected hypercall %" PRIu64 "\n", number);
+            *vcpu_exit = VCPU_EXIT_UNKNOWN;
+            return true;
+    }
+}
+
+#ifdef __aarch64__
+static void update_timer_interrupt_of_vcpu(struct vcpu* vcpu) {
+#ifdef __linux__
+    // Without an in-kernel GIC KVM reports the level of the virtual timer, which becomes the IRQ line of the vCPU
+    bool level = (vcpu->kvm_run->s.regs.device_irq_level & KVM_ARM_DEV_EL1_VTIMER) != 0;
+    if(level == vcpu->timer_interrupt_level)
+        return;
+    vcpu->timer_interrupt_level = level;
+    struct kvm_irq_level irq_level = {
+        .irq = (KVM_ARM_IRQ_TYPE_CPU << KVM_ARM_IRQ_TYPE_SHIFT) | ((uint32_t)vcpu->index << KVM_ARM_IRQ_VCPU_SHIFT) | KVM_ARM_IRQ_CPU_IRQ,
+        .level = level,
+    };
+    vm_ctl(vcpu->vm, KVM_IRQ_LINE, (uint64_t)&irq_level);
+#elif __APPLE__
+    // The line stays raised until the guest disables, masks or reprograms the timer
+    uint64_t control;
+    assert(hv_vcpu_get_sys_reg(vcpu->id, HV_SYS_REG_CNTV_CTL_EL0, &control) == 0);
+    vcpu->timer_interrupt_level = (control & 7) == 5; // enabled, not masked and expired
+    if(!vcpu->timer_interrupt_level)
+        assert(hv_vcpu_set_vtimer_mask(vcpu->id, false) == 0);
+    assert(hv_vcpu_set_pending_interrupt(vcpu->id, HV_INTERRUPT_TYPE_IRQ, vcpu->timer_interrupt_level) == 0);
+#endif
+}
+#endif
+
+void kick_vcpu(struct vcpu* vcpu) {
+#ifdef __linux__
+    // Even if the signal arrives before KVM_RUN is entered, it returns right away
+    vcpu->kvm_run->immediate_exit = 1;
+    assert(pthread_kill(vcpu->thread, VCPU_KICK_SIGNAL) == 0);
+#elif __APPLE__
+#ifdef __x86_64__
+    assert(hv_vcpu_interrupt(&vcpu->id, 1) == 0);
+#elif __aarch64__
+    assert(hv_vcpus_exit(&vcpu->id, 1) == 0);
+#endif
+#endif
+}
+
+// Waits while the VM is paused, then registers the vCPU so that pause_vm can kick it out
+static void enter_guest_of_vcpu(struct vcpu* vcpu) {
+    struct vm* vm = vcpu->vm;
+    assert(pthread_mutex_lock(&vm->pause_lock) == 0);
+    while(vm->number_of_pauses > 0)
+        assert(pthread_cond_wait(&vm->pause_changed, &vm->pause_lock) == 0);
+    vcpu->thread = pthread_self();
+    vcpu->next_running_vcpu = vm->running_vcpus;
+    vm->running_vcpus = vcpu;
+    // Under the lock, so that shoot_down_tlbs_of_page_table sees which generation the vCPU runs on
+    uint64_t page_table_generation = __atomic_load_n(&vcpu->page_table->generation, __ATOMIC_ACQUIRE);
+    if(vcpu->page_table_generation != page_table_generation) {
+        vcpu->page_table_generation = page_table_generation;
+        flush_tlb_of_vcpu(vcpu);
+    }
+    assert(pthread_mutex_unlock(&vm->pause_lock) == 0);
+}
+
+static void leave_guest_of_vcpu(struct vcpu* vcpu) {
+    struct vm* vm = vcpu->vm;
+    assert(pthread_mutex_lock(&vm->pause_lock) == 0);
+    struct vcpu** link = &vm->running_vcpus;
+    while(*link != vcpu)
+        link = &(*link)->next_running_vcpu;
+    *link = vcpu->next_running_vcpu;
+    // The guest might have changed its own tables, so the host does not trust its cached translations anymore
+    __atomic_add_fetch(&vcpu->page_table->translation_epoch, 1, __ATOMIC_RELEASE);
+#ifdef __linux__
+    vcpu->kvm_run->immediate_exit = 0;
+#endif
+    if((vm->number_of_pauses > 0 && !vm->running_vcpus) || vm->number_of_tlb_shootdowns > 0)
+        assert(pthread_cond_broadcast(&vm->pause_changed) == 0);
+    assert(pthread_mutex_unlock(&vm->pause_lock) == 0);
+}
+
+uint64_t run_vcpu(struct vcpu* vcpu) {
+    uint64_t vcpu_exit = VCPU_EXIT_UNKNOWN;
+    vcpu->exception_frame_address = 0;
     int stop = 0;
     while(!stop) {
+        // Exits are handled before leaving, so a paused VM has no hypercall in flight either
+        enter_guest_of_vcpu(vcpu);
 #ifdef __linux__
-        vcpu_ctl(vcpu, KVM_RUN, 0);
+        // Signals and, without an in-kernel GIC, changes of the timer line interrupt KVM_RUN
+        if(ioctl(vcpu->fd, KVM_RUN, 0) < 0) {
+            assert(errno == EINTR);
+            vcpu->kvm_run->exit_reason = KVM_EXIT_INTR;
+        }
         uint32_t exit_reason = vcpu->kvm_run->exit_reason;
 #elif __APPLE__
+#ifdef __aarch64__
+        if(vcpu->timer_interrupt_level)
+            update_timer_interrupt_of_vcpu(vcpu);
+#endif
         assert(hv_vcpu_run(vcpu->id) == 0);
 #ifdef __x86_64__
         uint32_t exit_reason = (uint32_t)rvmcs(vcpu, VMCS_RO_EXIT_REASON);
@@ -327,16 +707,34 @@ void run_vcpu(struct vcpu* vcpu) {
 #endif
         switch(exit_reason) {
 #ifdef __linux__
+            case KVM_EXIT_INTR:
+#ifdef __aarch64__
+                update_timer_interrupt_of_vcpu(vcpu);
+#endif
+                break;
 #ifdef __x86_64__
             case KVM_EXIT_HLT:
                 printf("HLT\n");
+                vcpu_exit = VCPU_EXIT_HALT;
                 stop = 1;
                 break;
+            case KVM_EXIT_IO:
+                if(vcpu->kvm_run->io.direction == KVM_EXIT_IO_OUT && vcpu->kvm_run->io.port == HYPERCALL_PORT)
+                    stop = handle_hypercall(vcpu, &vcpu_exit);
+                else {
+                    fprintf(stderr, "Unexpected I/O port %u\n", vcpu->kvm_run->io.port);
+                    stop = 1;
+                }
+                break;
 #elif __aarch64__
+            case KVM_EXIT_HYPERCALL:
+                stop = handle_hypercall(vcpu, &vcpu_exit);
+                break;
             case KVM_EXIT_SYSTEM_EVENT:
                 switch(vcpu->kvm_run->system_event.type) {
                     case KVM_SYSTEM_EVENT_SHUTDOWN:
                         printf("EVENT_SHUTDOWN\n");
+                        vcpu_exit = VCPU_EXIT_HALT;
                         break;
                     case KVM_SYSTEM_EVENT_RESET:
                         printf("EVENT_RESET\n");
@@ -355,8 +753,18 @@ void run_vcpu(struct vcpu* vcpu) {
 #ifdef __x86_64__
             case VMX_REASON_HLT:
                 printf("HLT\n");
+                vcpu_exit = VCPU_EXIT_HALT;
                 stop = 1;
                 break;
+            case VMX_REASON_IO:
+                if(((rvmcs(vcpu, VMCS_RO_EXIT_QUALIFIC) >> 16) & 0xFFFF) == HYPERCALL_PORT) {
+                    wvmcs(vcpu, VMCS_GUEST_RIP, rvmcs(vcpu, VMCS_GUEST_RIP) + rvmcs(vcpu, VMCS_RO_VMEXIT_INSTR_LEN));
+                    stop = handle_hypercall(vcpu, &vcpu_exit);
+                } else {
+                    fprintf(stderr, "Unexpected I/O port\n");
+                    stop = 1;
+                }
+                break;
             case VMX_REASON_IRQ:
                 printf("IRQ\n");
                 break;
@@ -365,15 +773,20 @@ void run_vcpu(struct vcpu* vcpu) {
                 break;
 #elif __aarch64__
             case HV_EXIT_REASON_CANCELED:
-                printf("CANCELED\n");
-                stop = 1;
+                // Kicked by pause_vm
                 break;
             case HV_EXIT_REASON_EXCEPTION:
+                if((vcpu->exit->exception.syndrome >> 26) == 0x16 && ((get_register_of_vcpu(vcpu, 0) & ~(NUMBER_OF_HYPERCALLS - 1)) == HYPERCALL_FUNCTION_ID || get_register_of_vcpu(vcpu, 0) == PSCI_CPU_ON)) {
+                    stop = handle_hypercall(vcpu, &vcpu_exit);
+                    break;
+                }
                 printf("EXCEPTION\n");
+                vcpu_exit = VCPU_EXIT_HALT;
                 stop = 1;
                 break;
             case HV_EXIT_REASON_VTIMER_ACTIVATED:
-                printf("VTIMER_ACTIVATED\n");
+                // HVF masks the virtual timer until it is unmasked again
+                vcpu->timer_interrupt_level = true;
                 break;
             case HV_EXIT_REASON_UNKNOWN:
                 printf("UNKNOWN\n");
@@ -386,5 +799,77 @@ void run_vcpu(struct vcpu* vcpu) {
                 stop = 1;
                 break;
         }
+        leave_guest_of_vcpu(vcpu);
     }
+    return vcpu_exit;
+}
+
+uint64_t call_guest_function(struct vcpu* vcpu, uint64_t function_address, uint64_t number_of_arguments, const uint64_t arguments[number_of_arguments], uint64_t* return_value) {
+    static const uint64_t argument_registers[] = ARGUMENT_REGISTERS;
+    assert(vcpu->return_address != 0 && number_of_arguments <= sizeof(argument_registers) / sizeof(argument_registers[0]));
+#ifdef __x86_64__
+#ifdef __linux__
+    // Batch all register writes into a single KVM_SET_REGS
+    uint64_t regs[sizeof(struct kvm_regs) / sizeof(uint64_t)];
+    vcpu_ctl(vcpu, KVM_GET_REGS, (uint64_t)&regs);
+    for(uint64_t index = 0; index < number_of_arguments; ++index)
+        regs[register_mapping[argument_registers[index]]] = arguments[index];
+    uint64_t stack_pointer = regs[register_mapping[6]];
+#elif __APPLE__
+    for(uint64_t index = 0; index < number_of_arguments; ++index)
+        set_register_of_vcpu(vcpu, argument_registers[index], arguments[index]);
+    uint64_t stack_pointer = get_register_of_vcpu(vcpu, 6);
+#endif
+    // Push the return address such that the stack is 16 byte aligned before the call
+    stack_pointer = (stack_pointer & ~15UL) - sizeof(uint64_t);
+    uint64_t physical_address;
+    void* host_address;
+    assert(resolve_address_of_vcpu(vcpu, true, stack_pointer, &physical_address) &&
+           resolve_address_of_vm(vcpu->vm, physical_address, &host_address, sizeof(uint64_t)));
+    *(uint64_t*)host_address = vcpu->return_address;
+#ifdef __linux__
+    regs[register_mapping[6]] = stack_pointer;
+    regs[register_mapping[16]] = function_address;
+    regs[register_mapping[17]] = 1UL << 1;
+    vcpu_ctl(vcpu, KVM_SET_REGS, (uint64_t)&regs);
+#elif __APPLE__
+    set_register_of_vcpu(vcpu, 6, stack_pointer);
+    set_register_of_vcpu(vcpu, 16, function_address);
+    set_register_of_vcpu(vcpu, 17, 1UL << 1);
+#endif
+#elif __aarch64__
+    for(uint64_t index = 0; index < number_of_arguments; ++index)
+        set_register_of_vcpu(vcpu, argument_registers[index], arguments[index]);
+    set_register_of_vcpu(vcpu, 31, get_register_of_vcpu(vcpu, 31) & ~15UL);
+    set_register_of_vcpu(vcpu, 30, vcpu->return_address);
+    set_register_of_vcpu(vcpu, 32, function_address);
+#endif
+    uint64_t vcpu_exit = run_vcpu(vcpu);
+    if(vcpu_exit == VCPU_EXIT_RETURN)
+        *return_value = vcpu->return_value;
+    return vcpu_exit;
+}
+
+uint64_t get_system_call_of_vcpu(struct vcpu* vcpu, uint64_t arguments[6]) {
+    uint64_t physical_address;
+    void* host_address;
+    assert(resolve_address_of_vcpu(vcpu, false, vcpu->system_call_arguments_address, &physical_address) &&
+           resolve_address_of_vm(vcpu->vm, physical_address, &host_address, 6 * sizeof(uint64_t)));
+    memcpy(arguments, host_address, 6 * sizeof(uint64_t));
+    return vcpu->system_call_number;
+}
+
+void set_system_call_result_of_vcpu(struct vcpu* vcpu, uint64_t result) {
+    static const uint64_t registers[] = HYPERCALL_REGISTERS;
+    set_register_of_vcpu(vcpu, registers[0], result);
+}
+
+struct interrupt_frame* get_exception_frame_of_vcpu(struct vcpu* vcpu) {
+    uint64_t physical_address;
+    void* host_address;
+    if(vcpu->exception_frame_address == 0 ||
+       !resolve_address_of_vcpu(vcpu, true, vcpu->exception_frame_address, &physical_address) ||
+       !resolve_address_of_vm(vcpu->vm, physical_address, &host_address, sizeof(struct interrupt_frame)))
+        return NULL;
+    return (struct interrupt_frame*)host_address;
 }
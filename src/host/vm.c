@@ -1,27 +1,81 @@
+#include <time.h>
 #include "platform.h"
 
 #ifdef __linux__
 void vm_ctl(struct vm* vm, uint32_t request, uint64_t param) {
     assert(ioctl(vm->fd, request, param) >= 0);
 }
+
+static void handle_kick_signal(int signal) {
+    (void)signal;
+}
 #endif
 
 struct vm* create_vm() {
     struct vm* vm = malloc(sizeof(struct vm));
     for(size_t slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot)
         vm->mappings[slot].length = 0;
+    memset(&vm->clock, 0, sizeof(vm->clock));
+    vm->snapshot = NULL;
+    vm->number_of_vcpus = 0;
+    vm->has_interrupt_controller = false;
+    vm->page_table_levels = GUEST_PAGE_TABLE_DEFAULT_LEVELS;
+    vm->page_table_subtrees = NULL;
+    vm->read_only_slots = 0;
+#ifdef __x86_64__
+    vm->hardware_page_flags = PAGE_ACCESSED | PAGE_DIRTY;
+#elif __aarch64__
+    // Known once the first vCPU reports what its MMU supports
+    vm->hardware_page_flags = 0;
+#endif
+    vm->memory_generation = 0;
+    assert(pthread_mutex_init(&vm->secondary_vcpus_lock, NULL) == 0);
+    for(size_t index = 0; index < NUMBER_OF_STARTABLE_VCPUS; ++index)
+        vm->secondary_vcpus[index] = NULL;
+    assert(pthread_mutex_init(&vm->pause_lock, NULL) == 0);
+    assert(pthread_cond_init(&vm->pause_changed, NULL) == 0);
+    vm->number_of_pauses = 0;
+    vm->number_of_tlb_shootdowns = 0;
+    vm->running_vcpus = NULL;
 #ifdef __linux__
+    // Only interrupts KVM_RUN, which is why it must not restart
+    struct sigaction kick_action;
+    memset(&kick_action, 0, sizeof(kick_action));
+    kick_action.sa_handler = handle_kick_signal;
+    sigemptyset(&kick_action.sa_mask);
+    assert(sigaction(VCPU_KICK_SIGNAL, &kick_action, NULL) == 0);
     vm->kvm_fd = open("/dev/kvm", O_RDWR);
     assert(vm->kvm_fd >= 0);
     int api_ver = ioctl(vm->kvm_fd, KVM_GET_API_VERSION, 0);
     assert(api_ver == KVM_API_VERSION);
     vm->fd = ioctl(vm->kvm_fd, KVM_CREATE_VM, 0);
     assert(vm->fd >= 0);
+    vm->userfault_fd = -1;
+    assert(pthread_mutex_init(&vm->lazy_memory_lock, NULL) == 0);
+    for(size_t index = 0; index < sizeof(vm->lazy_memories) / sizeof(vm->lazy_memories[0]); ++index)
+        vm->lazy_memories[index].length = 0;
     vm_ctl(vm, KVM_CHECK_EXTENSION, KVM_CAP_IMMEDIATE_EXIT);
     vm_ctl(vm, KVM_CHECK_EXTENSION, KVM_CAP_USER_MEMORY);
 #ifdef __aarch64__
     vm_ctl(vm, KVM_CHECK_EXTENSION, KVM_CAP_ONE_REG);
     vm_ctl(vm, KVM_CHECK_EXTENSION, KVM_CAP_ARM_PSCI_0_2);
+    vm_ctl(vm, KVM_CHECK_EXTENSION, KVM_CAP_ARM_SMCCC_FILTER);
+    // Forward the hypercall function range to user space
+    struct kvm_smccc_filter smccc_filter = {
+        .base = HYPERCALL_FUNCTION_ID,
+        .nr_functions = NUMBER_OF_HYPERCALLS,
+        .action = KVM_SMCCC_FILTER_FWD_TO_USER,
+    };
+    struct kvm_device_attr smccc_filter_attribute = {
+        .group = KVM_ARM_VM_SMCCC_CTRL,
+        .attr = KVM_ARM_VM_SMCCC_FILTER,
+        .addr = (uint64_t)&smccc_filter,
+    };
+    vm_ctl(vm, KVM_SET_DEVICE_ATTR, (uint64_t)&smccc_filter_attribute);
+    // and PSCI CPU_ON, as KVM only powers on vCPUs which exist already
+    smccc_filter.base = PSCI_CPU_ON;
+    smccc_filter.nr_functions = 1;
+    vm_ctl(vm, KVM_SET_DEVICE_ATTR, (uint64_t)&smccc_filter_attribute);
 #endif
 #elif __APPLE__
 #ifdef __x86_64__
@@ -33,8 +87,89 @@ struct vm* create_vm() {
     return vm;
 }
 
+void create_interrupt_controller_of_vm(struct vm* vm) {
+    assert(vm->number_of_vcpus == 0 && !vm->has_interrupt_controller);
+#ifdef __linux__
+#ifdef __x86_64__
+    // Every vCPU gets a local APIC at the default address
+    vm_ctl(vm, KVM_CREATE_IRQCHIP, 0);
+#elif __aarch64__
+    // Without an in-kernel GIC the timer line is reported in kvm_run and injected from user space
+    assert(ioctl(vm->fd, KVM_CHECK_EXTENSION, KVM_CAP_ARM_USER_IRQ) > 0);
+#endif
+#elif __APPLE__
+#ifdef __x86_64__
+    assert(false); // HVF has no local APIC emulation
+#endif
+#endif
+    vm->has_interrupt_controller = true;
+}
+
+#if defined(__linux__) && defined(__x86_64__)
+struct kvm_cpuid2* get_supported_cpuid_of_vm(struct vm* vm) {
+    // KVM reports E2BIG until the buffer is large enough
+    for(uint32_t number_of_entries = 64; ; number_of_entries *= 2) {
+        struct kvm_cpuid2* cpuid = malloc(sizeof(struct kvm_cpuid2) + number_of_entries * sizeof(struct kvm_cpuid_entry2));
+        cpuid->nent = number_of_entries;
+        if(ioctl(vm->kvm_fd, KVM_GET_SUPPORTED_CPUID, cpuid) >= 0)
+            return cpuid;
+        assert(errno == E2BIG);
+        free(cpuid);
+    }
+}
+
+// Some hypervisors report LA57 but reject it in CR4, so try it on a vCPU of a scratch VM
+static bool probe_five_level_paging(struct vm* vm, struct kvm_cpuid2* cpuid) {
+    int scratch_vm_fd = ioctl(vm->kvm_fd, KVM_CREATE_VM, 0);
+    assert(scratch_vm_fd >= 0);
+    int scratch_vcpu_fd = ioctl(scratch_vm_fd, KVM_CREATE_VCPU, 0);
+    assert(scratch_vcpu_fd >= 0);
+    struct kvm_sregs sregs;
+    bool is_supported = ioctl(scratch_vcpu_fd, KVM_SET_CPUID2, cpuid) >= 0 && ioctl(scratch_vcpu_fd, KVM_GET_SREGS, &sregs) >= 0;
+    if(is_supported) {
+        sregs.cr0 = CR0_PG | CR0_PE;
+        sregs.cr4 = CR4_LA57 | CR4_PAE;
+        sregs.efer = EFER_LMA | EFER_LME;
+        is_supported = ioctl(scratch_vcpu_fd, KVM_SET_SREGS, &sregs) >= 0;
+    }
+    assert(close(scratch_vcpu_fd) == 0 && close(scratch_vm_fd) == 0);
+    return is_supported;
+}
+#endif
+
+bool set_page_table_levels_of_vm(struct vm* vm, size_t levels) {
+    bool is_supported = levels == GUEST_PAGE_TABLE_DEFAULT_LEVELS;
+#ifdef __x86_64__
+    // Long mode walks at least 4 levels, 5 levels need LA57
+#ifdef __linux__
+    if(levels == 5) {
+        struct kvm_cpuid2* cpuid = get_supported_cpuid_of_vm(vm);
+        for(uint32_t index = 0; index < cpuid->nent; ++index)
+            if(cpuid->entries[index].function == 7 && cpuid->entries[index].index == 0)
+                is_supported = (cpuid->entries[index].ecx & CPUID_7_ECX_LA57) != 0;
+        is_supported = is_supported && probe_five_level_paging(vm, cpuid);
+        free(cpuid);
+    }
+#endif
+#elif __aarch64__
+    // Beyond 48 bits (5 levels of 4 KiB pages) FEAT_LPA2 would be needed, which changes the format of the entries
+    is_supported = levels >= GUEST_PAGE_TABLE_MINIMUM_LEVELS && levels <= GUEST_PAGE_TABLE_MAXIMUM_LEVELS && GUEST_VIRTUAL_ADDRESS_BITS(levels) <= 48;
+#endif
+    if(is_supported)
+        vm->page_table_levels = levels;
+    return is_supported;
+}
+
 void destroy_vm(struct vm* vm) {
+    assert(!vm->page_table_subtrees);
+    stop_secondary_vcpus_of_vm(vm);
+    assert(pthread_mutex_destroy(&vm->secondary_vcpus_lock) == 0);
+    assert(!vm->running_vcpus);
+    assert(pthread_cond_destroy(&vm->pause_changed) == 0);
+    assert(pthread_mutex_destroy(&vm->pause_lock) == 0);
 #ifdef __linux__
+    stop_lazy_memory_of_vm(vm);
+    assert(pthread_mutex_destroy(&vm->lazy_memory_lock) == 0);
     assert(close(vm->fd) >= 0);
     assert(close(vm->kvm_fd) >= 0);
 #elif __APPLE__
@@ -43,18 +178,74 @@ void destroy_vm(struct vm* vm) {
 #endif
 }
 
-void map_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
+// HVF might drop a kick which arrives right before the vCPU enters the guest, so kicks are repeated after a while
+static void wait_for_kicked_vcpus(struct vm* vm) {
+    struct timespec deadline;
+    assert(clock_gettime(CLOCK_REALTIME, &deadline) == 0);
+    deadline.tv_nsec += 1000000;
+    if(deadline.tv_nsec >= 1000000000) {
+        deadline.tv_nsec -= 1000000000;
+        ++deadline.tv_sec;
+    }
+    int error = pthread_cond_timedwait(&vm->pause_changed, &vm->pause_lock, &deadline);
+    assert(error == 0 || error == ETIMEDOUT);
+}
+
+void pause_vm(struct vm* vm) {
+    assert(pthread_mutex_lock(&vm->pause_lock) == 0);
+    ++vm->number_of_pauses;
+    while(vm->running_vcpus) {
+        for(struct vcpu* vcpu = vm->running_vcpus; vcpu; vcpu = vcpu->next_running_vcpu)
+            kick_vcpu(vcpu);
+        wait_for_kicked_vcpus(vm);
+    }
+    assert(pthread_mutex_unlock(&vm->pause_lock) == 0);
+}
+
+// Unlike pause_vm it can be called while handling a hypercall, the calling vCPU flushes before it enters the guest again anyway
+void shoot_down_tlbs_of_page_table(struct page_table* page_table) {
+    struct vm* vm = page_table->vm;
+    uint64_t generation = __atomic_load_n(&page_table->generation, __ATOMIC_ACQUIRE);
+    assert(pthread_mutex_lock(&vm->pause_lock) == 0);
+    ++vm->number_of_tlb_shootdowns;
+    while(1) {
+        bool is_stale = false;
+        for(struct vcpu* vcpu = vm->running_vcpus; vcpu; vcpu = vcpu->next_running_vcpu)
+            if(vcpu->page_table == page_table && vcpu->page_table_generation < generation && !pthread_equal(vcpu->thread, pthread_self())) {
+                kick_vcpu(vcpu);
+                is_stale = true;
+            }
+        if(!is_stale)
+            break;
+        wait_for_kicked_vcpus(vm);
+    }
+    --vm->number_of_tlb_shootdowns;
+    assert(pthread_mutex_unlock(&vm->pause_lock) == 0);
+}
+
+void resume_vm(struct vm* vm) {
+    assert(pthread_mutex_lock(&vm->pause_lock) == 0);
+    assert(vm->number_of_pauses > 0);
+    if(--vm->number_of_pauses == 0)
+        assert(pthread_cond_broadcast(&vm->pause_changed) == 0);
+    assert(pthread_mutex_unlock(&vm->pause_lock) == 0);
+}
+
+static void map_memory_of_vm_with_access(struct vm* vm, struct host_to_guest_mapping* mapping, bool read_only) {
     size_t slot;
     for(slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot)
         if(vm->mappings[slot].length == 0)
             break;
+    assert(slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]));
     vm->mappings[slot].guest_address = mapping->guest_address;
     vm->mappings[slot].host_address = mapping->host_address;
     vm->mappings[slot].length = mapping->length;
+    vm->read_only_slots = read_only ? (vm->read_only_slots | (1U << slot)) : (vm->read_only_slots & ~(1U << slot));
+    __atomic_add_fetch(&vm->memory_generation, 1, __ATOMIC_RELEASE);
 #ifdef __linux__
     struct kvm_userspace_memory_region memreg;
     memreg.slot = (uint32_t)slot;
-    memreg.flags = 0;
+    memreg.flags = read_only ? KVM_MEM_READONLY : 0;
     memreg.guest_phys_addr = mapping->guest_address;
     memreg.memory_size = mapping->length;
     memreg.userspace_addr = (uint64_t)mapping->host_address;
@@ -64,17 +255,28 @@ void map_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
         mapping->host_address,
         mapping->guest_address,
         mapping->length,
-        HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC) == 0);
+        read_only ? (HV_MEMORY_READ | HV_MEMORY_EXEC) : (HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC)) == 0);
 #endif
 }
 
+void map_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
+    map_memory_of_vm_with_access(vm, mapping, false);
+}
+
+void map_read_only_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
+    map_memory_of_vm_with_access(vm, mapping, true);
+}
+
 void unmap_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
     size_t slot;
     for(slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot)
-        if(vm->mappings[slot].guest_address == mapping->guest_address)
+        if(vm->mappings[slot].length > 0 && vm->mappings[slot].guest_address == mapping->guest_address)
             break;
+    assert(slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]));
     vm->mappings[slot].length = 0;
+    __atomic_add_fetch(&vm->memory_generation, 1, __ATOMIC_RELEASE);
 #ifdef __linux__
+    unregister_lazy_memory_of_vm(vm, mapping);
     struct kvm_userspace_memory_region memreg;
     memreg.slot = (uint32_t)slot;
     memreg.flags = 0;
@@ -88,155 +290,61 @@ void unmap_memory_of_vm(struct vm* vm, struct host_to_guest_mapping* mapping) {
 }
 
 bool resolve_address_of_vm(struct vm* vm, uint64_t guest_address, void** host_address, uint64_t length) {
-    size_t number_of_mappings = sizeof(vm->mappings) / sizeof(vm->mappings[0]);
-    for(size_t slot = 0; slot < number_of_mappings; ++slot)
-        if(vm->mappings[slot].length > 0 && (slot + 1 == number_of_mappings || guest_address < vm->mappings[slot + 1].guest_address)) {
-            uint64_t offset = guest_address - vm->mappings[slot].guest_address;
-            if(offset + length > vm->mappings[slot].length)
-                return false;
-            *host_address = (void*)(offset + (uint64_t)vm->mappings[slot].host_address);
-            return true;
-        }
+    for(size_t slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot) {
+        // Slots are not sorted as page tables and buffers come and go at runtime
+        uint64_t offset = guest_address - vm->mappings[slot].guest_address;
+        if(guest_address < vm->mappings[slot].guest_address || offset >= vm->mappings[slot].length)
+            continue;
+        if(offset + length > vm->mappings[slot].length)
+            return false;
+        *host_address = (void*)(offset + (uint64_t)vm->mappings[slot].host_address);
+        return true;
+    }
     return false;
 }
 
-#define MAPPING_LEVELS_LOOP \
-    uint64_t end_virtual_address; \
-    if(mapping_index + 1 < number_of_mappings) \
-        end_virtual_address = mappings[mapping_index + 1].virtual_address; \
-    else \
-        end_virtual_address = 1UL << (GUEST_ENTRIES_PER_PAGE_SHIFT * GUEST_PAGE_TABLE_LEVELS + GUEST_PAGE_TABLE_ENTRY_SHIFT); \
-    if(mapping->flags == MAPPING_GAP) \
-        continue; \
-    uint64_t gap_start_entry_index = 0, gap_end_entry_index = 0; \
-    for(size_t parent_level = GUEST_PAGE_TABLE_LEVELS; parent_level > 0; --parent_level) { \
-        size_t level = parent_level - 1; \
-        uint64_t start_entry_index = mapping->virtual_address / level_page_size[level]; \
-        uint64_t end_entry_index = (end_virtual_address + level_page_size[level] - 1) / level_page_size[level]; \
-        uint64_t real_start_entry_index = start_entry_index; \
-        if(start_entry_index < level_entry_index[level]) \
-            start_entry_index = level_entry_index[level]; \
-        if(gap_end_entry_index < start_entry_index) \
-            gap_start_entry_index = gap_end_entry_index = start_entry_index; \
-        else if(gap_start_entry_index > end_entry_index) \
-            gap_start_entry_index = gap_end_entry_index = end_entry_index; \
-        if(gap_end_entry_index < gap_start_entry_index) \
-            gap_end_entry_index = gap_start_entry_index; \
-        uint64_t leaves_start_entry_index = (mapping->virtual_address + level_page_size[level] - 1) / level_page_size[level]; \
-        uint64_t leaves_end_entry_index = end_virtual_address / level_page_size[level]; \
-        if(level > GUEST_HUGE_PAGE_TABLE_LEVELS) \
-            leaves_end_entry_index = leaves_start_entry_index;
-
-#define MAPPING_LEVELS_LOOP_END \
-        level_number_of_entries[level] += (gap_start_entry_index - start_entry_index) + (end_entry_index - gap_end_entry_index); \
-        level_entry_index[level] = end_entry_index; \
-        gap_start_entry_index = leaves_start_entry_index * GUEST_ENTRIES_PER_PAGE; \
-        gap_end_entry_index = leaves_end_entry_index * GUEST_ENTRIES_PER_PAGE; \
-    }
+struct host_to_guest_mapping* get_memory_of_vm(struct vm* vm, uint64_t guest_address) {
+    for(size_t slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot)
+        if(guest_address >= vm->mappings[slot].guest_address && guest_address - vm->mappings[slot].guest_address < vm->mappings[slot].length)
+            return &vm->mappings[slot];
+    return NULL;
+}
 
-#define WRITE_ENTRY { \
-    bool is_leaf = leaves_start_entry_index <= entry_index && entry_index < leaves_end_entry_index; \
-    assert(level > 0 || is_leaf); \
-    uint64_t parent_relative_entry_index = (entry_index < parent_leaves_start_entry_index) \
-        ? entry_index - parent_start_entry_index \
-        : entry_index - parent_leaves_start_entry_index; \
-    uint64_t relative_entry_index = entry_index - real_start_entry_index; \
-    entries[parent_relative_entry_index] = is_leaf \
-        ? leaf_proto_entry | (relative_entry_index * level_page_size[level] + mapping->physical_address) \
-        : branch_proto_entry | ((relative_entry_index + level_number_of_entries[level]) * GUEST_PAGE_SIZE + level_physical_address[level - 1]); \
-}
-
-void create_page_table(struct host_to_guest_mapping* page_table, uint64_t number_of_mappings, struct guest_internal_mapping mappings[number_of_mappings]) {
-    assert(number_of_mappings > 0);
-    uint64_t level_physical_address[GUEST_PAGE_TABLE_LEVELS];
-    uint64_t level_page_size[GUEST_PAGE_TABLE_LEVELS];
-    uint64_t level_number_of_entries[GUEST_PAGE_TABLE_LEVELS];
-    uint64_t level_entry_index[GUEST_PAGE_TABLE_LEVELS];
-    for(size_t level = 0; level < GUEST_PAGE_TABLE_LEVELS; ++level) {
-        level_page_size[level] = 1UL << (GUEST_ENTRIES_PER_PAGE_SHIFT * (level + 1) + GUEST_PAGE_TABLE_ENTRY_SHIFT);
-        level_number_of_entries[level] = 0;
-        level_entry_index[level] = 0;
-    }
-    for(size_t mapping_index = 0; mapping_index < number_of_mappings; ++mapping_index) {
-        struct guest_internal_mapping* mapping = &mappings[mapping_index];
-        if(mapping_index == 0)
-            assert(mapping->virtual_address == 0);
-        else {
-            assert(mapping->virtual_address == mapping->virtual_address / GUEST_PAGE_SIZE * GUEST_PAGE_SIZE);
-            struct guest_internal_mapping* prev_mapping = &mappings[mapping_index - 1];
-            assert(prev_mapping->flags != MAPPING_GAP || mapping->flags != MAPPING_GAP);
-            assert(prev_mapping->virtual_address != mapping->virtual_address);
-            if(prev_mapping->flags != MAPPING_GAP && mapping->flags != MAPPING_GAP) {
-                uint64_t prev_end_physical_address = prev_mapping->physical_address + (mapping->virtual_address - prev_mapping->virtual_address);
-                assert(prev_end_physical_address != mapping->physical_address || prev_mapping->flags != mapping->flags);
+uint64_t find_free_guest_address_of_vm(struct vm* vm, uint64_t length) {
+    // First fit: move past every slot which overlaps the candidate until none does
+    uint64_t guest_address = 0;
+    bool overlaps = true;
+    while(overlaps) {
+        overlaps = false;
+        for(size_t slot = 0; slot < sizeof(vm->mappings) / sizeof(vm->mappings[0]); ++slot) {
+            struct host_to_guest_mapping* mapping = &vm->mappings[slot];
+            if(mapping->length > 0 && guest_address < mapping->guest_address + mapping->length && mapping->guest_address < guest_address + length) {
+                guest_address = (mapping->guest_address + mapping->length + GUEST_HUGE_PAGE_SIZE - 1) / GUEST_HUGE_PAGE_SIZE * GUEST_HUGE_PAGE_SIZE;
+                overlaps = true;
             }
         }
-        MAPPING_LEVELS_LOOP
-            (void)real_start_entry_index;
-        MAPPING_LEVELS_LOOP_END
-    }
-    page_table->length = 0;
-    for(size_t parent_level = GUEST_PAGE_TABLE_LEVELS; parent_level > 0; --parent_level) {
-        size_t level = parent_level - 1;
-        level_physical_address[level] = page_table->guest_address + page_table->length;
-        page_table->length += ((parent_level == GUEST_PAGE_TABLE_LEVELS) ? 1 : level_number_of_entries[parent_level]) * GUEST_PAGE_SIZE;
-    }
-    for(size_t level = 0; level < GUEST_PAGE_TABLE_LEVELS; ++level) {
-        level_number_of_entries[level] = 0;
-        level_entry_index[level] = 0;
-    }
-    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
-    page_table->length = (page_table->length + host_page_size - 1) / host_page_size * host_page_size;
-    page_table->host_address = valloc(page_table->length);
-    assert(page_table->host_address);
-    uint64_t branch_proto_entry;
-#ifdef __x86_64__
-    branch_proto_entry = PT_PRE | PT_RW;
-#elif __aarch64__
-    branch_proto_entry = PT_ISH | PT_ACC | PT_NOT_LEAF | PT_PRE;
-#endif
-    for(size_t mapping_index = 0; mapping_index < number_of_mappings; ++mapping_index) {
-        struct guest_internal_mapping* mapping = &mappings[mapping_index];
-        uint64_t mapping_proto_entry = 0;
-#ifdef __x86_64__
-        if((mapping->flags & MAPPING_READABLE) != 0)
-            mapping_proto_entry |= PT_PRE;
-        if((mapping->flags & MAPPING_WRITABLE) != 0)
-            mapping_proto_entry |= PT_RW;
-        if((mapping->flags & MAPPING_EXECUTABLE) == 0)
-            mapping_proto_entry |= PT_NX;
-#elif __aarch64__
-        if((mapping->flags & MAPPING_READABLE) != 0)
-            mapping_proto_entry |= PT_ISH | PT_ACC | PT_NOT_LEAF | PT_PRE;
-        if((mapping->flags & MAPPING_WRITABLE) == 0)
-            mapping_proto_entry |= PT_RO;
-        if((mapping->flags & MAPPING_EXECUTABLE) == 0)
-            mapping_proto_entry |= PT_NX;
-#endif
-        uint64_t parent_start_entry_index = 0, parent_leaves_start_entry_index = 0;
-        uint64_t* entries = (uint64_t*)(level_physical_address[GUEST_PAGE_TABLE_LEVELS - 1] - page_table->guest_address + (uint64_t)page_table->host_address);
-        MAPPING_LEVELS_LOOP
-            uint64_t leaf_proto_entry = mapping_proto_entry;
-            if(level > 0)
-#ifdef __x86_64__
-                leaf_proto_entry |= PT_LEAF;
-#elif __aarch64__
-                leaf_proto_entry &= ~PT_NOT_LEAF;
-#endif
-            for(uint64_t entry_index = start_entry_index; entry_index < gap_start_entry_index; ++entry_index)
-                WRITE_ENTRY
-            for(uint64_t entry_index = gap_end_entry_index; entry_index < end_entry_index; ++entry_index)
-                WRITE_ENTRY
-            parent_start_entry_index = real_start_entry_index * GUEST_ENTRIES_PER_PAGE;
-            parent_leaves_start_entry_index = leaves_start_entry_index * GUEST_ENTRIES_PER_PAGE;
-            uint64_t page_offset = (level_number_of_entries[level] + real_start_entry_index - start_entry_index) * GUEST_PAGE_SIZE;
-            if(level > 0)
-                entries = (uint64_t*)(page_offset + level_physical_address[level - 1] - page_table->guest_address + (uint64_t)page_table->host_address);
-        MAPPING_LEVELS_LOOP_END
     }
+    return guest_address;
 }
 
-bool resolve_address_using_page_table(struct host_to_guest_mapping* page_table, bool write_access, uint64_t virtual_address, uint64_t* physical_address) {
-    *physical_address = page_table->guest_address;
-    return walk_page_table(write_access, (uint64_t)page_table->host_address - (uint64_t)page_table->guest_address, virtual_address, physical_address);
+void discard_memory_of_vm(struct vm* vm, uint64_t guest_address, uint64_t length) {
+    struct host_to_guest_mapping* mapping = get_memory_of_vm(vm, guest_address);
+    assert(mapping && guest_address + length <= mapping->guest_address + mapping->length);
+    // Only host pages which are covered entirely can be released
+    uint64_t host_page_size = (uint64_t)sysconf(_SC_PAGESIZE);
+    uint64_t host_address = (uint64_t)mapping->host_address + (guest_address - mapping->guest_address);
+    uint64_t start = (host_address + host_page_size - 1) / host_page_size * host_page_size;
+    uint64_t end = (host_address + length) / host_page_size * host_page_size;
+    if(start >= end)
+        return;
+#ifdef __linux__
+    // KVM zaps its stage 2 translations through the MMU notifier, the next touch faults in a zero page
+    assert(madvise((void*)start, end - start, MADV_DONTNEED) == 0);
+#elif __APPLE__
+    // Replace the pages by fresh ones, HVF has to let go of the old ones first
+    uint64_t start_guest_address = start - (uint64_t)mapping->host_address + mapping->guest_address;
+    assert(hv_vm_unmap(start_guest_address, end - start) == 0);
+    assert(mmap((void*)start, end - start, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE | MAP_FIXED, -1, 0) == (void*)start);
+    assert(hv_vm_map((void*)start, start_guest_address, end - start, HV_MEMORY_READ | HV_MEMORY_WRITE | HV_MEMORY_EXEC) == 0);
+#endif
 }